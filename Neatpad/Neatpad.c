@@ -264,15 +264,21 @@ UINT CommandHandler(HWND hwnd, UINT nCtrlId, UINT nCtrlCode, HWND hwndFrom)
 		return 0;
 
 	case IDM_FILE_SAVE:
-		MessageBox(hwnd, _T("Not implemented"), APP_TITLE, MB_ICONINFORMATION);
-		return 0;
+
+		// an untitled document needs a filename first
+		if(g_szFileTitle[0])
+		{
+			DoSaveFile(hwnd, g_szFileName, g_szFileTitle);
+			return 0;
+		}
+
+		// fall through
 
 	case IDM_FILE_SAVEAS:
 
-		// does nothing yet
 		if(ShowSaveFileDlg(hwnd, g_szFileName, g_szFileTitle))
 		{
-			MessageBox(hwnd, _T("Not implemented"), APP_TITLE, MB_ICONINFORMATION);
+			DoSaveFile(hwnd, g_szFileName, g_szFileTitle);
 		}
 
 		return 0;
@@ -295,6 +295,24 @@ BOOL DoOpenFile(HWND hwndMain, TCHAR *szFileName, TCHAR *szFileTitle)
 	}
 }
 
+//
+//	Save the current document to the specified file
+//
+BOOL DoSaveFile(HWND hwndMain, TCHAR *szFileName, TCHAR *szFileTitle)
+{
+	if(TextView_SaveFile(g_hwndTextView, szFileName))
+	{
+		SetWindowFileName(hwndMain, szFileTitle, FALSE);
+		g_fFileChanged   = FALSE;
+		return TRUE;
+	}
+	else
+	{
+		FmtErrorMsg(hwndMain, MB_OK|MB_ICONWARNING, GetLastError(), _T("Error saving \'%s\'\r\n\r\n"), szFileName);
+		return FALSE;
+	}
+}
+
 void NeatpadOpenFile(HWND hwnd, TCHAR *szFile)
 {
 	TCHAR *name;
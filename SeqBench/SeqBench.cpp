@@ -0,0 +1,1070 @@
+//
+//	MODULE:		SeqBench.cpp
+//
+//	PURPOSE:	Micro-benchmarks for the sequence (piece-table) class
+//
+//	NOTES:		Drives a sequence through typical editing workloads and
+//				reports, for each one, the average time per operation, the
+//				number of spans allocated and the memory used. Each workload
+//				runs in a process of its own (started with the hidden switch
+//				'-run n'), so its peak memory isn't hidden by that of a bigger
+//				workload run before it. The line-break
+//				scanner is then timed over each text encoding, once with
+//				every kernel (scalar/SSE2/AVX2) that the processor supports
+//
+//				usage: SeqBench [scale] [render-size-Mb]
+//
+//				'scale' multiplies the number of operations in each workload
+//				(default 1), and the render workload uses a document of
+//				'render-size-Mb' megabytes (default 1024). On 64bit builds
+//				(the "Win32 Release x64" configuration) a sparse 8Gb file is
+//				also opened and edited, to check that file sizes and edit
+//				lengths over 4Gb survive intact, and a sparse 6Gb file is
+//				opened as a TextDocument to check that its last line is found
+//				at the very end of the file. Every build also checks that the
+//				threads which index a TextDocument find exactly the lines that
+//				a serial scan does, over random and malformed text, and still
+//				do so when the text is edited while they are at work
+//
+
+#define STRICT
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+#include <winioctl.h>
+#include <psapi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "..\TextView\sequence.h"
+#include "..\TextView\TextView.h"
+#include "..\TextView\TextDocument.h"
+#include "..\TextView\linescan.h"
+
+typedef size_w (*BENCHPROC)(sequence &seq);
+
+static ULONG		g_nScale	  = 1;
+static ULONG		g_nRenderSize = 1024;
+static int			g_nWorkload	  = -1;
+static DWORD		g_dwSeed;
+static LARGE_INTEGER g_qpcStart;
+static LARGE_INTEGER g_qpcStop;
+
+// text that is 'typed' or pasted into the documents
+static const char	g_szSample[] =
+	"The quick brown fox jumps over the lazy dog.\r\n"
+	"Pack my box with five dozen liquor jugs!\r\n";
+
+#define SAMPLE_LEN	(sizeof(g_szSample) - 1)
+
+// text for the line-scanning benchmark, with some non-ASCII characters
+static const WCHAR	g_szSampleW[] =
+	L"The quick brown fox jumps over the lazy dog.\r\n"
+	L"Zw\x00f6lf Boxk\x00e4mpfer jagen Viktor quer \x00fcber den gro\x00dfen Sylter Deich.\r\n"
+	L"Pack my box with five dozen liquor jugs!\r\n";
+
+#define SAMPLEW_LEN	(sizeof(g_szSampleW) / sizeof(WCHAR) - 1)
+
+//
+//	Repeatable pseudo-random numbers (xorshift), so that every
+//	run of the benchmark performs exactly the same edits
+//
+static DWORD Random32()
+{
+	g_dwSeed ^= g_dwSeed << 13;
+	g_dwSeed ^= g_dwSeed >> 17;
+	g_dwSeed ^= g_dwSeed << 5;
+	return g_dwSeed;
+}
+
+static size_w Random(size_w range)
+{
+	unsigned __int64 r = (unsigned __int64)Random32() << 32 | Random32();
+
+	return range ? (size_w)(r % range) : 0;
+}
+
+//
+//	Workloads call StartTimer once their setup is complete, so that
+//	only the operations being measured are timed
+//
+static void StartTimer()
+{
+	QueryPerformanceCounter(&g_qpcStart);
+}
+
+static void StopTimer()
+{
+	QueryPerformanceCounter(&g_qpcStop);
+}
+
+//
+//	Fill a sequence with 'length' bytes of sample text
+//
+static bool InitDocument(sequence &seq, size_w length)
+{
+	seqchar *buf = new seqchar[(size_t)length];
+	bool	 success;
+
+	for(size_w i = 0; i < length; i++)
+		buf[i] = g_szSample[i % SAMPLE_LEN];
+
+	success = seq.init(buf, (size_t)length);
+
+	delete[] buf;
+	return success;
+}
+
+//
+//	Sequential typing at a cursor in the middle of a document. Every
+//	keystroke extends the previous span (see sequence::can_optimize)
+//
+static size_w BenchTyping(sequence &seq)
+{
+	size_w count = 1000000 * g_nScale;
+	size_w pos;
+
+	InitDocument(seq, 0x100000);
+	pos = seq.size() / 2;
+
+	StartTimer();
+
+	for(size_w i = 0; i < count; i++)
+		seq.insert(pos++, (seqchar)g_szSample[i % SAMPLE_LEN]);
+
+	return count;
+}
+
+//
+//	Short inserts and deletions scattered randomly through a document
+//
+static size_w BenchRandomEdit(sequence &seq)
+{
+	size_w count = 200000 * g_nScale;
+
+	InitDocument(seq, 0x100000);
+
+	StartTimer();
+
+	for(size_w i = 0; i < count; i++)
+	{
+		size_w len = 1 + Random(8);
+
+		if(i & 1)
+			seq.insert(Random(seq.size() + 1), (seqchar *)g_szSample, len);
+		else
+			seq.erase(Random(seq.size() - len), len);
+	}
+
+	return count;
+}
+
+//
+//	Type a run of text and then delete it all again with backspace
+//
+static size_w BenchBackspace(sequence &seq)
+{
+	size_w count = 200000 * g_nScale;
+	size_w pos;
+	size_w i;
+
+	InitDocument(seq, 0x100000);
+	pos = seq.size() / 2;
+
+	StartTimer();
+
+	for(i = 0; i < count; i++)
+		seq.insert(pos++, (seqchar)g_szSample[i % SAMPLE_LEN]);
+
+	for(i = 0; i < count; i++)
+		seq.erase(--pos, 1);
+
+	return count * 2;
+}
+
+//
+//	Paste a large block of text at random places in a document
+//
+static size_w BenchPaste(sequence &seq)
+{
+	size_w	 count  = 16 * g_nScale;
+	size_t	 length = 0x1000000;
+	seqchar *buf	= new seqchar[length];
+	size_t	 i;
+
+	for(i = 0; i < length; i++)
+		buf[i] = g_szSample[i % SAMPLE_LEN];
+
+	InitDocument(seq, 0x100000);
+
+	StartTimer();
+
+	for(i = 0; i < count; i++)
+		seq.insert(Random(seq.size() + 1), buf, length);
+
+	StopTimer();
+
+	delete[] buf;
+	return count;
+}
+
+//
+//	Overwrite short runs of text at random places
+//
+static size_w BenchReplace(sequence &seq)
+{
+	size_w count = 200000 * g_nScale;
+
+	InitDocument(seq, 0x100000);
+
+	StartTimer();
+
+	for(size_w i = 0; i < count; i++)
+	{
+		size_w len = 1 + Random(8);
+		seq.replace(Random(seq.size() - 8), (seqchar *)g_szSample, len, 1 + Random(8));
+	}
+
+	return count;
+}
+
+//
+//	Undo a long history of edits, then redo it all
+//
+static size_w BenchUndoRedo(sequence &seq)
+{
+	size_w count = 100000 * g_nScale;
+	size_w i;
+
+	InitDocument(seq, 0x100000);
+
+	for(i = 0; i < count; i++)
+	{
+		if(i & 1)
+			seq.insert(Random(seq.size() + 1), (seqchar *)g_szSample, 1 + Random(8));
+		else
+			seq.erase(Random(seq.size() - 8), 1 + Random(8));
+	}
+
+	StartTimer();
+
+	for(i = 0; seq.undo(); i++)
+		;
+
+	while(seq.redo())
+		i++;
+
+	return i;
+}
+
+//
+//	Render the whole of a large, fragmented document one megabyte at a
+//	time. The document is a temporary file, mapped just as an opened file
+//	would be, with many small edits spread through it
+//
+static size_w BenchRender(sequence &seq)
+{
+	TCHAR	 szPath[MAX_PATH];
+	TCHAR	 szFile[MAX_PATH];
+	HANDLE	 hFile;
+	seqchar *buf = new seqchar[0x100000];
+	DWORD	 written;
+	size_w	 count = 0;
+	size_w	 i;
+
+	for(i = 0; i < 0x100000; i++)
+		buf[i] = g_szSample[i % SAMPLE_LEN];
+
+	GetTempPath(MAX_PATH, szPath);
+	GetTempFileName(szPath, TEXT("sqb"), 0, szFile);
+
+	// the file is deleted once the sequence has finished with it
+	hFile = CreateFile(szFile, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_DELETE, 0,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY|FILE_FLAG_DELETE_ON_CLOSE, 0);
+
+	if(hFile == INVALID_HANDLE_VALUE)
+	{
+		delete[] buf;
+		return 0;
+	}
+
+	for(i = 0; i < g_nRenderSize; i++)
+	{
+		if(!WriteFile(hFile, buf, 0x100000, &written, 0) || written != 0x100000)
+			break;
+	}
+
+	if(i == g_nRenderSize && seq.open(hFile))
+	{
+		for(i = 0; i < 100000 * g_nScale; i++)
+			seq.insert(Random(seq.size() + 1), (seqchar)'*');
+
+		StartTimer();
+
+		for(i = 0; i < seq.size(); i += 0x100000, count++)
+			seq.render(i, buf, 0x100000);
+	}
+
+	CloseHandle(hFile);
+	delete[] buf;
+	return count;
+}
+
+//
+//	Open a sparse 8Gb file and erase a range longer than 4Gb from it, checking
+//	that neither the file's size nor the erase length is truncated to 32 bits
+//	along the way - the low 32 bits of the file's size are zero, so it looks
+//	empty if they are all that is read. Each check counts as one operation;
+//	any failure reports the whole workload as failed
+//
+static size_w BenchLargeFile(sequence &seq)
+{
+	const size_w FILESIZE	= (size_w)8 << 30;
+	const size_w MARKER		= (size_w)5 << 30;
+	const size_w ERASELEN	= ((size_w)4 << 30) + 0x1000;
+
+	TCHAR	szPath[MAX_PATH];
+	TCHAR	szFile[MAX_PATH];
+	HANDLE	hFile;
+	DWORD	written;
+	LONG	offhi;
+	seqchar ch = 0;
+	size_w	count = 0;
+
+	GetTempPath(MAX_PATH, szPath);
+	GetTempFileName(szPath, TEXT("sqb"), 0, szFile);
+
+	hFile = CreateFile(szFile, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_DELETE, 0,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY|FILE_FLAG_DELETE_ON_CLOSE, 0);
+
+	if(hFile == INVALID_HANDLE_VALUE)
+		return 0;
+
+	// only the marker is ever written, so the file takes no real disk space
+	DeviceIoControl(hFile, FSCTL_SET_SPARSE, 0, 0, 0, 0, &written, 0);
+
+	offhi = (LONG)(MARKER >> 32);
+	SetFilePointer(hFile, (LONG)MARKER, &offhi, FILE_BEGIN);
+	WriteFile(hFile, "X", 1, &written, 0);
+
+	offhi = (LONG)(FILESIZE >> 32);
+	SetFilePointer(hFile, (LONG)FILESIZE, &offhi, FILE_BEGIN);
+
+	if(SetEndOfFile(hFile) && seq.open(hFile))
+	{
+		StartTimer();
+
+		if(seq.size() == FILESIZE)
+			count++;
+
+		if(seq.render(MARKER, &ch, 1) == 1 && ch == 'X')
+			count++;
+
+		if(seq.erase(1, ERASELEN) && seq.size() == FILESIZE - ERASELEN)
+			count++;
+
+		if(seq.render(MARKER - ERASELEN, &ch, 1) == 1 && ch == 'X')
+			count++;
+
+		if(seq.undo() && seq.size() == FILESIZE)
+			count++;
+
+		StopTimer();
+	}
+
+	CloseHandle(hFile);
+	return count == 5 ? count : 0;
+}
+
+//
+//	Open a sparse 6Gb file as a TextDocument, wait for its lines to be
+//	counted, and go to the last one - which must end exactly where the file
+//	does, and hold the text written there. Each check counts as one
+//	operation; any failure reports the whole workload as failed
+//
+static size_w BenchLargeDocument(sequence &)
+{
+	const size_w FILESIZE	= (size_w)6 << 30;
+	const char	 szTail[]	= "\r\nlast line";
+	const size_w TAILLEN	= sizeof(szTail) - 1;
+
+	TextDocument *doc;
+	TCHAR	szPath[MAX_PATH];
+	TCHAR	szFile[MAX_PATH];
+	TCHAR	szLine[16];
+	HANDLE	hFile;
+	DWORD	written;
+	LONG	offhi;
+	ULONG	lineno;
+	size_w	off_chars, len_chars;
+	size_w	off_bytes, len_bytes;
+	size_w	count = 0;
+
+	GetTempPath(MAX_PATH, szPath);
+	GetTempFileName(szPath, TEXT("sqb"), 0, szFile);
+
+	hFile = CreateFile(szFile, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_DELETE, 0,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY|FILE_FLAG_DELETE_ON_CLOSE, 0);
+
+	if(hFile == INVALID_HANDLE_VALUE)
+		return 0;
+
+	// everything before the last line is a hole, so it reads as zeros
+	DeviceIoControl(hFile, FSCTL_SET_SPARSE, 0, 0, 0, 0, &written, 0);
+
+	offhi = (LONG)((FILESIZE - TAILLEN) >> 32);
+	SetFilePointer(hFile, (LONG)(FILESIZE - TAILLEN), &offhi, FILE_BEGIN);
+
+	if(!WriteFile(hFile, szTail, (DWORD)TAILLEN, &written, 0) || written != TAILLEN || (doc = new TextDocument) == 0)
+	{
+		CloseHandle(hFile);
+		return 0;
+	}
+
+	// the document closes the file-handle, and the file goes with its mapping
+	if(doc->init(hFile))
+	{
+		while(!doc->poll_linebuffer())
+			Sleep(10);
+
+		StopTimer();
+
+		if(doc->size() == FILESIZE)
+			count++;
+
+		lineno = doc->linecount() - 1;
+
+		if(doc->lineinfo_from_lineno(lineno, &off_chars, &len_chars, &off_bytes, &len_bytes) &&
+		   off_bytes + len_bytes == FILESIZE && len_bytes == TAILLEN - 2)
+			count++;
+
+		if(doc->getline(lineno, szLine, 15, &off_chars) == TAILLEN - 2)
+		{
+			szLine[TAILLEN - 2] = '\0';
+
+			if(lstrcmp(szLine, TEXT("last line")) == 0)
+				count++;
+		}
+	}
+
+	delete doc;
+	return count == 3 ? count : 0;
+}
+
+//
+//	Append one character of random text in the specified format - mostly
+//	letters, but also every kind of line-break, long runs that need hard
+//	line-breaks, and (outside ASCII) sequences that don't decode
+//
+static void AppendRandomText(int format, std::vector<BYTE> &buf)
+{
+	static const WCHAR breaks[] = { '\r', '\n', 0x0b, 0x0c, 0x85, 0x2028, 0x2029 };
+
+	WCHAR	text[4];
+	size_t	len = 1;
+	size_t	i;
+	DWORD	r	= (DWORD)Random(32);
+
+	if(r < 6)
+	{
+		text[0] = breaks[r < 2 ? r : Random(sizeof(breaks) / sizeof(breaks[0]))];
+	}
+	else if(r == 6)
+	{
+		text[0] = '\r';
+		text[1] = '\n';
+		len		= 2;
+	}
+	else if(r == 7)
+	{
+		// a line too long for the hard-break limit (128 characters)
+		for(i = (size_t)Random(400); i > 0; i--)
+		{
+			if(format == NCP_UTF16BE)
+				buf.push_back(0);
+
+			buf.push_back((BYTE)('a' + Random(26)));
+
+			if(format == NCP_UTF16)
+				buf.push_back(0);
+		}
+		return;
+	}
+	else if(r == 8 && format == NCP_UTF8)
+	{
+		// stray continuation, truncated lead, overlong nul, or a byte never used
+		static const BYTE bad[][3] = { { 1, 0x80 }, { 2, 0xe2, 0x80 }, { 2, 0xc0, 0x80 }, { 1, 0xff } };
+		const BYTE *b = bad[Random(4)];
+
+		buf.insert(buf.end(), b + 1, b + 1 + b[0]);
+		return;
+	}
+	else if(r == 8 && format != NCP_ASCII)
+	{
+		// a lone surrogate
+		text[0] = (WCHAR)(0xd800 + Random(0x800));
+	}
+	else if(r == 9)
+	{
+		text[0] = (WCHAR)(format == NCP_ASCII ? 0x80 + Random(0x80) : 0xa0 + Random(0x2000));
+	}
+	else
+	{
+		text[0] = (WCHAR)('a' + Random(26));
+	}
+
+	for(i = 0; i < len; i++)
+	{
+		WCHAR ch = text[i];
+
+		switch(format)
+		{
+		case NCP_ASCII:
+			buf.push_back((BYTE)ch);
+			break;
+
+		case NCP_UTF8:
+			if(ch < 0x80)
+			{
+				buf.push_back((BYTE)ch);
+			}
+			else if(ch < 0x800)
+			{
+				buf.push_back((BYTE)(0xc0 | ch >> 6));
+				buf.push_back((BYTE)(0x80 | ch & 0x3f));
+			}
+			else
+			{
+				buf.push_back((BYTE)(0xe0 | ch >> 12));
+				buf.push_back((BYTE)(0x80 | ch >> 6 & 0x3f));
+				buf.push_back((BYTE)(0x80 | ch & 0x3f));
+			}
+			break;
+
+		case NCP_UTF16:
+			buf.push_back((BYTE)ch);
+			buf.push_back((BYTE)(ch >> 8));
+			break;
+
+		case NCP_UTF16BE:
+			buf.push_back((BYTE)(ch >> 8));
+			buf.push_back((BYTE)ch);
+			break;
+		}
+	}
+}
+
+//
+//	Create a temporary file holding 'length' bytes (or so) of random text in
+//	the specified format, starting with the format's byte-order mark. The
+//	file is deleted when the returned handle is closed
+//
+static HANDLE CreateRandomFile(int format, size_t length)
+{
+	std::vector<BYTE> buf;
+	TCHAR	szPath[MAX_PATH];
+	TCHAR	szFile[MAX_PATH];
+	HANDLE	hFile;
+	DWORD	written;
+
+	buf.reserve(length + 0x1000);
+
+	switch(format)
+	{
+	case NCP_UTF8:	  buf.push_back(0xef); buf.push_back(0xbb); buf.push_back(0xbf); break;
+	case NCP_UTF16:	  buf.push_back(0xff); buf.push_back(0xfe); break;
+	case NCP_UTF16BE: buf.push_back(0xfe); buf.push_back(0xff); break;
+	}
+
+	while(buf.size() < length)
+		AppendRandomText(format, buf);
+
+	// UTF-16 text may be cut off half-way through a character
+	if(format != NCP_ASCII && format != NCP_UTF8 && Random(2))
+		buf.push_back('x');
+
+	GetTempPath(MAX_PATH, szPath);
+	GetTempFileName(szPath, TEXT("sqb"), 0, szFile);
+
+	hFile = CreateFile(szFile, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_DELETE, 0,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY|FILE_FLAG_DELETE_ON_CLOSE, 0);
+
+	if(hFile == INVALID_HANDLE_VALUE)
+		return 0;
+
+	if(!WriteFile(hFile, &buf[0], (DWORD)buf.size(), &written, 0) || written != buf.size())
+	{
+		CloseHandle(hFile);
+		return 0;
+	}
+
+	return hFile;
+}
+
+//
+//	Record the position and length of every line in a document
+//
+static void GetLines(TextDocument *doc, std::vector<size_w> &lines)
+{
+	size_w off_chars, len_chars;
+	size_w off_bytes, len_bytes;
+	ULONG  count = doc->linecount();
+
+	lines.clear();
+
+	for(ULONG i = 0; i < count; i++)
+	{
+		if(!doc->lineinfo_from_lineno(i, &off_chars, &len_chars, &off_bytes, &len_bytes))
+			off_chars = len_chars = off_bytes = len_bytes = (size_w)-1;
+
+		lines.push_back(off_chars);
+		lines.push_back(len_chars);
+		lines.push_back(off_bytes);
+		lines.push_back(len_bytes);
+	}
+}
+
+//
+//	Open random (and partly malformed) files in each text format, and check
+//	that the lines found by the background indexing threads, and then by the
+//	foreground threads of TextDocument::init_linebuffer, are exactly those
+//	found by a serial scan of the same document. Each matching index counts
+//	as one operation; any mismatch reports the whole workload as failed
+//
+static size_w BenchIndexThreads(sequence &)
+{
+	static const int formats[] = { NCP_ASCII, NCP_UTF8, NCP_UTF16, NCP_UTF16BE };
+
+	std::vector<size_w> serial;
+	std::vector<size_w> lines;
+	TextDocument *doc;
+	HANDLE	hFile;
+	size_w	count  = 0;
+	size_w	checks = 0;
+	ULONG	i;
+	int		f;
+
+	for(i = 0; i < 4 * g_nScale; i++)
+	{
+		for(f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+		{
+			checks += 2;
+
+			// more than two background ranges, so several threads share the work
+			if((hFile = CreateRandomFile(formats[f], 0x2400000 + (size_t)Random(0x10000))) == 0)
+				return 0;
+
+			if((doc = new TextDocument) == 0)
+			{
+				CloseHandle(hFile);
+				return 0;
+			}
+
+			if(doc->init(hFile) && doc->getformat() == formats[f])
+			{
+				while(!doc->poll_linebuffer())
+					Sleep(1);
+
+				GetLines(doc, lines);
+
+				TextDocument::set_indexthreads(0);
+				doc->init_linebuffer();
+				GetLines(doc, serial);
+				TextDocument::set_indexthreads(MAXIMUM_WAIT_OBJECTS);
+
+				if(lines == serial)
+					count++;
+
+				doc->init_linebuffer();
+				GetLines(doc, lines);
+
+				if(lines == serial)
+					count++;
+			}
+
+			delete doc;
+		}
+	}
+
+	return count == checks ? count : 0;
+}
+
+//
+//	Edit random (and partly malformed) documents all over - ahead of the
+//	indexed lines, just behind them and in ranges the threads are still
+//	working on - for as long as they are being indexed in the background,
+//	then check that the lines they end up with are exactly those found by a
+//	serial scan of the edited document. Each edit counts as one operation;
+//	any mismatch reports the whole workload as failed
+//
+static size_w BenchEditIndexing(sequence &)
+{
+	static const int formats[] = { NCP_ASCII, NCP_UTF16, NCP_UTF8 };
+	static TCHAR szText[]	   = TEXT("ab\r\ncd\ref\ngh\x2028ij\r");
+
+	std::vector<size_w> serial;
+	std::vector<size_w> lines;
+	TextDocument *doc;
+	HANDLE	hFile;
+	size_w	off_chars, len_chars;
+	size_w	off_bytes, len_bytes;
+	size_w	textlen = lstrlen(szText);
+	size_w	doclen;
+	size_w	offset;
+	size_w	pos;
+	size_w	count = 0;
+	ULONG	i;
+	int		f;
+	int		e;
+
+	for(i = 0; i < 2 * g_nScale; i++)
+	{
+		for(f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+		{
+			if((hFile = CreateRandomFile(formats[f], 0x5000000 + (size_t)Random(0x10000))) == 0)
+				return 0;
+
+			if((doc = new TextDocument) == 0)
+			{
+				CloseHandle(hFile);
+				return 0;
+			}
+
+			if(!doc->init(hFile) || doc->getformat() != formats[f])
+			{
+				delete doc;
+				return 0;
+			}
+
+			// edits go at any character offset in ASCII and UTF-16, but only
+			// within the lines indexed so far in UTF-8
+			while(!doc->poll_linebuffer())
+			{
+				for(e = 0; e < 256; e++, count++)
+				{
+					doc->lineinfo_from_lineno(doc->linecount() - 1, &off_chars, &len_chars, &off_bytes, &len_bytes);
+
+					if(formats[f] == NCP_UTF8)
+						doclen = off_chars;
+					else
+						doclen = doc->size() / (formats[f] == NCP_ASCII ? 1 : sizeof(WCHAR)) - 1;
+
+					// most edits go near the end of the indexed lines, which moves
+					// the ranges still to come. Only a few go anywhere at all, so
+					// that not every range is made stale before its lines are in
+					if(Random(4096) == 0)
+						offset = Random(doclen);
+					else
+						offset = off_chars - min(off_chars, (size_w)64) + Random(128);
+
+					offset = min(offset, doclen);
+					pos	   = Random(textlen);
+
+					switch(Random(8))
+					{
+					case 0: case 1: case 2:
+						doc->insert_text(offset, szText + pos, 1 + Random(textlen - pos));
+						break;
+
+					case 3: case 4:
+						doc->erase_text(offset, 1 + Random(min((size_w)16, doclen - offset)));
+						break;
+
+					case 5:
+						doc->replace_text(offset, szText + pos, 1, 1 + Random(min((size_w)4, doclen - offset)));
+						break;
+
+					case 6:
+						doc->Undo(&off_chars, &len_chars);
+						break;
+
+					default:
+						doc->Redo(&off_chars, &len_chars);
+						break;
+					}
+				}
+			}
+
+			GetLines(doc, lines);
+
+			TextDocument::set_indexthreads(0);
+			doc->init_linebuffer();
+			GetLines(doc, serial);
+			TextDocument::set_indexthreads(MAXIMUM_WAIT_OBJECTS);
+
+			delete doc;
+
+			if(lines != serial)
+				return 0;
+		}
+	}
+
+	return count;
+}
+
+//
+//	Fill 'buf' with 'length' bytes of sample text in the specified format,
+//	stopping short rather than splitting a character
+//
+static size_t InitScanText(int format, BYTE *buf, size_t length)
+{
+	BYTE   line[0x400];
+	size_t linelen;
+	size_t i;
+	size_t pos;
+
+	switch(format)
+	{
+	case NCP_ASCII:
+		linelen = WideCharToMultiByte(CP_ACP, 0, g_szSampleW, SAMPLEW_LEN, (char *)line, sizeof(line), 0, 0);
+		break;
+
+	case NCP_UTF8:
+		linelen = WideCharToMultiByte(CP_UTF8, 0, g_szSampleW, SAMPLEW_LEN, (char *)line, sizeof(line), 0, 0);
+		break;
+
+	default:
+		for(i = 0; i < SAMPLEW_LEN; i++)
+		{
+			line[i * 2 + 0] = (BYTE)(format == NCP_UTF16 ? g_szSampleW[i] : g_szSampleW[i] >> 8);
+			line[i * 2 + 1] = (BYTE)(format == NCP_UTF16 ? g_szSampleW[i] >> 8 : g_szSampleW[i]);
+		}
+
+		linelen = SAMPLEW_LEN * 2;
+		break;
+	}
+
+	for(pos = 0; pos + linelen <= length; pos += linelen)
+		memcpy(buf + pos, line, linelen);
+
+	return pos;
+}
+
+//
+//	Find every line-break in a buffer much as TextDocument::scan_line does.
+//	The scanner stops in front of each newline character (so CR/LF counts
+//	twice), which is then stepped over
+//
+static size_w ScanLines(int format, const BYTE *buf, size_t length)
+{
+	size_t unitsize  = (format == NCP_UTF16 || format == NCP_UTF16BE) ? 2 : 1;
+	size_t pos		 = 0;
+	size_t linechars = 0;
+	size_t chars;
+	size_w lines	 = 0;
+
+	while(pos < length)
+	{
+		pos		  += linescan(format, buf + pos, length - pos, 129 - linechars, &chars);
+		linechars += chars;
+
+		if(pos < length)
+		{
+			pos		 += unitsize;
+			linechars = 0;
+			lines++;
+		}
+	}
+
+	return lines;
+}
+
+//
+//	Time the line-scanner over the same amount of text in each encoding,
+//	with every kernel the processor supports, and report it in Gb/s
+//
+static void RunScanBenchmark()
+{
+	static const struct { const char *name; int format; } formats[] =
+	{
+		{ "ascii",		NCP_ASCII	},
+		{ "utf-8",		NCP_UTF8	},
+		{ "utf-16",		NCP_UTF16	},
+		{ "utf-16be",	NCP_UTF16BE },
+	};
+
+	static const char *levels[] = { "scalar", "sse2", "avx2" };
+
+	size_t	length = 0x4000000;
+	BYTE   *buf	   = new BYTE[length];
+	int		maxlevel;
+	size_t	i;
+	int		level;
+
+	maxlevel = linescan_setlevel(LINESCAN_AVX2);
+
+	printf("\n%-16s %10s %14s %10s\n", "scan", "kernel", "breaks", "Gb/s");
+
+	for(i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+	{
+		size_t textlen = InitScanText(formats[i].format, buf, length);
+
+		for(level = LINESCAN_SCALAR; level <= maxlevel; level++)
+		{
+			LARGE_INTEGER freq;
+			size_w		  lines = 0;
+			ULONG		  r;
+
+			linescan_setlevel(level);
+
+			StartTimer();
+
+			for(r = 0; r < 4 * g_nScale; r++)
+				lines = ScanLines(formats[i].format, buf, textlen);
+
+			StopTimer();
+
+			QueryPerformanceFrequency(&freq);
+
+			printf("%-16s %10s %14lu %10.2f\n",
+				formats[i].name,
+				levels[level],
+				(ULONG)lines,
+				(double)textlen * r / 1e9 / 
+					((double)(g_qpcStop.QuadPart - g_qpcStart.QuadPart) / (double)freq.QuadPart)
+				);
+		}
+	}
+
+	linescan_setlevel(maxlevel);
+	delete[] buf;
+}
+
+//
+//	Run one workload against a fresh sequence and print its results
+//
+static void RunBenchmark(const char *szName, BENCHPROC pfnBench)
+{
+	PROCESS_MEMORY_COUNTERS pmc = { sizeof(pmc) };
+	sequence *seq = new sequence;
+	size_t	  spans, spansfree, ranges, rangesfree;
+	SIZE_T	  memstart;
+	size_w	  ops;
+	double	  elapsed;
+
+	GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+	memstart = pmc.PagefileUsage;
+
+	g_dwSeed = 0x12345678;
+	g_qpcStop.QuadPart = 0;
+
+	StartTimer();
+	ops = pfnBench(*seq);
+
+	if(g_qpcStop.QuadPart < g_qpcStart.QuadPart)
+		StopTimer();
+
+	seq->nodestats(&spans, &spansfree, &ranges, &rangesfree);
+	GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+
+	if(ops == 0)
+	{
+		printf("%-16s  (failed)\n", szName);
+	}
+	else
+	{
+		LARGE_INTEGER freq;
+		QueryPerformanceFrequency(&freq);
+
+		elapsed = (double)(g_qpcStop.QuadPart - g_qpcStart.QuadPart) / (double)freq.QuadPart;
+
+		printf("%-16s %10lu %14.1f %10lu %12lu %12lu\n",
+			szName,
+			(ULONG)ops,
+			elapsed * 1e9 / (double)(LONGLONG)ops,
+			(ULONG)spans,
+			(ULONG)((pmc.PagefileUsage - memstart) / 1024),
+			(ULONG)((pmc.PeakPagefileUsage - memstart) / 1024)
+			);
+	}
+
+	delete seq;
+}
+
+//
+//	Run workload number 'nWorkload' in a new instance of the benchmark and
+//	wait for it to print its results. The new process runs only that
+//	workload and then exits
+//
+static void RunWorkload(int nWorkload, const char *szName, BENCHPROC pfnBench)
+{
+	STARTUPINFO			si = { sizeof(si) };
+	PROCESS_INFORMATION pi;
+	TCHAR				szExe[MAX_PATH];
+	TCHAR				szCmd[MAX_PATH + 64];
+
+	// this is the process that was started for the workload
+	if(g_nWorkload != -1)
+	{
+		if(g_nWorkload == nWorkload)
+			RunBenchmark(szName, pfnBench);
+
+		return;
+	}
+
+	GetModuleFileName(0, szExe, MAX_PATH);
+	wsprintf(szCmd, TEXT("\"%s\" %lu %lu -run %d"), szExe, g_nScale, g_nRenderSize, nWorkload);
+
+	// the results go wherever ours do
+	si.dwFlags	  = STARTF_USESTDHANDLES;
+	si.hStdInput  = GetStdHandle(STD_INPUT_HANDLE);
+	si.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+	si.hStdError  = GetStdHandle(STD_ERROR_HANDLE);
+
+	fflush(stdout);
+
+	if(!CreateProcess(0, szCmd, 0, 0, TRUE, 0, 0, 0, &si, &pi))
+	{
+		printf("%-16s  (failed)\n", szName);
+		return;
+	}
+
+	WaitForSingleObject(pi.hProcess, INFINITE);
+	CloseHandle(pi.hThread);
+	CloseHandle(pi.hProcess);
+}
+
+int main(int argc, char *argv[])
+{
+	char szRender[32];
+
+	if(argc > 1)
+		g_nScale = max(1, atoi(argv[1]));
+
+	if(argc > 2)
+		g_nRenderSize = max(1, atoi(argv[2]));
+
+	if(argc > 4 && lstrcmpA(argv[3], "-run") == 0)
+		g_nWorkload = atoi(argv[4]);
+
+	sprintf(szRender, "render %luMb", g_nRenderSize);
+
+	if(g_nWorkload == -1)
+	{
+		printf("%-16s %10s %14s %10s %12s %12s\n",
+			"workload", "ops", "ns/op", "spans", "mem (Kb)", "peak (Kb)");
+	}
+
+	RunWorkload(0, "typing",		BenchTyping);
+	RunWorkload(1, "random edit",	BenchRandomEdit);
+	RunWorkload(2, "backspace",		BenchBackspace);
+	RunWorkload(3, "replace",		BenchReplace);
+	RunWorkload(4, "undo/redo",		BenchUndoRedo);
+	RunWorkload(5, "paste 16Mb",	BenchPaste);
+	RunWorkload(6, szRender,		BenchRender);
+
+	// the whole file is mapped at once, which needs a 64bit process
+	if(sizeof(void *) > 4)
+	{
+		RunWorkload(7, "open 8Gb",		BenchLargeFile);
+		RunWorkload(8, "document 6Gb",	BenchLargeDocument);
+	}
+
+	RunWorkload(9, "index threads",	BenchIndexThreads);
+	RunWorkload(10, "edit indexing",	BenchEditIndexing);
+
+	if(g_nWorkload == -1)
+		RunScanBenchmark();
+
+	return 0;
+}
@@ -13,6 +13,73 @@
 #include "TextDocument.h"
 #include "TextView.h"
 #include "Unicode.h"
+#include "linescan.h"
+
+// lines longer than this many characters are broken in two
+#define HARDBREAK_LENGTH	128
+
+// smallest range of a document worth indexing on its own thread
+#define PARALLEL_MINRANGE	0x100000
+
+// a newly opened document is indexed this far before it is displayed,
+// and the rest in ranges of BACKGROUND_RANGE bytes
+#define INDEX_FIRSTBYTES	0x10000
+#define BACKGROUND_RANGE	0x1000000
+
+// the crash-recovery journal is kept next to the file, with this appended
+#define JOURNAL_EXT			TEXT(".journal")
+
+//
+//	A range of a document, starting and ending on line boundaries,
+//	and the index of the lines within it
+//
+struct INDEX_RANGE
+{
+	size_w		start;
+	size_w		end;
+	lineindex	lines;
+	bool		success;
+	LONG volatile done;
+
+	// kept by the thread that edits the document, see edit_ranges
+	size_w		cut;		// where 'start' was before it was moved onto a line boundary
+	size_w		shift;		// add to a snapshot offset to get the same offset in the document
+	bool		placed;		// 'pstart' and 'pend' have been worked out, see place_range
+	size_w		pstart;		// where the range's thread will move 'start' to
+	size_w		pend;		// ...and 'end', or -1 if that is too far away to look for
+	LONG volatile stale;	// edited before it could be indexed - its thread needn't bother
+};
+
+//
+//	Work shared by the threads that index a document - each thread
+//	takes the next unclaimed range until none are left (or until they
+//	are cancelled). Finished ranges are merged into the document's 
+//	line-buffer in order
+//
+struct INDEX_WORK
+{
+	TextDocument  *	doc;
+	sequence::version *text;	// the document as it was when indexing began
+	INDEX_RANGE	  *	ranges;
+	LONG			numranges;
+	LONG volatile	next;
+	LONG volatile	cancel;
+	LONG			merged;
+	HANDLE			hThread[MAXIMUM_WAIT_OBJECTS];
+	DWORD			numthreads;
+};
+
+// the most threads that index a document, besides the calling thread
+static DWORD g_dwIndexThreads = MAXIMUM_WAIT_OBJECTS;
+
+//
+//	Characters that end a line (a CR may also take a LF with it)
+//
+static bool isnewline(ULONG ch32)
+{
+	return ch32 == '\r' || ch32 == '\n' || ch32 == '\x0b' || ch32 == '\x0c' || 
+		   ch32 == 0x0085 || ch32 == 0x2029 || ch32 == 0x2028;
+}
 
 struct _BOM_LOOKUP BOMLOOK[] = 
 {
@@ -35,12 +102,11 @@ TextDocument::TextDocument()
 	m_nDocLength_bytes  = 0;
 	m_nDocLength_chars  = 0;
 
-	m_pLineBuf_byte		= 0;
-	m_pLineBuf_char		= 0;
-	m_nNumLines			= 0;
-
 	m_nFileFormat		= NCP_ASCII;
 	m_nHeaderSize		= 0;
+
+	m_pIndexWork		= 0;
+	m_szJournal[0]		= 0;
 }
 
 //
@@ -52,7 +118,9 @@ TextDocument::~TextDocument()
 }
 
 //
-//	Initialize the TextDocument with the specified file
+//	Initialize the TextDocument with the specified file. Edits are journalled
+//	to "<filename>.journal" so that they survive a crash - a journal left
+//	behind by an earlier session is replayed before the document is shown
 //
 bool TextDocument::init(TCHAR *filename)
 {
@@ -63,7 +131,27 @@ bool TextDocument::init(TCHAR *filename)
 	if(hFile == INVALID_HANDLE_VALUE)
 		return false;
 
-	return init(hFile);
+	if(!init(hFile))
+		return false;
+
+	// no journal if the name won't fit - the document can still be edited
+	if(lstrlen(filename) + lstrlen(JOURNAL_EXT) >= MAX_PATH)
+		return true;
+
+	lstrcpy(m_szJournal, filename);
+	lstrcat(m_szJournal, JOURNAL_EXT);
+
+	if(!m_seq.journal(m_szJournal))
+	{
+		m_szJournal[0] = 0;
+		return true;
+	}
+
+	// the replayed edits have changed the text under the line-buffer
+	if(m_seq.canundo() || m_seq.canredo())
+		reread();
+
+	return true;
 }
 
 //
@@ -71,49 +159,83 @@ bool TextDocument::init(TCHAR *filename)
 //
 bool TextDocument::init(HANDLE hFile)
 {
-	ULONG numread;
-	char *buffer;
+	DWORD sizehi = 0;
 
-	if((m_nDocLength_bytes = GetFileSize(hFile, 0)) == 0)
+	end_indexing(true);
+
+	if(GetFileSize(hFile, &sizehi) == 0 && sizehi == 0)
+	{
+		CloseHandle(hFile);
 		return false;
+	}
 
-	// allocate new file-buffer
-	if((buffer = new char[m_nDocLength_bytes]) == 0)
+	// map the file straight into the piece-table - nothing is read up-front
+	if(!m_seq.open(hFile))
+	{
+		CloseHandle(hFile);
 		return false;
+	}
 
-	// read entire file into memory
-	ReadFile(hFile, buffer, m_nDocLength_bytes, &numread, 0);
+	reread();
 
-	m_seq.init((BYTE *)buffer, m_nDocLength_bytes);
+	CloseHandle(hFile);
+	return true;
+}
+
+//
+//	Take in the sequence's text afresh - its format and where each line
+//	starts - after it has been opened or had a journal replayed into it
+//
+void TextDocument::reread()
+{
+	end_indexing(true);
+
+	m_nDocLength_bytes = m_seq.size();
 
 	// try to detect if this is an ascii/unicode/utf8 file
 	m_nFileFormat = detect_file_format(&m_nHeaderSize);
 
-	// work out where each line of text starts
-	if(!init_linebuffer())
+	// work out where each line of text starts - at least, the first few
+	if(!open_linebuffer())
 		clear();
-
-	CloseHandle(hFile);
-	delete[] buffer;
-	return true;
 }
 
-//	Initialize the TextDocument with the specified file
 //
-/*bool TextDocument::save(TCHAR *filename)
+//	Save the TextDocument to the specified file. If it is the file the
+//	document was opened from, and that can be updated in-place, only the
+//	changes are written; otherwise (including Save As) the whole document
+//	is streamed out to replace it.
+//
+//	Saving empties the journal, which goes on recording the edits made
+//	from here on. A journal named after another file can't be found again
+//	for this one, so after a Save As it is deleted instead
+//
+bool TextDocument::save(TCHAR *filename)
 {
-	HANDLE hFile;
-	
-	hFile = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, 0, 0);
+	TCHAR journal[MAX_PATH];
 
-	if(hFile == INVALID_HANDLE_VALUE)
+	if(!m_seq.quicksave(filename) && !m_seq.save(filename))
 		return false;
 
+	if(m_szJournal[0] == 0)
+		return true;
 
+	journal[0] = 0;
+
+	if(lstrlen(filename) + lstrlen(JOURNAL_EXT) < MAX_PATH)
+	{
+		lstrcpy(journal, filename);
+		lstrcat(journal, JOURNAL_EXT);
+	}
+
+	if(lstrcmpi(journal, m_szJournal) != 0)
+	{
+		m_seq.endjournal(true);
+		m_szJournal[0] = 0;
+	}
 
-	CloseHandle(hFile);
 	return true;
-}*/
+}
 
 
 //
@@ -156,22 +278,16 @@ int TextDocument::detect_file_format(int *m_nHeaderSize)
 //
 bool TextDocument::clear()
 {
+	end_indexing(true);
+
+	// the edits are being thrown away, so there's nothing left to recover
+	m_seq.endjournal(true);
+	m_szJournal[0] = 0;
+
 	m_seq.clear();
 	m_nDocLength_bytes = 0;
 
-	if(m_pLineBuf_byte)
-	{
-		delete[] m_pLineBuf_byte;
-		m_pLineBuf_byte = 0;
-	}
-
-	if(m_pLineBuf_char)
-	{
-		delete[] m_pLineBuf_char;
-		m_pLineBuf_char = 0;
-	}
-		
-	m_nNumLines = 0;
+	m_lineindex.clear();
 	return true;
 }
 
@@ -180,58 +296,90 @@ bool TextDocument::EmptyDoc()
 	clear();
 	m_seq.init();
 
-	// this is not robust. it's just to get the thing
-	// up-and-running until I write a proper line-buffer mananger
-	m_pLineBuf_byte = new ULONG[0x1000];
-	m_pLineBuf_char = new ULONG[0x1000];
-
-	m_pLineBuf_byte[0] = 0;
-	m_pLineBuf_char[0] = 0;
-
 	return true;
 }
 
 
 //
-//	Return a UTF-32 character value
+//	Return a UTF-32 character value from the current iterator position,
+//	and advance the iterator past the character's code-units
 //
-int TextDocument::getchar(ULONG offset, ULONG lenbytes, ULONG *pch32)
+//	returns number of bytes processed
+//
+template <class ITERATOR>
+int TextDocument::getchar(ITERATOR &itor, size_w lenbytes, ULONG *pch32)
 {
-//	BYTE	*rawdata   = (BYTE *)(buffer + offset + m_nHeaderSize);
-	BYTE	rawdata[16];
-
-	lenbytes = min(16, lenbytes);
-	m_seq.render(offset+ m_nHeaderSize, rawdata, lenbytes);
+	BYTE	rawdata[8];
+	ULONG	rawlen;
 
 #ifdef UNICODE
 
-	UTF16   *rawdata_w = (UTF16 *)rawdata;//(WCHAR*)(buffer + offset + m_nHeaderSize);
+	UTF16   *rawdata_w = (UTF16 *)rawdata;
 	WCHAR     ch16;
 	size_t   ch32len = 1;
+	ITERATOR peek = itor;
+
+	if(lenbytes == 0)
+		return 0;
 
 	switch(m_nFileFormat)
 	{
 	case NCP_ASCII:
+		rawdata[0] = *itor;
+		++itor;
+
 		MultiByteToWideChar(CP_ACP, 0, (CCHAR*)rawdata, 1, &ch16, 1);
 		*pch32 = ch16;
 		return 1;
 
 	case NCP_UTF16:
-		return utf16_to_utf32(rawdata_w, lenbytes / 2, pch32, &ch32len) * sizeof(WCHAR);
-		
 	case NCP_UTF16BE:
-		return utf16be_to_utf32(rawdata_w, lenbytes / 2, pch32, &ch32len) * sizeof(WCHAR);
+
+		// fetch one UTF-16 unit, and a second if this could be a surrogate pair
+		rawlen = (ULONG)min(4, lenbytes);
+
+		for(ULONG i = 0; i < rawlen; i++, ++peek)
+			rawdata[i] = *peek;
+
+		if(m_nFileFormat == NCP_UTF16)
+			rawlen = utf16_to_utf32(rawdata_w, rawlen / 2, pch32, &ch32len) * sizeof(WCHAR);
+		else
+			rawlen = utf16be_to_utf32(rawdata_w, rawlen / 2, pch32, &ch32len) * sizeof(WCHAR);
+
+		break;
 
 	case NCP_UTF8:
-		return utf8_to_utf32(rawdata, lenbytes, pch32);
+
+		// the lead-byte tells us how many trailing bytes to fetch
+		rawdata[0] = *peek;
+
+		if(rawdata[0] < 0x80)			rawlen = 1;
+		else if(rawdata[0] >= 0xFC)		rawlen = 6;
+		else if(rawdata[0] >= 0xF8)		rawlen = 5;
+		else if(rawdata[0] >= 0xF0)		rawlen = 4;
+		else if(rawdata[0] >= 0xE0)		rawlen = 3;
+		else if(rawdata[0] >= 0xC0)		rawlen = 2;
+		else							rawlen = 1;
+
+		rawlen = (ULONG)min(rawlen, lenbytes);
+
+		for(ULONG i = 0; i < rawlen; i++, ++peek)
+			rawdata[i] = *peek;
+
+		rawlen = utf8_to_utf32(rawdata, rawlen, pch32);
+		break;
 
 	default:
 		return 0;
 	}
 
+	itor += rawlen;
+	return rawlen;
+
 #else
 
-	*pch32 = (ULONG)(BYTE)rawdata[0];
+	*pch32 = (ULONG)(BYTE)*itor;
+	++itor;
 	return 1;
 
 #endif
@@ -257,7 +405,7 @@ int TextDocument::getchar(ULONG offset, ULONG lenbytes, ULONG *pch32)
 //
 //	returns  - number of bytes processed
 //
-ULONG TextDocument::gettext(ULONG offset, ULONG lenbytes, TCHAR *buf, ULONG *buflen)
+ULONG TextDocument::gettext(size_w offset, size_w lenbytes, TCHAR *buf, ULONG *buflen)
 {
 //	BYTE	*rawdata = (BYTE *)(buffer + offset + m_nHeaderSize);
 
@@ -270,18 +418,46 @@ ULONG TextDocument::gettext(ULONG offset, ULONG lenbytes, TCHAR *buf, ULONG *buf
 		return 0;
 	}
 
+	sequence::iterator itor = m_seq.iterate(offset + m_nHeaderSize);
+
 	while(lenbytes > 0 && *buflen > 0)
 	{
-		BYTE   rawdata[0x100];
-		size_t rawlen = min(lenbytes, 0x100);
+		const seqchar *rawdata;
+		BYTE   tmpdata[8];
+		size_t rawlen;
+		size_t tmplen = *buflen;
 
-		// get next block of data from the piece-table
-		m_seq.render(offset + m_nHeaderSize, rawdata, rawlen);
+		// convert straight out of the piece-table's span memory
+		if((rawlen = itor.chunk(&rawdata)) == 0)
+			break;
 
-		// convert to UTF-16 
-		size_t tmplen = *buflen;
-		rawlen = rawdata_to_utf16(rawdata, rawlen, buf, &tmplen);
+		rawlen = (size_t)min(lenbytes, rawlen);
 
+		// don't split a character that continues into the next span
+		if(rawlen < lenbytes)
+			rawlen = trim_partial(rawdata, rawlen);
+
+		if(rawlen == 0 || (rawlen = rawdata_to_utf16((BYTE *)rawdata, rawlen, buf, &tmplen)) == 0)
+		{
+			// the next character straddles a span-boundary,
+			// so assemble it in a small local buffer first
+			sequence::iterator peek = itor;
+			
+			rawlen = (size_t)min(lenbytes, sizeof(tmpdata));
+
+			for(size_t i = 0; i < rawlen; i++, ++peek)
+				tmpdata[i] = *peek;
+
+			if(rawlen < lenbytes)
+				rawlen = trim_partial(tmpdata, rawlen);
+
+			tmplen = *buflen;
+			
+			if((rawlen = rawdata_to_utf16(tmpdata, rawlen, buf, &tmplen)) == 0)
+				break;
+		}
+
+		itor			+= rawlen;
 		lenbytes		-= rawlen;
 		offset			+= rawlen;
 		bytes_processed += rawlen;
@@ -357,7 +533,49 @@ ULONG TextDocument::gettext(ULONG offset, ULONG lenbytes, TCHAR *buf, ULONG *buf
 	}*/
 }
 
-ULONG TextDocument::getdata(ULONG offset, BYTE *buf, size_t len)
+//
+//	Return the number of bytes at the start of rawdata that hold whole
+//	characters, i.e. exclude a multi-byte sequence that is cut short at
+//	the end of the buffer
+//
+size_t TextDocument::trim_partial(const BYTE *rawdata, size_t rawlen)
+{
+	size_t i, seqlen;
+
+	switch(m_nFileFormat)
+	{
+	case NCP_UTF8:
+
+		// find the lead-byte of the last sequence in the buffer
+		for(i = rawlen; i > 0 && rawlen - i < 6; i--)
+		{
+			BYTE ch = rawdata[i-1];
+
+			if((ch & 0xC0) != 0x80)
+			{
+				if(ch < 0xC0)			seqlen = 1;
+				else if(ch < 0xE0)		seqlen = 2;
+				else if(ch < 0xF0)		seqlen = 3;
+				else if(ch < 0xF8)		seqlen = 4;
+				else if(ch < 0xFC)		seqlen = 5;
+				else					seqlen = 6;
+
+				return (i - 1 + seqlen > rawlen) ? i - 1 : rawlen;
+			}
+		}
+
+		return rawlen;
+
+	case NCP_UTF16:
+	case NCP_UTF16BE:
+		return rawlen & ~1;
+
+	default:
+		return rawlen;
+	}
+}
+
+ULONG TextDocument::getdata(size_w offset, BYTE *buf, size_t len)
 {
 	//memcpy(buf, buffer + offset + m_nHeaderSize, len);
 	m_seq.render(offset + m_nHeaderSize, buf, len);
@@ -365,97 +583,770 @@ ULONG TextDocument::getdata(ULONG offset, BYTE *buf, size_t len)
 }
 
 //
-//	Initialize the line-buffer
+//	Limit the number of threads used to index a document, besides the
+//	calling thread (at most MAXIMUM_WAIT_OBJECTS, the default). With none
+//	at all every document is indexed in one pass by the calling thread,
+//	which is how SeqBench checks the threads' results
 //
-//	With Unicode a newline sequence is defined as any of the following:
+void TextDocument::set_indexthreads(DWORD maxthreads)
+{
+	g_dwIndexThreads = min(maxthreads, MAXIMUM_WAIT_OBJECTS);
+}
+
 //
-//	\u000A | \u000B | \u000C | \u000D | \u0085 | \u2028 | \u2029 | \u000D\u000A
+//	Initialize the line-buffer, indexing the whole document before returning
 //
 bool TextDocument::init_linebuffer()
 {
-	ULONG offset_bytes		= 0;
-	ULONG offset_chars		= 0;
-	ULONG linestart_bytes	= 0;
-	ULONG linestart_chars	= 0;
-	ULONG bytes_left	    = m_nDocLength_bytes - m_nHeaderSize;
+	size_w buflen = m_nDocLength_bytes - m_nHeaderSize;
+
+	end_indexing(true);
+	m_lineindex.clear();
+
+	// an empty document has no lines at all
+	if(buflen == 0)
+		return true;
+
+	// this thread does its share of the work as well
+	if(buflen >= PARALLEL_MINRANGE * 2 && begin_indexing(0, false))
+	{
+		index_thread(m_pIndexWork);
+		return end_indexing(false);
+	}
+
+	return index_range(m_seq, m_lineindex, 0, buflen);
+}
+
+//
+//	Initialize the line-buffer for a document that has just been opened.
+//	Only the first few lines - enough to fill a window - are indexed
+//	straight away, and the rest of a large document is left to background
+//	threads. The line-buffer then grows each time poll_linebuffer is called
+//
+bool TextDocument::open_linebuffer()
+{
+	size_w buflen = m_nDocLength_bytes - m_nHeaderSize;
+
+	// a small document is indexed before anyone would notice
+	if(buflen < PARALLEL_MINRANGE * 2)
+		return init_linebuffer();
+
+	end_indexing(true);
+	m_lineindex.clear();
+
+	if(!index_range(m_seq, m_lineindex, 0, INDEX_FIRSTBYTES))
+		return false;
+
+	return resume_linebuffer();
+}
+
+//
+//	Carry on indexing from the end of the last line in the line-buffer -
+//	in the background if possible, otherwise straight away
+//
+bool TextDocument::resume_linebuffer()
+{
+	size_w buflen  = m_nDocLength_bytes - m_nHeaderSize;
+	size_w indexed = m_lineindex.size_bytes();
+
+	if(indexed == buflen || begin_indexing(indexed, true))
+		return true;
+
+	return index_range(m_seq, m_lineindex, indexed, buflen);
+}
+
+//
+//	Add the lines from 'start' (a line boundary) up to the first line
+//	boundary at or after 'end' to an index. A range that runs to the end
+//	of the document also takes the last line - whatever follows the final
+//	newline, even if that is nothing. Gives up if '*cancel' is set
+//
+template <class TEXT>
+bool TextDocument::index_range(const TEXT &text, lineindex &index, size_w start, size_w end, LONG volatile *cancel)
+{
+	size_w buflen		= text.size() - m_nHeaderSize;
+	size_w offset_bytes	= start;
+	size_w linelen_bytes;
+	size_w linelen_chars;
+	bool   more = true;
+
+	// walk the text with an iterator rather than rendering each character
+	typename TEXT::iterator itor = text.iterate(m_nHeaderSize + start);
+
+	while(more && (offset_bytes < end || offset_bytes == buflen))
+	{
+		if(cancel && *cancel)
+			return false;
+
+		more = scan_line(itor, buflen - offset_bytes, &linelen_bytes, &linelen_chars);
+
+		if(!index.append(linelen_bytes, linelen_chars))
+			return false;
+
+		offset_bytes += linelen_bytes;
+	}
+
+	return true;
+}
+
+//
+//	Start indexing the document from 'start' - the end of the line-buffer -
+//	on other threads. The rest of the document is cut into ranges which
+//	each start just after a newline - a line always starts there, however
+//	the scan arrives - so the ranges can be measured on their own. Their
+//	indexes are then joined end to end, which adds up the offsets of every
+//	range in the index's Fenwick trees.
+//
+//	The threads read a snapshot of the document rather than the document
+//	itself, so it can go on being edited while they work (see edit_ranges)
+//
+//	In the background the ranges are a fixed size, so that the line-buffer
+//	grows steadily, and the threads give way to the user-interface
+//
+//	Returns false, having done nothing, if the document can't be split
+//
+bool TextDocument::begin_indexing(size_w start, bool background)
+{
+	size_w		 buflen = m_nDocLength_bytes - m_nHeaderSize;
+	SYSTEM_INFO	 si;
+	INDEX_WORK	*work;
+	HANDLE		 hThread;
+	DWORD		 maxthreads;
+	LONG		 numranges;
+	LONG		 i;
+
+#ifdef UNICODE
+	// only encodings that can be picked up part-way through
+	if(m_nFileFormat != NCP_ASCII && m_nFileFormat != NCP_UTF8 &&
+	   m_nFileFormat != NCP_UTF16 && m_nFileFormat != NCP_UTF16BE)
+		return false;
+#endif
+
+	GetSystemInfo(&si);
+
+	// in the foreground, the calling thread makes up the numbers
+	if(g_dwIndexThreads == 0 || (!background && si.dwNumberOfProcessors < 2))
+		return false;
+
+	maxthreads = min(max(si.dwNumberOfProcessors - 1, 1), g_dwIndexThreads);
+
+	// in the foreground, a few ranges for each processor so that they all finish together
+	if(background)
+		numranges = (LONG)max((buflen - start) / BACKGROUND_RANGE, 1);
+	else
+		numranges = (LONG)min(si.dwNumberOfProcessors * 4, (buflen - start) / PARALLEL_MINRANGE);
+
+	if((work = new INDEX_WORK) == 0)
+		return false;
+
+	if((work->text = m_seq.snapshot()) == 0)
+	{
+		delete work;
+		return false;
+	}
+
+	if((work->ranges = new INDEX_RANGE[numranges]) == 0)
+	{
+		work->text->release();
+		delete work;
+		return false;
+	}
+
+	// rough boundaries only - each thread moves its range's boundaries onto
+	// line boundaries, so nothing has to be read from the document here
+	for(i = 0; i < numranges; i++)
+	{
+		work->ranges[i].start	= start + (buflen - start) / numranges * i;
+		work->ranges[i].end		= start + (buflen - start) / numranges * (i + 1);
+		work->ranges[i].success = false;
+		work->ranges[i].done	= FALSE;
+		work->ranges[i].cut		= work->ranges[i].start;
+		work->ranges[i].shift	= 0;
+		work->ranges[i].placed	= false;
+		work->ranges[i].stale	= FALSE;
+	}
+
+	work->ranges[numranges - 1].end = buflen;
+
+	work->doc		 = this;
+	work->numranges	 = numranges;
+	work->next		 = 0;
+	work->cancel	 = FALSE;
+	work->merged	 = 0;
+	work->numthreads = 0;
 
-	ULONG buflen  = m_nDocLength_bytes - m_nHeaderSize;
+	while(work->numthreads < min(maxthreads, (DWORD)numranges))
+	{
+		if((hThread = CreateThread(0, 0, index_thread, work, 0, 0)) == 0)
+			break;
 
-	// allocate the line-buffer for storing each line's BYTE offset
-	if((m_pLineBuf_byte = new ULONG[buflen+1]) == 0)
+		if(background)
+			SetThreadPriority(hThread, THREAD_PRIORITY_BELOW_NORMAL);
+
+		work->hThread[work->numthreads++] = hThread;
+	}
+
+	// nobody to do the work in the background
+	if(background && work->numthreads == 0)
+	{
+		work->text->release();
+		delete[] work->ranges;
+		delete work;
 		return false;
+	}
+
+	m_pIndexWork = work;
+	return true;
+}
+
+//
+//	Wait for the indexing threads to finish - or, with 'cancel', tell them
+//	to give up straight away - and add the ranges they completed to the
+//	line-buffer. After a cancel resume_linebuffer carries on from wherever
+//	they got to
+//
+//	Returns false if any of the document is left unindexed
+//
+bool TextDocument::end_indexing(bool cancel)
+{
+	INDEX_WORK *work = m_pIndexWork;
+	bool		success;
+	DWORD		i;
+
+	if(work == 0)
+		return true;
+
+	if(cancel)
+		InterlockedExchange(&work->cancel, TRUE);
+
+	if(work->numthreads > 0)
+		WaitForMultipleObjects(work->numthreads, work->hThread, TRUE, INFINITE);
+
+	for(i = 0; i < work->numthreads; i++)
+		CloseHandle(work->hThread[i]);
+
+	success = merge_ranges((size_w)-1);
+
+	work->text->release();
+	delete[] work->ranges;
+	delete work;
+
+	m_pIndexWork = 0;
+	return success;
+}
+
+//
+//	Add the ranges that have been indexed so far to the end of the
+//	line-buffer, in order. A range that can't be used as it is - one that
+//	was edited before its thread got to it, that an edit has left out of
+//	line with the end of the line-buffer, or that its thread couldn't
+//	finish for any reason other than being cancelled - is indexed again
+//	here from the document, up to the next range that can. No more than
+//	'maxbytes' are indexed here on each call, so a caller on the user-
+//	interface thread is never held up for long.
+//
+//	Returns true once every range has been added
+//
+bool TextDocument::merge_ranges(size_w maxbytes)
+{
+	INDEX_WORK  *work	= m_pIndexWork;
+	size_w		 buflen = m_nDocLength_bytes - m_nHeaderSize;
+	INDEX_RANGE *range;
+	size_w		 indexed;
+	size_w		 stop;
+	LONG		 next;
+
+	while(work->merged < work->numranges && work->ranges[work->merged].done)
+	{
+		range	= &work->ranges[work->merged];
+		indexed = m_lineindex.size_bytes();
+
+		if(range->success && !range->stale && range->start + range->shift == indexed)
+		{
+			m_lineindex.append(range->lines);
+			work->merged++;
+			continue;
+		}
+
+		if(work->cancel)
+			return false;
+
+		// find the next range that lines up with the document as it is now
+		for(next = work->merged + 1; next < work->numranges; next++)
+		{
+			range = &work->ranges[next];
+
+			if(!range->done)
+				return false;
+
+			if(range->success && !range->stale && range->start + range->shift >= indexed)
+				break;
+		}
+
+		stop = next < work->numranges ? range->start + range->shift : buflen;
+
+		if(indexed < stop)
+		{
+			if(maxbytes == 0)
+				return false;
+
+			if(!index_range(m_seq, m_lineindex, indexed, min(stop, indexed + min(maxbytes, buflen))))
+				return false;
+
+			maxbytes -= min(maxbytes, m_lineindex.size_bytes() - indexed);
+
+			if(m_lineindex.size_bytes() < stop)
+				return false;
+		}
+
+		// everything before 'next' has been indexed afresh
+		work->merged = next;
+	}
+
+	return work->merged == work->numranges;
+}
+
+//
+//	Adjust the ranges that haven't been added to the line-buffer yet for an
+//	edit to the document (offsets are as they were before the edit). The
+//	threads carry on regardless - they are reading a snapshot that the edit
+//	doesn't touch - and the ranges are put right as follows:
+//
+//	A range after the edit has its offsets shifted. A range that has been
+//	indexed has the edit applied to its lines, just like the line-buffer,
+//	if the edit lies wholly inside it. Any other range the edit touches is
+//	marked stale, and merge_ranges indexes it again when its turn comes
+//
+void TextDocument::edit_ranges(size_w offset_bytes, size_w erased_bytes, size_w inserted_bytes)
+{
+	INDEX_WORK  *work	= m_pIndexWork;
+	size_w		 buflen = m_nDocLength_bytes - m_nHeaderSize + erased_bytes - inserted_bytes;
+	size_w		 first	= offset_bytes > 0 ? offset_bytes - 1 : 0;
+	size_w		 last	= offset_bytes + erased_bytes;
+	size_w		 limit	= buflen;
+	size_w		 start;
+	size_w		 end;
+	INDEX_RANGE *range;
+	LONG		 i;
+
+	if(work == 0)
+		return;
+
+	// working backwards, a range that ends too far away to be placed is
+	// taken to reach as far as the start of the range that follows it
+	for(i = work->numranges - 1; i >= work->merged; i--)
+	{
+		range = &work->ranges[i];
+
+		if(range->stale)
+			continue;
+
+		if(range->done)
+		{
+			start = range->start + range->shift;
+			end	  = range->end + range->shift;
+		}
+		else
+		{
+			if(!range->placed)
+				place_range(i);
+
+			start = range->pstart + range->shift;
+			end	  = range->pend != (size_w)-1 ? range->pend + range->shift : limit;
+		}
+
+		// the edit also changes the line before it, so reaches back a byte
+		if(first < end && last >= start)
+		{
+			if(range->done && range->success && start <= first && last < end &&
+			   update_index(range->lines, start, offset_bytes, erased_bytes, inserted_bytes, end != buflen))
+			{
+				range->end = range->start + range->lines.size_bytes();
+			}
+			else
+			{
+				InterlockedExchange(&range->stale, TRUE);
+			}
+		}
+		else if(start > last)
+		{
+			range->shift += inserted_bytes - erased_bytes;
+		}
+
+		// an empty range doesn't end the one before it
+		if(start != end)
+			limit = start;
+	}
+}
+
+//
+//	Work out the boundaries that the thread indexing range 'i' will give it,
+//	without waiting for the thread to get that far - so that an edit can be
+//	kept to the ranges it really touches. Both look in the same snapshot of
+//	the document, so both arrive at the same line-starts. A line that runs
+//	on past the next range as well is not followed to its end
+//
+void TextDocument::place_range(LONG i)
+{
+	INDEX_WORK	*work	= m_pIndexWork;
+	INDEX_RANGE *range	= &work->ranges[i];
+	const sequence::version &text = *work->text;
+	size_w		 buflen = text.size() - m_nHeaderSize;
+	size_w		 rough	= i < work->numranges - 1 ? work->ranges[i + 1].cut : buflen;
+
+	range->pstart = range->cut;
+	range->pend	  = rough;
+	range->placed = true;
+
+	// the same steps as index_thread
+	if(i > 0 && !find_linestart(text, char_boundary(text, range->cut), rough, &range->pstart))
+		range->pstart = rough;
+	else if(i < work->numranges - 1 && !find_linestart(text, char_boundary(text, rough), min(rough + BACKGROUND_RANGE, buflen), &range->pend))
+		range->pend = rough + BACKGROUND_RANGE < buflen ? (size_w)-1 : buflen;
+}
+
+//
+//	Collect whatever the background threads have indexed since the last
+//	call, so the line-buffer (and linecount) grows as they go. Returns
+//	true once the whole document has been indexed
+//
+bool TextDocument::poll_linebuffer()
+{
+	if(m_pIndexWork == 0)
+		return true;
 
-	// allocate the line-buffer for storing each line's CHARACTER offset
-	if((m_pLineBuf_char = new ULONG[buflen+1]) == 0)
+	if(!merge_ranges(PARALLEL_MINRANGE))
 		return false;
 
-	m_nNumLines = 0;
+	// every range is in, so the threads are on their way out
+	end_indexing(false);
+	return true;
+}
+
+//
+//	Return true while the document is being indexed in the background
+//
+bool TextDocument::indexing()
+{
+	return m_pIndexWork != 0;
+}
+
+//
+//	Thread procedure for begin_indexing
+//
+DWORD WINAPI TextDocument::index_thread(LPVOID param)
+{
+	INDEX_WORK	 *work	 = (INDEX_WORK *)param;
+	TextDocument *doc	 = work->doc;
+	const sequence::version &text = *work->text;
+	size_w		  buflen = text.size() - doc->m_nHeaderSize;
+	INDEX_RANGE	 *range;
+	LONG		  i;
+
+	while(!work->cancel && (i = InterlockedIncrement(&work->next) - 1) < work->numranges)
+	{
+		range = &work->ranges[i];
+
+		// an edit has already reached it, merge_ranges will index it afresh
+		if(range->stale)
+		{
+			range->success = false;
+			InterlockedExchange(&range->done, TRUE);
+			continue;
+		}
+
+		// the range starts after its first newline and ends after the first
+		// newline of the ranges that follow - wherever the next range with a
+		// newline of its own starts. A range without one is left empty
+		if(i > 0 && !doc->find_linestart(text, doc->char_boundary(text, range->start), range->end, &range->start, &work->cancel))
+			range->start = range->end;
+		else if(i < work->numranges - 1 && !doc->find_linestart(text, doc->char_boundary(text, range->end), buflen, &range->end, &work->cancel))
+			range->end = buflen;
+
+		// an empty range has no lines, not even a last one
+		range->success = !work->cancel && (range->start == range->end ||
+			doc->index_range(text, range->lines, range->start, range->end, &work->cancel));
+
+		// hand the range's lines over to merge_ranges
+		InterlockedExchange(&range->done, TRUE);
+	}
+
+	return 0;
+}
+
+//
+//	Return the first character boundary at or after 'offset_bytes'
+//	(every byte starts a character when nothing is decoded)
+//
+template <class TEXT>
+size_w TextDocument::char_boundary(const TEXT &text, size_w offset_bytes)
+{
+#ifdef UNICODE
+
+	size_w buflen = text.size() - m_nHeaderSize;
+
+	switch(m_nFileFormat)
+	{
+	case NCP_UTF16:
+	case NCP_UTF16BE:
+		return offset_bytes & ~1;
+
+	case NCP_UTF8:
+		{
+			// every byte but a trail-byte starts a character, even in malformed text
+			typename TEXT::iterator itor = text.iterate(m_nHeaderSize + offset_bytes);
+
+			while(offset_bytes < buflen && (*itor & 0xC0) == 0x80)
+			{
+				++itor;
+				offset_bytes++;
+			}
+		}
+
+		break;
+	}
+
+#endif
+
+	return offset_bytes;
+}
+
+//
+//	Find the start of the line that follows the first newline at or after
+//	'offset_bytes' (a character boundary), looking no further than 'limit'.
+//	Whatever point the search starts from, it arrives at a true line-start.
+//	Gives up if '*cancel' is set
+//
+template <class TEXT>
+bool TextDocument::find_linestart(const TEXT &text, size_w offset_bytes, size_w limit, size_w *linestart, LONG volatile *cancel)
+{
+	size_w buflen = text.size() - m_nHeaderSize;
+
+#ifdef UNICODE
+	int	   format = m_nFileFormat;
+#else
+	int	   format = NCP_ASCII;
+#endif
+
+	typename TEXT::iterator itor = text.iterate(m_nHeaderSize + offset_bytes);
+
+	while(offset_bytes < limit)
+	{
+		const seqchar *ptr;
+		size_t chars;
+		size_t plain = (size_t)min(itor.chunk(&ptr), limit - offset_bytes);
+
+		if(cancel && *cancel)
+			return false;
+
+		if(plain > 0 && (plain = linescan(format, ptr, plain, (size_t)-1, &chars)) > 0)
+		{
+			itor		 += plain;
+			offset_bytes += plain;
+			continue;
+		}
+
+		ULONG ch32;
+		ULONG len = getchar(itor, buflen - offset_bytes, &ch32);
+
+		if(len == 0)
+			return false;
+
+		offset_bytes += len;
+
+		if(isnewline(ch32))
+		{
+			// a CR takes a LF with it
+			if(ch32 == '\r' && offset_bytes < buflen &&
+			   (len = getchar(itor, buflen - offset_bytes, &ch32)) != 0 && ch32 == '\n')
+			{
+				offset_bytes += len;
+			}
+
+			*linestart = offset_bytes;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+//
+//	Bring the line-buffer up to date after 'erased_bytes' at 'offset_bytes'
+//	were replaced by 'inserted_bytes'. While a document is still being
+//	indexed the line-buffer stops short, and the ranges that will follow
+//	it are adjusted as well - an edit beyond the end of the line-buffer
+//	only affects them
+//
+bool TextDocument::update_linebuffer(size_w offset_bytes, size_w erased_bytes, size_w inserted_bytes)
+{
+	size_w buflen  = m_nDocLength_bytes - m_nHeaderSize;
+	size_w indexed = m_lineindex.size_bytes();
+	bool   partial;
+
+	if(m_lineindex.count() == 0 || buflen == 0)
+		return init_linebuffer();
+
+	partial = indexed != buflen + erased_bytes - inserted_bytes;
+
+	if(partial)
+	{
+		edit_ranges(offset_bytes, erased_bytes, inserted_bytes);
+
+		if(offset_bytes > indexed)
+			return true;
+	}
+
+	return update_index(m_lineindex, 0, offset_bytes, erased_bytes, inserted_bytes, partial);
+}
+
+//
+//	Bring 'index' - the lines from 'base' onwards - up to date after an
+//	edit. Scanning starts with the line before the edit (a CR that gains
+//	a LF belongs to the previous line) and stops at the first line that
+//	starts where one of the old lines did, so only the lines around the
+//	edit are rescanned.
+//
+//	A 'partial' index stops short of the end of the document, and the
+//	rescan stops at the first line boundary after its old lines run out
+//
+bool TextDocument::update_index(lineindex &index, size_w base, size_w offset_bytes, size_w erased_bytes, size_w inserted_bytes, bool partial)
+{
+	std::vector<lineindex::line> lines;
+	lineindex::line ln;
+
+	size_w buflen  = m_nDocLength_bytes - m_nHeaderSize;
+	size_w editend = offset_bytes + inserted_bytes;
+	size_w indexed = base + index.size_bytes();
+	size_w linestart;
+	size_w oldstart;
+	ULONG  first;
+	ULONG  last = index.count();
+	ULONG  lineno;
+	bool   more = true;
+
+	first = index.lineno_from_bytes((offset_bytes > base ? offset_bytes - 1 : base) - base, &linestart);
+	linestart += base;
+
+	sequence::iterator itor = m_seq.iterate(m_nHeaderSize + linestart);
+
+	while(more)
+	{
+		more = scan_line(itor, buflen - linestart, &ln.length_bytes, &ln.length_chars);
+		lines.push_back(ln);
+		linestart += ln.length_bytes;
+
+		// past the edit, a line that starts where an old line started
+		// (allowing for the change in length) begins an unchanged run
+		if(more && linestart >= editend)
+		{
+			size_w target = linestart - inserted_bytes + erased_bytes;
+
+			// the old lines have run out before the end of the document
+			if(partial && target >= indexed && linestart < buflen)
+				break;
+
+			lineno = index.lineno_from_bytes(target - base, &oldstart);
+
+			if(oldstart + base == target)
+			{
+				last = lineno;
+				break;
+			}
+		}
+	}
+
+	// otherwise the rest of the document was rescanned
+	return index.replace(first, last - first, &lines[0], (ULONG)lines.size());
+}
+
+//
+//	Measure the line that starts at the iterator's position, and move the
+//	iterator past it. Returns false if the line runs to the end of the
+//	document rather than ending in a newline (or a 'hard break')
+//
+//	With Unicode a newline sequence is defined as any of the following:
+//
+//	\u000A | \u000B | \u000C | \u000D | \u0085 | \u2028 | \u2029 | \u000D\u000A
+//
+template <class ITERATOR>
+bool TextDocument::scan_line(ITERATOR &itor, size_w lenbytes, size_w *linelen_bytes, size_w *linelen_chars)
+{
+	size_w offset_bytes = 0;
+	size_w offset_chars = 0;
+	bool   newline		= false;
 
+#ifdef UNICODE
+	int	   format		= m_nFileFormat;
+#else
+	int	   format		= NCP_ASCII;	// getchar doesn't decode at all
+#endif
 
-	// loop through every byte in the file
-	for(offset_bytes = 0; offset_bytes < buflen; )
+	while(offset_bytes < lenbytes && !newline)
 	{
+		const seqchar *ptr;
+		size_t chars;
+		size_t plain = (size_t)min(itor.chunk(&ptr), lenbytes - offset_bytes);
+
+		// step over plain text straight out of the span's memory, and only
+		// decode the characters that could end the line
+		if(plain > 0 && (plain = linescan(format, ptr, plain, HARDBREAK_LENGTH + 1 - (size_t)offset_chars, &chars)) > 0)
+		{
+			itor		 += plain;
+			offset_bytes += plain;
+			offset_chars += chars;
+
+			if(offset_chars > HARDBREAK_LENGTH)
+				newline = true;
+
+			continue;
+		}
+
 		ULONG ch32;
+		ULONG len = getchar(itor, lenbytes - offset_bytes, &ch32);
+
+		// a partial character at the end of the document
+		if(len == 0)
+		{
+			offset_bytes = lenbytes;
+			offset_chars++;
+			break;
+		}
 
-		// get a UTF-32 character from the underlying file format.
-		// this needs serious thought. Currently 
-		ULONG len = getchar(offset_bytes, buflen - offset_bytes, &ch32);
 		offset_bytes += len;
 		offset_chars += 1;
 
 		if(ch32 == '\r')
 		{
-			// record where the line starts
-			m_pLineBuf_byte[m_nNumLines] = linestart_bytes;
-			m_pLineBuf_char[m_nNumLines] = linestart_chars;
-			linestart_bytes				= offset_bytes;
-			linestart_chars				= offset_chars;
-
-			// look ahead to next char
-			len = getchar(offset_bytes, buflen - offset_bytes, &ch32);
-			offset_bytes += len;
-			offset_chars += 1;
-
-			// carriage-return / line-feed combination
-			if(ch32 == '\n')
+			ITERATOR peek = itor;
+
+			// carriage-return / line-feed combination. Anything
+			// else after the CR starts the next line
+			if(offset_bytes < lenbytes && 
+			   (len = getchar(peek, lenbytes - offset_bytes, &ch32)) != 0 && ch32 == '\n')
 			{
-				linestart_bytes		= offset_bytes;
-				linestart_chars		= offset_chars;
+				itor		  = peek;
+				offset_bytes += len;
+				offset_chars += 1;
 			}
-			
-			m_nNumLines++;
+
+			newline = true;
 		}
-		else if(ch32 == '\n' || ch32 == '\x0b' || ch32 == '\x0c' || ch32 == 0x0085 || ch32 == 0x2029 || ch32 == 0x2028)
+		else if(isnewline(ch32))
 		{
-			// record where the line starts
-			m_pLineBuf_byte[m_nNumLines] = linestart_bytes;
-			m_pLineBuf_char[m_nNumLines] = linestart_chars;
-			linestart_bytes				= offset_bytes;
-			linestart_chars				= offset_chars;
-			m_nNumLines++;
+			newline = true;
 		}
 		// force a 'hard break' 
-		else if(offset_chars - linestart_chars > 128)
+		else if(offset_chars > HARDBREAK_LENGTH)
 		{
-			m_pLineBuf_byte[m_nNumLines] = linestart_bytes;
-			m_pLineBuf_char[m_nNumLines] = linestart_chars;
-			linestart_bytes				= offset_bytes;
-			linestart_chars				= offset_chars;
-			m_nNumLines++;
+			newline = true;
 		}
 	}
 
-	if(buflen > 0)
-	{
-		m_pLineBuf_byte[m_nNumLines] = linestart_bytes;
-		m_pLineBuf_char[m_nNumLines] = linestart_chars;
-		m_nNumLines++;
-	}
-
-	m_pLineBuf_byte[m_nNumLines] = buflen;
-	m_pLineBuf_char[m_nNumLines] = offset_chars;
+	*linelen_bytes = offset_bytes;
+	*linelen_chars = offset_chars;
 
-	return true;
+	return newline;
 }
 
 
@@ -464,7 +1355,7 @@ bool TextDocument::init_linebuffer()
 //
 ULONG TextDocument::linecount()
 {
-	return m_nNumLines;
+	return m_lineindex.count();
 }
 
 //
@@ -509,34 +1400,19 @@ ULONG TextDocument::longestline(int tabwidth)
 //
 //	Return information about specified line
 //
-bool TextDocument::lineinfo_from_lineno(ULONG lineno, ULONG *lineoff_chars,  ULONG *linelen_chars, ULONG *lineoff_bytes, ULONG *linelen_bytes)
+bool TextDocument::lineinfo_from_lineno(ULONG lineno, size_w *lineoff_chars,  size_w *linelen_chars, size_w *lineoff_bytes, size_w *linelen_bytes)
 {
-	if(lineno < m_nNumLines)
-	{
-		if(linelen_chars) *linelen_chars  = m_pLineBuf_char[lineno+1] - m_pLineBuf_char[lineno];
-		if(lineoff_chars) *lineoff_chars  = m_pLineBuf_char[lineno];
-
-		if(linelen_bytes) *linelen_bytes  = m_pLineBuf_byte[lineno+1] - m_pLineBuf_byte[lineno];
-		if(lineoff_bytes) *lineoff_bytes  = m_pLineBuf_byte[lineno];
-
-		return true;
-	}
-	else
-	{
-		return false;
-	}
+	return m_lineindex.lineinfo(lineno, lineoff_bytes, linelen_bytes, lineoff_chars, linelen_chars);
 }
 
 //
 //	Perform a reverse lookup - file-offset to line number
 //
-bool TextDocument::lineinfo_from_offset(ULONG offset_chars, ULONG *lineno, ULONG *lineoff_chars, ULONG *linelen_chars, ULONG *lineoff_bytes, ULONG *linelen_bytes)
+bool TextDocument::lineinfo_from_offset(size_w offset_chars, ULONG *lineno, size_w *lineoff_chars, size_w *linelen_chars, size_w *lineoff_bytes, size_w *linelen_bytes)
 {
-	ULONG low  = 0;
-	ULONG high = m_nNumLines-1;
-	ULONG line = 0;
+	ULONG line;
 
-	if(m_nNumLines == 0)
+	if(m_lineindex.count() == 0)
 	{
 		if(lineno)			*lineno			= 0;
 		if(lineoff_chars)	*lineoff_chars	= 0;
@@ -547,31 +1423,12 @@ bool TextDocument::lineinfo_from_offset(ULONG offset_chars, ULONG *lineno, ULONG
 		return false;
 	}
 
-	while(low <= high)
-	{
-		line = (high + low) / 2;
-
-		if(offset_chars >= m_pLineBuf_char[line] && offset_chars < m_pLineBuf_char[line+1])
-		{
-			break;
-		}
-		else if(offset_chars < m_pLineBuf_char[line])
-		{
-			high = line-1;
-		}
-		else
-		{
-			low = line+1;
-		}
-	}
+	line = m_lineindex.lineno_from_chars(offset_chars);
 
-	if(lineno)			*lineno			= line;
-	if(lineoff_bytes)	*lineoff_bytes	= m_pLineBuf_byte[line];
-	if(linelen_bytes)	*linelen_bytes  = m_pLineBuf_byte[line+1] - m_pLineBuf_byte[line];
-	if(lineoff_chars)	*lineoff_chars  = m_pLineBuf_char[line];
-	if(linelen_chars)	*linelen_chars  = m_pLineBuf_char[line+1] - m_pLineBuf_char[line];
+	if(lineno)
+		*lineno = line;
 
-	return true;
+	return m_lineindex.lineinfo(line, lineoff_bytes, linelen_bytes, lineoff_chars, linelen_chars);
 }
 
 int TextDocument::getformat()
@@ -579,15 +1436,15 @@ int TextDocument::getformat()
 	return m_nFileFormat;
 }
 
-ULONG TextDocument::size()
+size_w TextDocument::size()
 {
 	return m_nDocLength_bytes;
 }
 
-TextIterator TextDocument::iterate(ULONG offset_chars)
+TextIterator TextDocument::iterate(size_w offset_chars)
 {
-	ULONG off_bytes = charoffset_to_byteoffset(offset_chars);
-	ULONG len_bytes = m_nDocLength_bytes - off_bytes;
+	size_w off_bytes = charoffset_to_byteoffset(offset_chars);
+	size_w len_bytes = m_nDocLength_bytes - off_bytes;
 
 	//if(!lineinfo_from_offset(offset_chars, 0, linelen, &offset_bytes, &length_bytes))
 	//	return TextIterator();
@@ -599,10 +1456,10 @@ TextIterator TextDocument::iterate(ULONG offset_chars)
 //
 //
 //
-TextIterator TextDocument::iterate_line(ULONG lineno, ULONG *linestart, ULONG *linelen)
+TextIterator TextDocument::iterate_line(ULONG lineno, size_w *linestart, size_w *linelen)
 {
-	ULONG offset_bytes;
-	ULONG length_bytes;
+	size_w offset_bytes;
+	size_w length_bytes;
 
 	if(!lineinfo_from_lineno(lineno, linestart, linelen, &offset_bytes, &length_bytes))
 		return TextIterator();
@@ -610,10 +1467,10 @@ TextIterator TextDocument::iterate_line(ULONG lineno, ULONG *linestart, ULONG *l
 	return TextIterator(offset_bytes, length_bytes, this);
 }
 
-TextIterator TextDocument::iterate_line_offset(ULONG offset_chars, ULONG *lineno, ULONG *linestart)
+TextIterator TextDocument::iterate_line_offset(size_w offset_chars, ULONG *lineno, size_w *linestart)
 {
-	ULONG offset_bytes;
-	ULONG length_bytes;
+	size_w offset_bytes;
+	size_w length_bytes;
 
 	if(!lineinfo_from_offset(offset_chars, lineno, linestart, 0, &offset_bytes, &length_bytes))
 		return TextIterator();
@@ -621,16 +1478,16 @@ TextIterator TextDocument::iterate_line_offset(ULONG offset_chars, ULONG *lineno
 	return TextIterator(offset_bytes, length_bytes, this);
 }
 
-ULONG TextDocument::lineno_from_offset(ULONG offset)
+ULONG TextDocument::lineno_from_offset(size_w offset)
 {
 	ULONG lineno = 0;
 	lineinfo_from_offset(offset, &lineno, 0, 0, 0, 0);
 	return lineno;
 }
 
-ULONG TextDocument::offset_from_lineno(ULONG lineno)
+size_w TextDocument::offset_from_lineno(ULONG lineno)
 {
-	ULONG lineoff = 0;
+	size_w lineoff = 0;
 	lineinfo_from_lineno(lineno, &lineoff, 0, 0, 0);
 	return lineoff;
 }
@@ -638,12 +1495,12 @@ ULONG TextDocument::offset_from_lineno(ULONG lineno)
 //
 //	Retrieve an entire line of text
 //	
-ULONG TextDocument::getline(ULONG nLineNo, TCHAR *buf, ULONG buflen, ULONG *off_chars)
+ULONG TextDocument::getline(ULONG nLineNo, TCHAR *buf, ULONG buflen, size_w *off_chars)
 {
-	ULONG offset_bytes;
-	ULONG length_bytes;
-	ULONG offset_chars;
-	ULONG length_chars;
+	size_w offset_bytes;
+	size_w length_bytes;
+	size_w offset_chars;
+	size_w length_chars;
 
 	if(!lineinfo_from_lineno(nLineNo, &offset_chars, &length_chars, &offset_bytes, &length_bytes))
 	{
@@ -740,18 +1597,18 @@ size_t TextDocument::utf16_to_rawdata(TCHAR *utf16str, size_t utf16len, BYTE *ra
 //
 //	returns number of BYTEs stored
 //
-ULONG TextDocument::insert_raw(ULONG offset_bytes, TCHAR *text, ULONG length)
+size_w TextDocument::insert_raw(size_w offset_bytes, TCHAR *text, size_w length)
 {
-	BYTE  buf[0x100];
-	ULONG buflen;
-	ULONG copied;
-	ULONG rawlen = 0;
-	ULONG offset = offset_bytes+ m_nHeaderSize;
+	BYTE   buf[0x100];
+	size_t buflen;
+	size_t copied;
+	size_w rawlen = 0;
+	size_w offset = offset_bytes+ m_nHeaderSize;
 
 	while(length)
 	{
 		buflen = 0x100;
-		copied = utf16_to_rawdata(text, length, buf, (size_t *)&buflen);
+		copied = utf16_to_rawdata(text, (size_t)length, buf, &buflen);
 
 		// do the piece-table insertion!
 		if(!m_seq.insert(offset, buf, buflen))
@@ -764,23 +1621,26 @@ ULONG TextDocument::insert_raw(ULONG offset_bytes, TCHAR *text, ULONG length)
 	}
 
 	m_nDocLength_bytes = m_seq.size();
+	update_linebuffer(offset_bytes, 0, rawlen);
+
 	return rawlen;
 }
 
-ULONG TextDocument::replace_raw(ULONG offset_bytes, TCHAR *text, ULONG length, ULONG erase_chars)
+size_w TextDocument::replace_raw(size_w offset_bytes, TCHAR *text, size_w length, size_w erase_chars)
 {
-	BYTE  buf[0x100];
-	ULONG buflen;
-	ULONG copied;
-	ULONG rawlen = 0;
-	ULONG offset = offset_bytes + m_nHeaderSize;
+	BYTE   buf[0x100];
+	size_t buflen;
+	size_t copied;
+	size_w rawlen = 0;
+	size_w offset = offset_bytes + m_nHeaderSize;
 
-	ULONG erase_bytes = count_chars(offset_bytes, erase_chars);
+	size_w oldlength   = m_seq.size();
+	size_w erase_bytes = count_chars(offset_bytes, erase_chars);
 
 	while(length)
 	{
 		buflen = 0x100;
-		copied = utf16_to_rawdata(text, length, buf, (size_t *)&buflen);
+		copied = utf16_to_rawdata(text, (size_t)length, buf, &buflen);
 
 		// do the piece-table replacement!
 		if(!m_seq.replace(offset, buf, buflen, erase_bytes))
@@ -794,7 +1654,10 @@ ULONG TextDocument::replace_raw(ULONG offset_bytes, TCHAR *text, ULONG length, U
 		erase_bytes = 0;
 	}
 
+	// the erase is cut short at the end of the document
 	m_nDocLength_bytes = m_seq.size();
+	update_linebuffer(offset_bytes, oldlength + rawlen - m_nDocLength_bytes, rawlen);
+
 	return rawlen;
 }
 
@@ -802,7 +1665,7 @@ ULONG TextDocument::replace_raw(ULONG offset_bytes, TCHAR *text, ULONG length, U
 //	Erase is a little different. Need to work out how many
 //  bytes the specified number of UTF16 characters takes up
 //
-ULONG TextDocument::erase_raw(ULONG offset_bytes, ULONG length)
+size_w TextDocument::erase_raw(size_w offset_bytes, size_w length)
 {
 	/*TCHAR  buf[0x100];
 	ULONG  buflen;
@@ -827,11 +1690,14 @@ ULONG TextDocument::erase_raw(ULONG offset_bytes, ULONG length)
 		return length;
 	}*/
 
-	ULONG erase_bytes  = count_chars(offset_bytes, length);
+	size_w erase_bytes  = count_chars(offset_bytes, length);
+	size_w oldlength	= m_seq.size();
 	
 	if(m_seq.erase(offset_bytes + m_nHeaderSize, erase_bytes))
 	{
 		m_nDocLength_bytes = m_seq.size();
+		update_linebuffer(offset_bytes, oldlength - m_nDocLength_bytes, 0);
+
 		return length;
 	}
 		
@@ -842,7 +1708,7 @@ ULONG TextDocument::erase_raw(ULONG offset_bytes, ULONG length)
 //	return number of bytes comprising 'length_chars' characters
 //	in the underlying raw file
 //
-ULONG TextDocument::count_chars(ULONG offset_bytes, ULONG length_chars)
+size_w TextDocument::count_chars(size_w offset_bytes, size_w length_chars)
 {
 	switch(m_nFileFormat)
 	{
@@ -857,12 +1723,12 @@ ULONG TextDocument::count_chars(ULONG offset_bytes, ULONG length_chars)
 		break;
 	}
 
-	ULONG offset_start = offset_bytes;
+	size_w offset_start = offset_bytes;
 
 	while(length_chars && offset_bytes < m_nDocLength_bytes)
 	{
 		TCHAR buf[0x100];
-		ULONG charlen = min(length_chars, 0x100);
+		ULONG charlen = (ULONG)min(length_chars, 0x100);
 		ULONG bytelen;
 
 		bytelen = gettext(offset_bytes, m_nDocLength_bytes - offset_bytes, buf, &charlen);
@@ -874,7 +1740,7 @@ ULONG TextDocument::count_chars(ULONG offset_bytes, ULONG length_chars)
 	return offset_bytes - offset_start;
 }
 
-ULONG TextDocument::byteoffset_to_charoffset(ULONG offset_bytes)
+size_w TextDocument::byteoffset_to_charoffset(size_w offset_bytes)
 {
 	switch(m_nFileFormat)
 	{
@@ -896,7 +1762,7 @@ ULONG TextDocument::byteoffset_to_charoffset(ULONG offset_bytes)
 	return 0;
 }
 
-ULONG TextDocument::charoffset_to_byteoffset(ULONG offset_chars)
+size_w TextDocument::charoffset_to_byteoffset(size_w offset_chars)
 {
 	switch(m_nFileFormat)
 	{
@@ -914,8 +1780,8 @@ ULONG TextDocument::charoffset_to_byteoffset(ULONG offset_chars)
 		break;
 	}
 
-	ULONG lineoff_chars;
-	ULONG lineoff_bytes;
+	size_w lineoff_chars;
+	size_w lineoff_bytes;
 
 	if(lineinfo_from_offset(offset_chars, 0, &lineoff_chars, 0, &lineoff_bytes, 0))
 	{
@@ -931,62 +1797,72 @@ ULONG TextDocument::charoffset_to_byteoffset(ULONG offset_chars)
 //
 //	Insert text at specified character-offset
 //
-ULONG TextDocument::insert_text(ULONG offset_chars, TCHAR *text, ULONG length)
+size_w TextDocument::insert_text(size_w offset_chars, TCHAR *text, size_w length)
 {
-	ULONG offset_bytes = charoffset_to_byteoffset(offset_chars);
+	size_w offset_bytes = charoffset_to_byteoffset(offset_chars);
 	return insert_raw(offset_bytes, text, length);
 }
 
 //
 //	Overwrite text at specified character-offset
 //
-ULONG TextDocument::replace_text(ULONG offset_chars, TCHAR *text, ULONG length, ULONG erase_len)
+size_w TextDocument::replace_text(size_w offset_chars, TCHAR *text, size_w length, size_w erase_len)
 {
-	ULONG offset_bytes = charoffset_to_byteoffset(offset_chars);
+	size_w offset_bytes = charoffset_to_byteoffset(offset_chars);
 	return replace_raw(offset_bytes, text, length, erase_len);
 }
 
 //
 //	Erase text at specified character-offset
 //
-ULONG TextDocument::erase_text(ULONG offset_chars, ULONG length)
+size_w TextDocument::erase_text(size_w offset_chars, size_w length)
 {
-	ULONG offset_bytes = charoffset_to_byteoffset(offset_chars);
+	size_w offset_bytes = charoffset_to_byteoffset(offset_chars);
 	return erase_raw(offset_bytes, length);
 }
 
-bool TextDocument::Undo(ULONG *offset_start, ULONG *offset_end)
+bool TextDocument::Undo(size_w *offset_start, size_w *offset_end)
 {
-	ULONG start, length;
+	size_w start, length;
+	size_w erased, inserted;
 
 	if(!m_seq.undo())
 		return false;
 
+	m_nDocLength_bytes = m_seq.size();
+
+	// the whole undo/redo group, not just its last event, needs reindexing
+	m_seq.event_range(&start, &erased, &inserted);
+	update_linebuffer(start - m_nHeaderSize, erased, inserted);
+
 	start  = m_seq.event_index() - m_nHeaderSize;
 	length = m_seq.event_length();
 
 	*offset_start = byteoffset_to_charoffset(start);
 	*offset_end   = byteoffset_to_charoffset(start+length);
 
-	m_nDocLength_bytes = m_seq.size();
-	
 	return true;
 }
 
-bool TextDocument::Redo(ULONG *offset_start, ULONG *offset_end)
+bool TextDocument::Redo(size_w *offset_start, size_w *offset_end)
 {
-	ULONG start, length;
+	size_w start, length;
+	size_w erased, inserted;
 
 	if(!m_seq.redo())
 		return false;
 
+	m_nDocLength_bytes = m_seq.size();
+
+	// reindex everything the redo changed
+	m_seq.event_range(&start, &erased, &inserted);
+	update_linebuffer(start - m_nHeaderSize, erased, inserted);
+
 	start  = m_seq.event_index() - m_nHeaderSize;
 	length = m_seq.event_length();
 
 	*offset_start = byteoffset_to_charoffset(start);
 	*offset_end   = byteoffset_to_charoffset(start+length);
-	
-	m_nDocLength_bytes = m_seq.size();
 
 	return true;
 }
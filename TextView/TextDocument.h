@@ -3,8 +3,10 @@
 
 #include "codepages.h"
 #include "sequence.h"
+#include "lineindex.h"
 
 class TextIterator;
+struct INDEX_WORK;
 
 class TextDocument
 {
@@ -17,66 +19,94 @@ public:
 
 	bool  init(HANDLE hFile);
 	bool  init(TCHAR *filename);
+	bool  save(TCHAR *filename);
 	
 	bool  clear();
 	bool EmptyDoc();
 
-	bool	Undo(ULONG *offset_start, ULONG *offset_end);
-	bool	Redo(ULONG *offset_start, ULONG *offset_end);
+	bool	Undo(size_w *offset_start, size_w *offset_end);
+	bool	Redo(size_w *offset_start, size_w *offset_end);
 
 	// UTF-16 text-editing interface
-	ULONG	insert_text(ULONG offset_chars, TCHAR *text, ULONG length);
-	ULONG	replace_text(ULONG offset_chars, TCHAR *text, ULONG length, ULONG erase_len);
-	ULONG	erase_text(ULONG offset_chars, ULONG length);
+	size_w	insert_text(size_w offset_chars, TCHAR *text, size_w length);
+	size_w	replace_text(size_w offset_chars, TCHAR *text, size_w length, size_w erase_len);
+	size_w	erase_text(size_w offset_chars, size_w length);
 
-	ULONG lineno_from_offset(ULONG offset);
-	ULONG offset_from_lineno(ULONG lineno);
+	ULONG  lineno_from_offset(size_w offset);
+	size_w offset_from_lineno(ULONG lineno);
 
-	bool  lineinfo_from_offset(ULONG offset_chars, ULONG *lineno, ULONG *lineoff_chars,  ULONG *linelen_chars, ULONG *lineoff_bytes, ULONG *linelen_bytes);
-	bool  lineinfo_from_lineno(ULONG lineno,                      ULONG *lineoff_chars,  ULONG *linelen_chars, ULONG *lineoff_bytes, ULONG *linelen_bytes);	
+	bool  lineinfo_from_offset(size_w offset_chars, ULONG *lineno, size_w *lineoff_chars,  size_w *linelen_chars, size_w *lineoff_bytes, size_w *linelen_bytes);
+	bool  lineinfo_from_lineno(ULONG lineno,                       size_w *lineoff_chars,  size_w *linelen_chars, size_w *lineoff_bytes, size_w *linelen_bytes);	
 
-	TextIterator iterate(ULONG offset);
-	TextIterator iterate_line(ULONG lineno, ULONG *linestart = 0, ULONG *linelen = 0);
-	TextIterator iterate_line_offset(ULONG offset_chars, ULONG *lineno, ULONG *linestart = 0);
+	TextIterator iterate(size_w offset);
+	TextIterator iterate_line(ULONG lineno, size_w *linestart = 0, size_w *linelen = 0);
+	TextIterator iterate_line_offset(size_w offset_chars, ULONG *lineno, size_w *linestart = 0);
 
-	ULONG getdata(ULONG offset, BYTE *buf, size_t len);
-	ULONG getline(ULONG nLineNo, TCHAR *buf, ULONG buflen, ULONG *off_chars);
+	ULONG getdata(size_w offset, BYTE *buf, size_t len);
+	ULONG getline(ULONG nLineNo, TCHAR *buf, ULONG buflen, size_w *off_chars);
 
-	int   getformat();
-	ULONG linecount();
-	ULONG longestline(int tabwidth);
-	ULONG size();
+	int    getformat();
+	ULONG  linecount();
+	bool   poll_linebuffer();
+	bool   indexing();
+	ULONG  longestline(int tabwidth);
+	size_w size();
+
+	// index the whole document again, and limit the threads that may help
+	bool   init_linebuffer();
+	static void set_indexthreads(DWORD maxthreads);
 
 private:
 	
-	bool init_linebuffer();
+	bool open_linebuffer();
+	bool resume_linebuffer();
+	bool update_linebuffer(size_w offset_bytes, size_w erased_bytes, size_w inserted_bytes);
+	bool update_index(lineindex &index, size_w base, size_w offset_bytes, size_w erased_bytes, size_w inserted_bytes, bool partial);
+	template <class ITERATOR> bool scan_line(ITERATOR &itor, size_w lenbytes, size_w *linelen_bytes, size_w *linelen_chars);
+
+	// the text read is either the document itself or a snapshot of it
+	template <class TEXT> bool index_range(const TEXT &text, lineindex &index, size_w start, size_w end, LONG volatile *cancel = 0);
+	template <class TEXT> bool find_linestart(const TEXT &text, size_w offset_bytes, size_w limit, size_w *linestart, LONG volatile *cancel = 0);
+	template <class TEXT> size_w char_boundary(const TEXT &text, size_w offset_bytes);
+
+	bool begin_indexing(size_w start, bool background);
+	bool end_indexing(bool cancel);
+	bool merge_ranges(size_w maxbytes);
+	void edit_ranges(size_w offset_bytes, size_w erased_bytes, size_w inserted_bytes);
+	void place_range(LONG i);
 
-	ULONG charoffset_to_byteoffset(ULONG offset_chars);
-	ULONG byteoffset_to_charoffset(ULONG offset_bytes);
+	static DWORD WINAPI index_thread(LPVOID param);
 
-	ULONG count_chars(ULONG offset_bytes, ULONG length_chars);
+	size_w charoffset_to_byteoffset(size_w offset_chars);
+	size_w byteoffset_to_charoffset(size_w offset_bytes);
+
+	size_w count_chars(size_w offset_bytes, size_w length_chars);
 
 	size_t utf16_to_rawdata(TCHAR *utf16str, size_t utf16len, BYTE *rawdata, size_t *rawlen);
 	size_t rawdata_to_utf16(BYTE *rawdata, size_t rawlen, TCHAR *utf16str, size_t *utf16len);
+	size_t trim_partial(const BYTE *rawdata, size_t rawlen);
 
 	int   detect_file_format(int *headersize);
-	ULONG	  gettext(ULONG offset, ULONG lenbytes, TCHAR *buf, ULONG *len);
-	int   getchar(ULONG offset, ULONG lenbytes, ULONG *pch32);
+	void  reread();
+	ULONG	  gettext(size_w offset, size_w lenbytes, TCHAR *buf, ULONG *len);
+	template <class ITERATOR> int getchar(ITERATOR &itor, size_w lenbytes, ULONG *pch32);
 
 	// UTF-16 text-editing interface
-	ULONG	insert_raw(ULONG offset_bytes, TCHAR *text, ULONG length);
-	ULONG	replace_raw(ULONG offset_bytes, TCHAR *text, ULONG length, ULONG erase_len);
-	ULONG	erase_raw(ULONG offset_bytes, ULONG length);
+	size_w	insert_raw(size_w offset_bytes, TCHAR *text, size_w length);
+	size_w	replace_raw(size_w offset_bytes, TCHAR *text, size_w length, size_w erase_len);
+	size_w	erase_raw(size_w offset_bytes, size_w length);
 
 
 	sequence m_seq;
+	TCHAR	 m_szJournal[MAX_PATH];	// crash-recovery journal kept next to the file
+
+	size_w  m_nDocLength_chars;
+	size_w  m_nDocLength_bytes;
 
-	ULONG  m_nDocLength_chars;
-	ULONG  m_nDocLength_bytes;
+	lineindex m_lineindex;
 
-	ULONG *m_pLineBuf_byte;
-	ULONG *m_pLineBuf_char;
-	ULONG  m_nNumLines;
+	// lines still being indexed in the background
+	INDEX_WORK *m_pIndexWork;
 	
 	int	   m_nFileFormat;
 	int    m_nHeaderSize;
@@ -91,7 +121,7 @@ public:
 	{
 	}
 
-	TextIterator(ULONG off, ULONG len, TextDocument *td)
+	TextIterator(size_w off, size_w len, TextDocument *td)
 		: text_doc(td), off_bytes(off), len_bytes(len)
 	{
 		
@@ -192,8 +222,8 @@ private:
 
 	TextDocument *text_doc;
 	
-	ULONG off_bytes;
-	ULONG len_bytes;
+	size_w off_bytes;
+	size_w len_bytes;
 };
 
 class LineIterator
@@ -154,6 +154,10 @@ ULONG TextView::NotifyParent(UINT nNotifyCode, NMHDR *optional)
 	UINT  nCtrlId = GetWindowLong(m_hWnd, GWL_ID);
 	NMHDR nmhdr   = { m_hWnd, nCtrlId, nNotifyCode };
 	NMHDR *nmptr  = &nmhdr;  
+
+	// (re)start the idle-timer whenever the document is modified
+	if(nNotifyCode == TVN_CHANGED)
+		SetTimer(m_hWnd, IDLE_TIMER, IDLE_DELAY, 0);
 	
 	if(optional)
 	{
@@ -307,14 +311,14 @@ LINEINFO* TextView::GetLineInfo(ULONG nLineNo)
 							);
 }
 
-ULONG TextView::SelectionSize()
+size_w TextView::SelectionSize()
 {
-	ULONG s1 = min(m_nSelectionStart, m_nSelectionEnd); 
-	ULONG s2 = max(m_nSelectionStart, m_nSelectionEnd); 
+	size_w s1 = min(m_nSelectionStart, m_nSelectionEnd); 
+	size_w s2 = max(m_nSelectionStart, m_nSelectionEnd); 
 	return s2 - s1;
 }
 
-ULONG TextView::SelectAll()
+size_w TextView::SelectAll()
 {
 	m_nSelectionStart = 0;
 	m_nSelectionEnd   = m_pTextDoc->size();
@@ -434,6 +438,9 @@ LONG WINAPI TextView::WndProc(UINT msg, WPARAM wParam, LPARAM lParam)
 	case TXM_OPENFILE:
 		return OpenFile((TCHAR *)lParam);
 
+	case TXM_SAVEFILE:
+		return SaveFile((TCHAR *)lParam);
+
 	case TXM_CLEAR:
 		return ClearFile();
 
@@ -464,22 +471,24 @@ LONG WINAPI TextView::WndProc(UINT msg, WPARAM wParam, LPARAM lParam)
 	case TXM_GETFORMAT:
 		return m_pTextDoc->getformat();
 
+	// message results are only 32bit wide, so clamp rather than
+	// let a selection larger than 4Gb wrap around to zero
 	case TXM_GETSELSIZE:
-		return SelectionSize();
+		return (LONG)min(SelectionSize(), MAXLONG);
 
 	case TXM_SETSELALL:
-		return SelectAll();
+		return (LONG)SelectAll();
 
 	case TXM_GETCURPOS:
-		return m_nCursorOffset;
+		return (LONG)min(m_nCursorOffset, MAXLONG);
 
 	case TXM_GETCURLINE:
 		return m_nCurrentLine;
 
 	case TXM_GETCURCOL:
-		ULONG nOffset;
+		size_w nOffset;
 		GetUspData(0, m_nCurrentLine, &nOffset);
-		return m_nCursorOffset - nOffset;
+		return (LONG)(m_nCursorOffset - nOffset);
 
 	case TXM_GETEDITMODE:
 		return m_nEditMode;
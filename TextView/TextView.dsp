@@ -135,6 +135,14 @@ LIB32=link.exe -lib
 # PROP Default_Filter "cpp;c;cxx;rc;def;r;odl;idl;hpj;bat"
 # Begin Source File
 
+SOURCE=.\lineindex.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\linescan.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\sequence.cpp
 # End Source File
 # Begin Source File
@@ -195,6 +203,14 @@ SOURCE=.\codepages.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\lineindex.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\linescan.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\sequence.h
 # End Source File
 # Begin Source File
@@ -67,6 +67,7 @@ COLORREF RealizeColour(COLORREF col);
 #define TXM_SETEDITMODE			(TXM_BASE + 22)
 #define TXM_GETEDITMODE			(TXM_BASE + 23)
 #define TXM_SETCONTEXTMENU		(TXM_BASE + 24)
+#define TXM_SAVEFILE			(TXM_BASE + 25)
 
 //
 //	TextView Notification Messages defined here - 
@@ -77,6 +78,7 @@ COLORREF RealizeColour(COLORREF col);
 #define TVN_SELECTION_CHANGE	(TVN_BASE + 1)
 #define TVN_EDITMODE_CHANGE		(TVN_BASE + 2)
 #define TVN_CHANGED				(TVN_BASE + 3)
+#define TVN_INDEXED				(TVN_BASE + 4)
 
 typedef struct
 {
@@ -142,6 +144,9 @@ typedef struct
 #define TextView_OpenFile(hwndTV, szFile)	\
 	SendMessage((hwndTV), TXM_OPENFILE, 0, (LPARAM)(TCHAR *)(szFile))
 
+#define TextView_SaveFile(hwndTV, szFile)	\
+	SendMessage((hwndTV), TXM_SAVEFILE, 0, (LPARAM)(TCHAR *)(szFile))
+
 #define TextView_Clear(hwndTV)	\
 	SendMessage((hwndTV), TXM_CLEAR, 0, 0)
 
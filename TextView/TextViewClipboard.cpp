@@ -61,14 +61,26 @@ BOOL TextView::OnPaste()
 //	szDest must be big enough to hold nLength characters
 //	nLength includes the terminating NULL
 //
-ULONG TextView::GetText(TCHAR *szDest, ULONG nStartOffset, ULONG nLength)
+size_w TextView::GetText(TCHAR *szDest, size_w nStartOffset, size_w nLength)
 {
-	ULONG copied = 0;
+	size_w copied = 0;
 
 	if(nLength > 1)
 	{
 		TextIterator itor = m_pTextDoc->iterate(nStartOffset);
-		copied = itor.gettext(szDest, nLength - 1);
+		ULONG len;
+
+		// the iterator works in ULONG-sized pieces, so walk
+		// selections larger than 4Gb a gigabyte at a time
+		while(copied < nLength - 1)
+		{
+			len = (ULONG)min(nLength - 1 - copied, 0x40000000);
+
+			if((len = itor.gettext(szDest + copied, len)) == 0)
+				break;
+
+			copied += len;
+		}
 
 		// null-terminate
 		szDest[copied] = 0;
@@ -82,19 +94,23 @@ ULONG TextView::GetText(TCHAR *szDest, ULONG nStartOffset, ULONG nLength)
 //
 BOOL TextView::OnCopy()
 {
-	ULONG	selstart	= min(m_nSelectionStart, m_nSelectionEnd);
-	ULONG	sellen		= SelectionSize();
+	size_w	selstart	= min(m_nSelectionStart, m_nSelectionEnd);
+	size_w	sellen		= SelectionSize();
 	BOOL	success		= FALSE;
 
 	if(sellen  == 0)
 		return FALSE;
 
+	// the clipboard buffer must be addressable in one allocation
+	if(sellen >= (SIZE_T)-1 / sizeof(TCHAR))
+		return FALSE;
+
 	if(OpenClipboard(m_hWnd))
 	{
 		HANDLE hMem;
 		TCHAR  *ptr;
 		
-		if((hMem = GlobalAlloc(GPTR, (sellen + 1) * sizeof(TCHAR))) != 0)
+		if((hMem = GlobalAlloc(GPTR, (SIZE_T)(sellen + 1) * sizeof(TCHAR))) != 0)
 		{
 			if((ptr = (TCHAR *)GlobalLock(hMem)) != 0)
 			{
@@ -36,17 +36,32 @@ LONG TextView::OpenFile(TCHAR *szFileName)
 		UpdateMarginWidth();
 		UpdateMetrics();
 		ResetLineCache();
+
+		// the rest of the lines are counted in the background
+		if(m_pTextDoc->indexing())
+			SetTimer(m_hWnd, INDEX_TIMER, INDEX_DELAY, 0);
+
 		return TRUE;
 	}
 
 	return FALSE;
 }
 
+//
+//	Save the document to the specified file
+//
+LONG TextView::SaveFile(TCHAR *szFileName)
+{
+	return m_pTextDoc->save(szFileName) ? TRUE : FALSE;
+}
+
 //
 //
 //
 LONG TextView::ClearFile()
 {
+	KillTimer(m_hWnd, INDEX_TIMER);
+
 	if(m_pTextDoc)
 	{
 		m_pTextDoc->clear();
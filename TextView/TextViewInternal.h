@@ -22,7 +22,7 @@ typedef struct
 {
 	USPDATA *uspData;
 	ULONG	 lineno;		// line#
-	ULONG	 offset;		// offset (in WCHAR's) of this line
+	size_w	 offset;		// offset (in WCHAR's) of this line
 	ULONG	 usage;			// cache-count
 
 	int		 length;		// length in chars INCLUDING CR/LF
@@ -54,6 +54,17 @@ typedef int (__cdecl * COMPAREPROC) (const void *, const void *);
 // maximum fonts that a TextView can hold
 #define MAX_FONTS 32
 
+// the document is tidied up once editing has paused for IDLE_DELAY ms,
+// IDLE_SPANS spans at a time
+#define IDLE_TIMER	2
+#define IDLE_DELAY	2000
+#define IDLE_SPANS	0x4000
+
+// while a large document is indexed in the background, the line count
+// is brought up to date every INDEX_DELAY ms
+#define INDEX_TIMER	3
+#define INDEX_DELAY	100
+
 enum SELMODE { SEL_NONE, SEL_NORMAL, SEL_MARGIN, SEL_BLOCK };
 
 typedef struct
@@ -114,15 +125,16 @@ private:
 	//	Internal private functions
 	//
 	LONG		OpenFile(TCHAR *szFileName);
+	LONG		SaveFile(TCHAR *szFileName);
 	LONG		ClearFile();
 	void		ResetLineCache();
-	ULONG		GetText(TCHAR *szDest, ULONG nStartOffset, ULONG nLength);
+	size_w		GetText(TCHAR *szDest, size_w nStartOffset, size_w nLength);
 	
 	//
 	//	Cursor/Selection
 	//
-	ULONG		SelectionSize();
-	ULONG		SelectAll();
+	size_w		SelectionSize();
+	size_w		SelectAll();
 
 	//void		Toggle
 
@@ -135,13 +147,13 @@ private:
 	void		PaintText(HDC hdc, ULONG nLineNo, int x, int y, RECT *bounds);
 	int			PaintMargin(HDC hdc, ULONG line, int x, int y);
 
-	LONG		InvalidateRange(ULONG nStart, ULONG nFinish);
+	LONG		InvalidateRange(size_w nStart, size_w nFinish);
 	LONG		InvalidateLine(ULONG nLineNo, bool forceAnalysis);
 	VOID		UpdateLine(ULONG nLineNo);
 
 	
-	int			ApplyTextAttributes(ULONG nLineNo, ULONG offset, ULONG &nColumn, TCHAR *szText, int nTextLen, ATTR *attr);
-	int			ApplySelection(USPDATA *uspData, ULONG nLineNo, ULONG nOffset, ULONG nTextLen);
+	int			ApplyTextAttributes(ULONG nLineNo, size_w offset, ULONG &nColumn, TCHAR *szText, int nTextLen, ATTR *attr);
+	int			ApplySelection(USPDATA *uspData, ULONG nLineNo, size_w nOffset, ULONG nTextLen);
 	int			SyntaxColour(TCHAR *szText, ULONG nTextLen, ATTR *attr);
 	int			StripCRLF(TCHAR *szText, ATTR *attrList, int nLength, bool fAllow);
 	void		MarkCRLF(USPDATA *uspData, TCHAR *szText, int nLength, ATTR *attr);
@@ -171,11 +183,11 @@ private:
 	//
 	//	Caret/Cursor positioning
 	//
-	BOOL		MouseCoordToFilePos(int x, int y, ULONG *pnLineNo, ULONG *pnFileOffset, int *px);//, ULONG *pnLineLen=0);
+	BOOL		MouseCoordToFilePos(int x, int y, ULONG *pnLineNo, size_w *pnFileOffset, int *px);//, ULONG *pnLineLen=0);
 	VOID		RepositionCaret();
 	//VOID		MoveCaret(int x, int y);
 	VOID		UpdateCaretXY(int x, ULONG lineno);
-	VOID		UpdateCaretOffset(ULONG offset, BOOL fTrailing, int *outx=0, ULONG *outlineno=0);
+	VOID		UpdateCaretOffset(size_w offset, BOOL fTrailing, int *outx=0, ULONG *outlineno=0);
 	VOID		Smeg(BOOL fAdvancing);
 
 	VOID		MoveWordPrev();
@@ -270,11 +282,11 @@ private:
 
 	// Cursor/Caret position 
 	ULONG		m_nCurrentLine;
-	ULONG		m_nSelectionStart;
-	ULONG		m_nSelectionEnd;
-	ULONG		m_nCursorOffset;
-	ULONG		m_nSelMarginOffset1;
-	ULONG		m_nSelMarginOffset2;
+	size_w		m_nSelectionStart;
+	size_w		m_nSelectionEnd;
+	size_w		m_nCursorOffset;
+	size_w		m_nSelMarginOffset1;
+	size_w		m_nSelMarginOffset2;
 	int			m_nCaretPosX;
 	int			m_nAnchorPosX;
 	
@@ -310,9 +322,9 @@ private:
 
 	// Cache for USPDATA objects
 	USPCACHE    *m_uspCache;
-	USPDATA		*GetUspData(HDC hdc, ULONG nLineNo, ULONG *nOffset=0);
-	USPCACHE    *GetUspCache(HDC hdc, ULONG nLineNo, ULONG *nOffset=0);
-	bool		 GetLogAttr(ULONG nLineNo, USPCACHE **puspCache, CSCRIPT_LOGATTR **plogAttr=0, ULONG *pnOffset=0);
+	USPDATA		*GetUspData(HDC hdc, ULONG nLineNo, size_w *nOffset=0);
+	USPCACHE    *GetUspCache(HDC hdc, ULONG nLineNo, size_w *nOffset=0);
+	bool		 GetLogAttr(ULONG nLineNo, USPCACHE **puspCache, CSCRIPT_LOGATTR **plogAttr=0, size_w *pnOffset=0);
 
 	TextDocument *m_pTextDoc;
 };
@@ -22,11 +22,11 @@
 //
 ULONG TextView::EnterText(TCHAR *szText, ULONG nLength)
 {
-	ULONG selstart = min(m_nSelectionStart, m_nSelectionEnd);
-	ULONG selend   = max(m_nSelectionStart, m_nSelectionEnd);
+	size_w selstart = min(m_nSelectionStart, m_nSelectionEnd);
+	size_w selend   = max(m_nSelectionStart, m_nSelectionEnd);
 
 	BOOL  fReplaceSelection = (selstart == selend) ? FALSE : TRUE;
-	ULONG erase_len = nLength;
+	size_w erase_len = nLength;
 
 	switch(m_nEditMode)
 	{
@@ -61,14 +61,14 @@ ULONG TextView::EnterText(TCHAR *szText, ULONG nLength)
 		}
 		else
 		{
-			ULONG lineoff;
+			size_w lineoff;
 			USPCACHE *uspCache = GetUspCache(0, m_nCurrentLine, &lineoff);
 
 			// single-character overwrite - must behave like 'forward delete'
 			// and remove a whole character-cluster (i.e. maybe more than 1 char)
 			if(nLength == 1)
 			{
-				ULONG oldpos = m_nCursorOffset;
+				size_w oldpos = m_nCursorOffset;
 				MoveCharNext();
 				erase_len = m_nCursorOffset - oldpos;
 				m_nCursorOffset = oldpos;
@@ -108,8 +108,8 @@ ULONG TextView::EnterText(TCHAR *szText, ULONG nLength)
 
 BOOL TextView::ForwardDelete()
 {
-	ULONG selstart = min(m_nSelectionStart, m_nSelectionEnd);
-	ULONG selend   = max(m_nSelectionStart, m_nSelectionEnd);
+	size_w selstart = min(m_nSelectionStart, m_nSelectionEnd);
+	size_w selend   = max(m_nSelectionStart, m_nSelectionEnd);
 
 	if(selstart != selend)
 	{
@@ -139,7 +139,7 @@ BOOL TextView::ForwardDelete()
 		}
 		while(!logAttr[index].fCharStop);*/
 
-		ULONG oldpos = m_nCursorOffset;
+		size_w oldpos = m_nCursorOffset;
 		MoveCharNext();
 
 		m_pTextDoc->erase_text(oldpos, m_nCursorOffset - oldpos);
@@ -164,8 +164,8 @@ BOOL TextView::ForwardDelete()
 
 BOOL TextView::BackDelete()
 {
-	ULONG selstart = min(m_nSelectionStart, m_nSelectionEnd);
-	ULONG selend   = max(m_nSelectionStart, m_nSelectionEnd);
+	size_w selstart = min(m_nSelectionStart, m_nSelectionEnd);
+	size_w selend   = max(m_nSelectionStart, m_nSelectionEnd);
 
 	// if there's a selection then delete it
 	if(selstart != selend)
@@ -178,7 +178,7 @@ BOOL TextView::BackDelete()
 	else if(m_nCursorOffset > 0)
 	{
 		//m_nCursorOffset--;
-		ULONG oldpos = m_nCursorOffset;
+		size_w oldpos = m_nCursorOffset;
 		MoveCharPrev();
 		//m_pTextDoc->erase_text(m_nCursorOffset, 1);
 		m_pTextDoc->erase_text(m_nCursorOffset, oldpos - m_nCursorOffset);
@@ -196,8 +196,6 @@ BOOL TextView::BackDelete()
 
 void TextView::Smeg(BOOL fAdvancing)
 {
-	m_pTextDoc->init_linebuffer();
-
 	m_nLineCount   = m_pTextDoc->linecount();
 
 	UpdateMetrics();
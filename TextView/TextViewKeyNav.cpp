@@ -33,7 +33,7 @@ bool IsKeyPressed(UINT nVirtKey)
 //
 //	Get the UspCache and logical attributes for specified line
 //
-bool TextView::GetLogAttr(ULONG nLineNo, USPCACHE **puspCache, CSCRIPT_LOGATTR **plogAttr, ULONG *pnOffset)
+bool TextView::GetLogAttr(ULONG nLineNo, USPCACHE **puspCache, CSCRIPT_LOGATTR **plogAttr, size_w *pnOffset)
 {
 	if((*puspCache = GetUspCache(0, nLineNo, pnOffset)) == 0)
 		return false;
@@ -50,7 +50,7 @@ bool TextView::GetLogAttr(ULONG nLineNo, USPCACHE **puspCache, CSCRIPT_LOGATTR *
 VOID TextView::MoveLineUp(int numLines)
 {
 	USPDATA			* uspData;
-	ULONG			  lineOffset;
+	size_w			  lineOffset;
 	
 	int				  charPos;
 	BOOL			  trailing;
@@ -72,7 +72,7 @@ VOID TextView::MoveLineUp(int numLines)
 VOID TextView::MoveLineDown(int numLines)
 {
 	USPDATA			* uspData;
-	ULONG			  lineOffset;
+	size_w			  lineOffset;
 	
 	int				  charPos;
 	BOOL			  trailing;
@@ -95,7 +95,7 @@ VOID TextView::MoveWordPrev()
 {
 	USPCACHE		* uspCache;
 	CSCRIPT_LOGATTR * logAttr;
-	ULONG			  lineOffset;
+	size_w			  lineOffset;
 	int				  charPos;
 
 	// get Uniscribe data for current line
@@ -103,7 +103,7 @@ VOID TextView::MoveWordPrev()
 		return;
 
 	// move 1 character to left
-	charPos = m_nCursorOffset - lineOffset - 1; 
+	charPos = (int)(m_nCursorOffset - lineOffset) - 1; 
 
 	// skip to end of *previous* line if necessary
 	if(charPos < 0)
@@ -138,14 +138,14 @@ VOID TextView::MoveWordNext()
 {
 	USPCACHE		* uspCache;
 	CSCRIPT_LOGATTR * logAttr;
-	ULONG			  lineOffset;
+	size_w			  lineOffset;
 	int				  charPos;
 
 	// get Uniscribe data for current line
 	if(!GetLogAttr(m_nCurrentLine, &uspCache, &logAttr, &lineOffset))
 		return;
 
-	charPos = m_nCursorOffset - lineOffset;
+	charPos = (int)(m_nCursorOffset - lineOffset);
 
 	// if already at end-of-line, skip to next line
 	if(charPos == uspCache->length_CRLF)
@@ -181,14 +181,14 @@ VOID TextView::MoveWordStart()
 {
 	USPCACHE		* uspCache;
 	CSCRIPT_LOGATTR * logAttr;
-	ULONG			  lineOffset;
+	size_w			  lineOffset;
 	int				  charPos;
 
 	// get Uniscribe data for current line
 	if(!GetLogAttr(m_nCurrentLine, &uspCache, &logAttr, &lineOffset))
 		return;
 
-	charPos  = m_nCursorOffset - lineOffset;
+	charPos  = (int)(m_nCursorOffset - lineOffset);
 
 	while(charPos > 0 && !logAttr[charPos-1].fWhiteSpace)
 		charPos--;
@@ -203,14 +203,14 @@ VOID TextView::MoveWordEnd()
 {
 	USPCACHE		* uspCache;
 	CSCRIPT_LOGATTR * logAttr;
-	ULONG			  lineOffset;
+	size_w			  lineOffset;
 	int				  charPos;
 
 	// get Uniscribe data for current line
 	if(!GetLogAttr(m_nCurrentLine, &uspCache, &logAttr, &lineOffset))
 		return;
 
-	charPos  = m_nCursorOffset - lineOffset;
+	charPos  = (int)(m_nCursorOffset - lineOffset);
 
 	while(charPos < uspCache->length_CRLF && !logAttr[charPos].fWhiteSpace)
 		charPos++;
@@ -225,14 +225,14 @@ VOID TextView::MoveCharPrev()
 {
 	USPCACHE		* uspCache;
 	CSCRIPT_LOGATTR * logAttr;
-	ULONG			  lineOffset;
+	size_w			  lineOffset;
 	int				  charPos;
 
 	// get Uniscribe data for current line
 	if(!GetLogAttr(m_nCurrentLine, &uspCache, &logAttr, &lineOffset))
 		return;
 
-	charPos = m_nCursorOffset - lineOffset;
+	charPos = (int)(m_nCursorOffset - lineOffset);
 
 	// find the previous valid character-position
 	for( --charPos; charPos >= 0; charPos--)
@@ -264,14 +264,14 @@ VOID TextView::MoveCharNext()
 {
 	USPCACHE		* uspCache;
 	CSCRIPT_LOGATTR * logAttr;
-	ULONG			  lineOffset;
+	size_w			  lineOffset;
 	int				  charPos;
 
 	// get Uniscribe data for specified line
 	if(!GetLogAttr(m_nCurrentLine, &uspCache, &logAttr, &lineOffset))
 		return;
 
-	charPos = m_nCursorOffset - lineOffset;
+	charPos = (int)(m_nCursorOffset - lineOffset);
 
 	// find the next valid character-position
 	for( ++charPos; charPos <= uspCache->length_CRLF; charPos++)
@@ -298,7 +298,7 @@ VOID TextView::MoveCharNext()
 //
 VOID TextView::MoveLineStart(ULONG lineNo)
 {
-	ULONG			  lineOffset;
+	size_w			  lineOffset;
 	USPCACHE		* uspCache;
 	CSCRIPT_LOGATTR * logAttr;
 	int				  charPos;
@@ -307,7 +307,7 @@ VOID TextView::MoveLineStart(ULONG lineNo)
 	if(!GetLogAttr(lineNo, &uspCache, &logAttr, &lineOffset))
 		return;
 
-	charPos  = m_nCursorOffset - lineOffset;
+	charPos  = (int)(m_nCursorOffset - lineOffset);
 	
 	// if already at start of line, skip *forwards* past any whitespace
 	if(m_nCursorOffset == lineOffset)
@@ -98,8 +98,8 @@ LONG TextView::OnContextMenu(HWND hwndParam, int x, int y)
 //
 LONG TextView::OnLButtonDown(UINT nFlags, int mx, int my)
 {
-	ULONG nLineNo;
-	ULONG nFileOff;
+	ULONG  nLineNo;
+	size_w nFileOff;
 	
 	// regular mouse input - mouse is within 
 	if(mx >= LeftMarginWidth())
@@ -231,7 +231,8 @@ LONG TextView::OnLButtonDblClick(UINT nFlags, int mx, int my)
 	// regular mouse input - mouse is within scrolling viewport
 	if(mx >= LeftMarginWidth())
 	{
-		ULONG lineno, fileoff;
+		ULONG  lineno;
+		size_w fileoff;
 		int   xpos;
 
 		// map the mouse-coordinates to a real file-offset-coordinate
@@ -266,7 +267,8 @@ LONG TextView::OnMouseMove(UINT nFlags, int mx, int my)
 {
 	if(m_nSelectionMode)
 	{
-		ULONG	nLineNo, nFileOff;
+		ULONG	nLineNo;
+		size_w	nFileOff;
 		BOOL	fCurChanged = FALSE;
 
 		RECT	rect;
@@ -328,7 +330,7 @@ LONG TextView::OnMouseMove(UINT nFlags, int mx, int my)
 		fCurChanged = m_nSelectionEnd == nFileOff ? FALSE : TRUE;
 		//if(m_nSelectionEnd != nFileOff)
 		{
-			ULONG linelen;
+			size_w linelen;
 			m_pTextDoc->lineinfo_from_lineno(nLineNo, 0, &linelen, 0, 0);
 
 			m_nCursorOffset	= nFileOff;
@@ -386,13 +388,50 @@ LONG TextView::OnMouseMove(UINT nFlags, int mx, int my)
 //
 //	WM_TIMER handler
 //
-//	Used to create regular scrolling 
+//	Used to create regular scrolling, to follow the background indexing
+//	of a document, and to compact the document's span-table once editing
+//	has paused
 //
 LONG TextView::OnTimer(UINT nTimerId)
 {
 	int	  dx = 0, dy = 0;	// scrolling vectors
 	RECT  rect;
 	POINT pt;
+
+	if(nTimerId == INDEX_TIMER)
+	{
+		ULONG nOldCount = m_nLineCount;
+		int	  nOldWidth = m_nLinenoWidth;
+		bool  fDone		= m_pTextDoc->poll_linebuffer();
+
+		m_nLineCount = m_pTextDoc->linecount();
+
+		UpdateMarginWidth();
+		SetupScrollbars();
+
+		// repaint if the margin has widened or new lines have come into view
+		if(m_nLinenoWidth != nOldWidth || nOldCount < m_nVScrollPos + m_nWindowLines)
+			RefreshWindow();
+
+		if(fDone)
+		{
+			KillTimer(m_hWnd, INDEX_TIMER);
+			NotifyParent(TVN_INDEXED);
+		}
+
+		return 0;
+	}
+
+	if(nTimerId == IDLE_TIMER)
+	{
+		// keep going in small steps until the whole document is done
+		if(m_pTextDoc->m_seq.compact(IDLE_SPANS))
+			SetTimer(m_hWnd, IDLE_TIMER, 0, 0);
+		else
+			KillTimer(m_hWnd, IDLE_TIMER);
+
+		return 0;
+	}
 	
 	// find client area, but make it an even no. of lines
 	GetClientRect(m_hWnd, &rect);
@@ -470,13 +509,13 @@ LONG TextView::OnTimer(UINT nTimerId)
 BOOL TextView::MouseCoordToFilePos(	int		 mx,			// [in]  mouse x-coord
 									int		 my,			// [in]  mouse x-coord
 									ULONG	*pnLineNo,		// [out] line number
-									ULONG	*pnFileOffset,  // [out] zero-based file-offset (in chars)
+									size_w	*pnFileOffset,  // [out] zero-based file-offset (in chars)
 									int		*psnappedX		// [out] adjusted x coord of caret
 									)
 {
-	ULONG nLineNo;
-	ULONG off_chars;
-	RECT  rect;
+	ULONG  nLineNo;
+	size_w off_chars;
+	RECT   rect;
 	int	  cp;
 
 	// get scrollable area
@@ -551,10 +590,10 @@ LONG TextView::InvalidateLine(ULONG nLineNo, bool forceAnalysis)
 //
 //	Redraw any line which spans the specified range of text
 //
-LONG TextView::InvalidateRange(ULONG nStart, ULONG nFinish)
+LONG TextView::InvalidateRange(size_w nStart, size_w nFinish)
 {
-	ULONG start  = min(nStart, nFinish);
-	ULONG finish = max(nStart, nFinish);
+	size_w start  = min(nStart, nFinish);
+	size_w finish = max(nStart, nFinish);
 	
 	int   ypos;
 	RECT  rect;
@@ -562,9 +601,9 @@ LONG TextView::InvalidateRange(ULONG nStart, ULONG nFinish)
 	TextIterator itor;
 
 	// information about current line:
-	ULONG lineno;
-	ULONG off_chars;
-	ULONG len_chars;
+	ULONG  lineno;
+	size_w off_chars;
+	size_w len_chars;
 
 	// nothing to do?
 	if(start == finish)
@@ -675,11 +714,11 @@ VOID TextView::UpdateCaretXY(int xpos, ULONG lineno)
 //	Reposition the caret based on cursor-offset
 //	return the resulting x-coord and line#
 //
-VOID TextView::UpdateCaretOffset(ULONG offset, BOOL fTrailing, int *outx, ULONG *outlineno)
+VOID TextView::UpdateCaretOffset(size_w offset, BOOL fTrailing, int *outx, ULONG *outlineno)
 {
 	ULONG		lineno = 0;
 	int			xpos = 0;
-	ULONG		off_chars;
+	size_w		off_chars;
 	USPDATA	  * uspData;
 
 	// get line information from cursor-offset
@@ -692,9 +731,9 @@ VOID TextView::UpdateCaretOffset(ULONG offset, BOOL fTrailing, int *outx, ULONG
 			off_chars = m_nCursorOffset - off_chars;
 			
 			if(fTrailing && off_chars > 0)
-				UspOffsetToX(uspData, off_chars-1, TRUE, &xpos);
+				UspOffsetToX(uspData, (int)off_chars-1, TRUE, &xpos);
 			else
-				UspOffsetToX(uspData, off_chars, FALSE, &xpos);
+				UspOffsetToX(uspData, (int)off_chars, FALSE, &xpos);
 
 			// update caret position
 			UpdateCaretXY(xpos, lineno);
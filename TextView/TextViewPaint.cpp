@@ -29,12 +29,12 @@ VOID TextView::RefreshWindow()
 	InvalidateRect(m_hWnd, NULL, FALSE);
 }
 
-USPCACHE *TextView::GetUspCache(HDC hdc, ULONG nLineNo, ULONG *nOffset/*=0*/)
+USPCACHE *TextView::GetUspCache(HDC hdc, ULONG nLineNo, size_w *nOffset/*=0*/)
 {
 	TCHAR	 buff[TEXTBUFSIZE];
 	ATTR	 attr[TEXTBUFSIZE];
 	ULONG	 colno = 0;
-	ULONG	 off_chars = 0;
+	size_w	 off_chars = 0;
 	int		 len;
 	HDC		 hdcTemp;
 	
@@ -139,7 +139,7 @@ USPCACHE *TextView::GetUspCache(HDC hdc, ULONG nLineNo, ULONG *nOffset/*=0*/)
 //
 //	Return a fully-analyzed USPDATA object for the specified line
 //
-USPDATA *TextView::GetUspData(HDC hdc, ULONG nLineNo, ULONG *nOffset/*=0*/)
+USPDATA *TextView::GetUspData(HDC hdc, ULONG nLineNo, size_w *nOffset/*=0*/)
 {
 	USPCACHE *uspCache = GetUspCache(hdc, nLineNo, nOffset);
 
@@ -446,7 +446,8 @@ int TextView::PaintMargin(HDC hdc, ULONG nLineNo, int xpos, int ypos)
 void TextView::PaintText(HDC hdc, ULONG nLineNo, int xpos, int ypos, RECT *bounds)
 {
 	USPDATA * uspData;
-	ULONG	  lineOffset;
+	size_w	  lineOffset;
+	size_w	  lineEnd;
 
 	// grab the USPDATA for this line
 	uspData = GetUspData(hdc, nLineNo, &lineOffset);
@@ -457,8 +458,14 @@ void TextView::PaintText(HDC hdc, ULONG nLineNo, int xpos, int ypos, RECT *bound
 	else
 		UspSetSelColor(uspData, GetColour(TXC_HIGHLIGHTTEXT2), GetColour(TXC_HIGHLIGHT2));
 
-	// update selection-attribute information for the line
-	UspApplySelection(uspData, m_nSelectionStart - lineOffset, m_nSelectionEnd - lineOffset);
+	// update selection-attribute information for the line. The selection
+	// is clipped to the line first, as the offsets might not fit in an int
+	lineEnd = lineOffset + uspData->stringLen;
+
+	UspApplySelection(uspData, 
+		(int)(min(max(m_nSelectionStart, lineOffset), lineEnd) - lineOffset), 
+		(int)(min(max(m_nSelectionEnd,   lineOffset), lineEnd) - lineOffset)
+		);
 
 	ApplySelection(uspData, nLineNo, lineOffset, uspData->stringLen);
 
@@ -466,7 +473,7 @@ void TextView::PaintText(HDC hdc, ULONG nLineNo, int xpos, int ypos, RECT *bound
 	UspTextOut(uspData, hdc, xpos, ypos, m_nLineHeight, m_nHeightAbove, bounds);
 }
 
-int	TextView::ApplySelection(USPDATA *uspData, ULONG nLine, ULONG nOffset, ULONG nTextLen)
+int	TextView::ApplySelection(USPDATA *uspData, ULONG nLine, size_w nOffset, ULONG nTextLen)
 {
 	int selstart = 0;
 	int selend   = 0;
@@ -502,12 +509,12 @@ int	TextView::ApplySelection(USPDATA *uspData, ULONG nLine, ULONG nOffset, ULONG
 //
 //	Returns new length of buffer if text has been modified
 //
-int TextView::ApplyTextAttributes(ULONG nLineNo, ULONG nOffset, ULONG &nColumn, TCHAR *szText, int nTextLen, ATTR *attr)
+int TextView::ApplyTextAttributes(ULONG nLineNo, size_w nOffset, ULONG &nColumn, TCHAR *szText, int nTextLen, ATTR *attr)
 {
 	int i;
 
-	ULONG selstart = min(m_nSelectionStart, m_nSelectionEnd);
-	ULONG selend   = max(m_nSelectionStart, m_nSelectionEnd);
+	size_w selstart = min(m_nSelectionStart, m_nSelectionEnd);
+	size_w selend   = max(m_nSelectionStart, m_nSelectionEnd);
 
 	//
 	//	STEP 1. Apply the "base coat"
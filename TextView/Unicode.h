@@ -22,7 +22,7 @@ typedef unsigned char	UTF8;
 #define UNI_SUR_LOW_START    (UTF32)0xDC00
 #define UNI_SUR_LOW_END      (UTF32)0xDFFF
 
-#define SWAPWORD(val) (((UTF16)(val) << 8) | ((UTF16)(val) >> 8))
+#define SWAPWORD(val) ((UTF16)(((UTF16)(val) << 8) | ((UTF16)(val) >> 8)))
 
 //
 //	Conversions between UTF-8 and a single UTF-32 value
@@ -0,0 +1,633 @@
+//
+//	MODULE:		lineindex.cpp
+//
+//	PURPOSE:	Line-offset index for the TextDocument
+//
+//	NOTES:		www.catch22.net
+//
+
+#define STRICT
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+#include <algorithm>
+#include "lineindex.h"
+
+//
+//	Blocks are split once they hold twice this many lines, and merged
+//	with a neighbour once they fall below a quarter of it
+//
+#define LINEBLOCK_SIZE	256
+
+lineindex::lineindex()
+{
+	numlines	= 0;
+	total_bytes	= 0;
+	total_chars	= 0;
+}
+
+lineindex::~lineindex()
+{
+	clear();
+}
+
+//
+//	lineindex::clear
+//
+//	Remove every line from the index
+//
+void lineindex::clear()
+{
+	for(size_t i = 0; i < blocks.size(); i++)
+		delete blocks[i];
+
+	blocks.clear();
+	tree_lines.clear();
+	tree_bytes.clear();
+	tree_chars.clear();
+
+	numlines	= 0;
+	total_bytes	= 0;
+	total_chars	= 0;
+}
+
+//
+//	lineindex::append
+//
+//	Add a line to the end of the index - used when a whole document is
+//	indexed in one pass
+//
+bool lineindex::append(size_w length_bytes, size_w length_chars)
+{
+	line   ln = { length_bytes, length_chars };
+	block *blk;
+	size_t b;
+
+	if(blocks.empty() || blocks.back()->count >= LINEBLOCK_SIZE)
+	{
+		// the block just filled won't grow again, so drop its spare capacity
+		if(!blocks.empty())
+			std::vector<BYTE>(blocks.back()->data).swap(blocks.back()->data);
+
+		if((blk = new block) == 0)
+			return false;
+
+		blk->count = 0;
+		blk->bytes = 0;
+		blk->chars = 0;
+		blocks.push_back(blk);
+
+		fenwick_push(tree_lines, 0);
+		fenwick_push(tree_bytes, 0);
+		fenwick_push(tree_chars, 0);
+	}
+
+	b	= blocks.size() - 1;
+	blk = blocks[b];
+	encode(blk->data, ln);
+
+	blk->count += 1;
+	blk->bytes += length_bytes;
+	blk->chars += length_chars;
+
+	fenwick_add(tree_lines, b, 1);
+	fenwick_add(tree_bytes, b, length_bytes);
+	fenwick_add(tree_chars, b, length_chars);
+
+	numlines	+= 1;
+	total_bytes += length_bytes;
+	total_chars += length_chars;
+
+	return true;
+}
+
+//
+//	lineindex::append
+//
+//	Move every line of another index onto the end of this one, leaving
+//	the other empty. Whole blocks change hands, so nothing is done per
+//	line, and only the incoming blocks are added to the Fenwick trees -
+//	this joins up indexes that were built separately
+//
+void lineindex::append(lineindex &source)
+{
+	block *blk;
+	size_t i;
+
+	if(source.blocks.empty())
+		return;
+
+	// drop the spare capacity of the blocks that meet at the join
+	if(!blocks.empty())
+		std::vector<BYTE>(blocks.back()->data).swap(blocks.back()->data);
+
+	std::vector<BYTE>(source.blocks.back()->data).swap(source.blocks.back()->data);
+
+	for(i = 0; i < source.blocks.size(); i++)
+	{
+		blk = source.blocks[i];
+		blocks.push_back(blk);
+
+		fenwick_push(tree_lines, blk->count);
+		fenwick_push(tree_bytes, blk->bytes);
+		fenwick_push(tree_chars, blk->chars);
+
+		numlines	+= (ULONG)blk->count;
+		total_bytes += blk->bytes;
+		total_chars += blk->chars;
+	}
+
+	source.blocks.clear();
+	source.clear();
+}
+
+//
+//	lineindex::replace
+//
+//	Replace 'count' lines, starting at line 'first', with 'numlines' new ones.
+//	The blocks holding the old lines are unpacked, edited and packed again.
+//	When they change in number (because blocks had to be split or merged)
+//	the Fenwick trees are rebuilt from the block totals, otherwise only the
+//	one block's totals are updated
+//
+bool lineindex::replace(ULONG first, ULONG count, const line *lines, ULONG num)
+{
+	std::vector<line> work;
+	size_w pos = first;
+	size_t b   = 0;
+	size_t e   = 0;
+	size_t i;
+
+	if(first > numlines || count > numlines - first)
+		return false;
+
+	if(count == 0 && num == 0)
+		return true;
+
+	// unpack the block holding the first line, and any more that the old
+	// lines run on into. The end of the index is the end of the last block
+	if(!blocks.empty())
+	{
+		if(first == numlines)
+		{
+			b	= blocks.size() - 1;
+			pos = blocks[b]->count;
+		}
+		else
+		{
+			b = fenwick_search(tree_lines, &pos);
+		}
+
+		// most edits change a line or two inside a single block
+		if(splice(b, pos, count, lines, num))
+			return true;
+
+		work.reserve((size_t)blocks[b]->count + num + LINEBLOCK_SIZE);
+
+		for(e = b; e == b || pos + count > work.size(); e++)
+			unpack(e, work);
+	}
+
+	work.erase(work.begin() + (size_t)pos, work.begin() + (size_t)(pos + count));
+	work.insert(work.begin() + (size_t)pos, lines, lines + num);
+
+	// lines have been removed, leaving too few for a block of their own
+	if(num < count && work.size() < LINEBLOCK_SIZE / 4)
+	{
+		if(e < blocks.size())
+		{
+			unpack(e++, work);
+		}
+		else if(b > 0)
+		{
+			std::vector<line> prev;
+
+			unpack(--b, prev);
+			work.insert(work.begin(), prev.begin(), prev.end());
+		}
+	}
+
+	// a block that stays as one block is repacked where it is
+	if(e == b + 1 && !work.empty() && work.size() <= LINEBLOCK_SIZE * 2)
+	{
+		block *blk		= blocks[b];
+		size_w oldcount = blk->count;
+		size_w oldbytes = blk->bytes;
+		size_w oldchars = blk->chars;
+
+		pack(blk, &work[0], work.size());
+
+		// unsigned arithmetic wraps, so a shrinking block adds a 'negative' delta
+		fenwick_add(tree_lines, b, blk->count - oldcount);
+		fenwick_add(tree_bytes, b, blk->bytes - oldbytes);
+		fenwick_add(tree_chars, b, blk->chars - oldchars);
+
+		numlines	+= (ULONG)(blk->count - oldcount);
+		total_bytes += blk->bytes - oldbytes;
+		total_chars += blk->chars - oldchars;
+
+		return true;
+	}
+
+	// otherwise the blocks are replaced by new ones
+	for(i = b; i < e; i++)
+		delete blocks[i];
+
+	blocks.erase(blocks.begin() + b, blocks.begin() + e);
+
+	for(i = 0; i < work.size(); )
+	{
+		block *blk;
+		size_t len = work.size() - i;
+
+		// the last block takes whatever is left over
+		if(len > LINEBLOCK_SIZE * 2)
+			len = LINEBLOCK_SIZE;
+
+		if((blk = new block) == 0)
+			break;
+
+		pack(blk, &work[i], len);
+		blocks.insert(blocks.begin() + b++, blk);
+		i += len;
+	}
+
+	rebuild();
+	return i == work.size();
+}
+
+//
+//	lineindex::splice
+//
+//	Replace lines within a single block by splicing their encoded form,
+//	without unpacking the rest of the block. Returns false, having changed
+//	nothing, when the edit would take the block beyond its size limits
+//
+bool lineindex::splice(size_t b, size_w pos, ULONG count, const line *lines, ULONG num)
+{
+	std::vector<BYTE> data;
+	block	   *blk = blocks[b];
+	const BYTE *ptr;
+	const BYTE *end;
+	size_w		newcount = blk->count - count + num;
+	size_w		bytes	 = 0;
+	size_w		chars	 = 0;
+	size_w		i;
+	size_t		offset;
+	size_t		oldlen;
+	line		ln;
+
+	if(pos + count > blk->count || newcount == 0 || newcount > LINEBLOCK_SIZE * 2 ||
+	   num < count && newcount < LINEBLOCK_SIZE / 4)
+	{
+		return false;
+	}
+
+	// find the encoded lines being replaced, and what they add up to
+	for(ptr = &blk->data[0], i = 0; i < pos; i++)
+		ptr = decode(ptr, &ln);
+
+	for(end = ptr, i = 0; i < count; i++)
+	{
+		end    = decode(end, &ln);
+		bytes -= ln.length_bytes;
+		chars -= ln.length_chars;
+	}
+
+	for(i = 0; i < num; i++)
+	{
+		encode(data, lines[(size_t)i]);
+		bytes += lines[(size_t)i].length_bytes;
+		chars += lines[(size_t)i].length_chars;
+	}
+
+	offset = ptr - &blk->data[0];
+	oldlen = end - ptr;
+
+	// overwrite what overlaps, then insert or erase the difference
+	if(data.size() >= oldlen)
+	{
+		std::copy(data.begin(), data.begin() + oldlen, blk->data.begin() + offset);
+		blk->data.insert(blk->data.begin() + offset + oldlen, data.begin() + oldlen, data.end());
+	}
+	else
+	{
+		std::copy(data.begin(), data.end(), blk->data.begin() + offset);
+		blk->data.erase(blk->data.begin() + offset + data.size(), blk->data.begin() + offset + oldlen);
+	}
+
+	// unsigned arithmetic wraps, so a shrinking block adds a 'negative' delta
+	fenwick_add(tree_lines, b, newcount - blk->count);
+	fenwick_add(tree_bytes, b, bytes);
+	fenwick_add(tree_chars, b, chars);
+
+	numlines	+= (ULONG)(newcount - blk->count);
+	total_bytes += bytes;
+	total_chars += chars;
+
+	blk->count	 = newcount;
+	blk->bytes	+= bytes;
+	blk->chars	+= chars;
+
+	return true;
+}
+
+//
+//	lineindex::encode
+//
+//	Each line is stored as two numbers of 7 bits per byte: its length in
+//	characters, then how many more bytes than characters it has. A line of
+//	fewer than 128 ASCII or UTF-16 characters takes just two bytes
+//
+void lineindex::encode(std::vector<BYTE> &data, const line &ln)
+{
+	size_w value[2] = { ln.length_chars, ln.length_bytes - ln.length_chars };
+
+	for(int i = 0; i < 2; i++)
+	{
+		while(value[i] >= 0x80)
+		{
+			data.push_back((BYTE)(value[i] | 0x80));
+			value[i] >>= 7;
+		}
+
+		data.push_back((BYTE)value[i]);
+	}
+}
+
+//
+//	lineindex::decode
+//
+//	Decode the line stored at 'ptr' and return a pointer to the next one
+//
+const BYTE *lineindex::decode(const BYTE *ptr, line *ln)
+{
+	size_w value[2];
+
+	// the common case of two single-byte values
+	if((ptr[0] & 0x80) == 0 && (ptr[1] & 0x80) == 0)
+	{
+		ln->length_chars = ptr[0];
+		ln->length_bytes = ptr[0] + ptr[1];
+		return ptr + 2;
+	}
+
+	for(int i = 0; i < 2; i++)
+	{
+		int shift = 0;
+
+		for(value[i] = 0; *ptr & 0x80; shift += 7)
+			value[i] |= (size_w)(*ptr++ & 0x7f) << shift;
+
+		value[i] |= (size_w)*ptr++ << shift;
+	}
+
+	ln->length_chars = value[0];
+	ln->length_bytes = value[0] + value[1];
+
+	return ptr;
+}
+
+//
+//	lineindex::unpack
+//
+//	Decode every line of a block onto the end of 'lines'
+//
+void lineindex::unpack(size_t b, std::vector<line> &lines) const
+{
+	const block *blk = blocks[b];
+	const BYTE  *ptr = blk->data.empty() ? 0 : &blk->data[0];
+	line ln;
+
+	for(size_w i = 0; i < blk->count; i++)
+	{
+		ptr = decode(ptr, &ln);
+		lines.push_back(ln);
+	}
+}
+
+//
+//	lineindex::pack
+//
+//	Encode 'count' lines into a block, replacing whatever it held, and
+//	recalculate its totals
+//
+void lineindex::pack(block *blk, const line *lines, size_t count)
+{
+	blk->data.clear();
+	blk->count = count;
+	blk->bytes = 0;
+	blk->chars = 0;
+
+	for(size_t i = 0; i < count; i++)
+	{
+		encode(blk->data, lines[i]);
+		blk->bytes += lines[i].length_bytes;
+		blk->chars += lines[i].length_chars;
+	}
+
+	// a block that has shrunk a long way gives back its spare capacity
+	if(blk->data.capacity() > blk->data.size() * 2)
+		std::vector<BYTE>(blk->data).swap(blk->data);
+}
+
+//
+//	lineindex::rebuild
+//
+//	Rebuild the Fenwick trees from the block totals, in O(n)
+//
+void lineindex::rebuild()
+{
+	size_t n = blocks.size();
+	size_t i, j;
+
+	tree_lines.resize(n);
+	tree_bytes.resize(n);
+	tree_chars.resize(n);
+
+	numlines	= 0;
+	total_bytes	= 0;
+	total_chars	= 0;
+
+	for(i = 0; i < n; i++)
+	{
+		tree_lines[i] = blocks[i]->count;
+		tree_bytes[i] = blocks[i]->bytes;
+		tree_chars[i] = blocks[i]->chars;
+
+		numlines	+= (ULONG)blocks[i]->count;
+		total_bytes += blocks[i]->bytes;
+		total_chars += blocks[i]->chars;
+	}
+
+	// each node passes its sum up to its parent
+	for(i = 1; i <= n; i++)
+	{
+		if((j = i + (i & (0 - i))) <= n)
+		{
+			tree_lines[j - 1] += tree_lines[i - 1];
+			tree_bytes[j - 1] += tree_bytes[i - 1];
+			tree_chars[j - 1] += tree_chars[i - 1];
+		}
+	}
+}
+
+//
+//	lineindex::fenwick_add
+//
+//	Add 'delta' to the total of block 'i'
+//
+void lineindex::fenwick_add(fenwick &tree, size_t i, size_w delta)
+{
+	for(i++; i <= tree.size(); i += i & (0 - i))
+		tree[i - 1] += delta;
+}
+
+//
+//	lineindex::fenwick_push
+//
+//	Add a block with the specified total to the end of the tree
+//
+void lineindex::fenwick_push(fenwick &tree, size_w value)
+{
+	size_t n = tree.size() + 1;
+
+	tree.push_back(value + fenwick_prefix(tree, n - 1) - fenwick_prefix(tree, n - (n & (0 - n))));
+}
+
+//
+//	lineindex::fenwick_prefix
+//
+//	Return the sum of the totals of the first 'i' blocks
+//
+size_w lineindex::fenwick_prefix(const fenwick &tree, size_t i) const
+{
+	size_w sum = 0;
+
+	for( ; i > 0; i -= i & (0 - i))
+		sum += tree[i - 1];
+
+	return sum;
+}
+
+//
+//	lineindex::fenwick_search
+//
+//	Find the block in which 'offset' falls - the first block whose running
+//	total is greater than 'offset' - and make 'offset' relative to it.
+//	Returns the number of blocks if 'offset' is beyond the end
+//
+size_t lineindex::fenwick_search(const fenwick &tree, size_w *offset) const
+{
+	size_t pos  = 0;
+	size_t step = 1;
+
+	while(step * 2 <= tree.size())
+		step *= 2;
+
+	for( ; step > 0; step /= 2)
+	{
+		if(pos + step <= tree.size() && tree[pos + step - 1] <= *offset)
+		{
+			pos		+= step;
+			*offset -= tree[pos - 1];
+		}
+	}
+
+	return pos;
+}
+
+//
+//	lineindex::lineinfo
+//
+//	Return the position and length of the specified line
+//
+bool lineindex::lineinfo(ULONG lineno, size_w *off_bytes, size_w *len_bytes, size_w *off_chars, size_w *len_chars) const
+{
+	size_w rel = lineno;
+	size_w ob, oc;
+	size_t b;
+
+	if(lineno >= numlines)
+		return false;
+
+	b  = fenwick_search(tree_lines, &rel);
+	ob = fenwick_prefix(tree_bytes, b);
+	oc = fenwick_prefix(tree_chars, b);
+
+	const BYTE *ptr = &blocks[b]->data[0];
+	line ln;
+
+	for(ptr = decode(ptr, &ln); rel > 0; rel--)
+	{
+		ob += ln.length_bytes;
+		oc += ln.length_chars;
+		ptr = decode(ptr, &ln);
+	}
+
+	if(off_bytes) *off_bytes = ob;
+	if(len_bytes) *len_bytes = ln.length_bytes;
+	if(off_chars) *off_chars = oc;
+	if(len_chars) *len_chars = ln.length_chars;
+
+	return true;
+}
+
+//
+//	lineindex::lineno_from_offset
+//
+//	Find the line holding the specified byte/character offset, and where
+//	it starts. An offset at (or beyond) the end of the document belongs to
+//	the last line
+//
+ULONG lineindex::lineno_from_offset(const fenwick &tree, size_w offset, bool bytes, size_w *linestart) const
+{
+	const BYTE *ptr;
+	size_w start = offset;
+	size_w lineno;
+	size_w i;
+	size_t b;
+	line   ln;
+
+	if(numlines == 0)
+	{
+		if(linestart) *linestart = 0;
+		return 0;
+	}
+
+	if((b = fenwick_search(tree, &offset)) == blocks.size())
+	{
+		if(linestart)
+			lineinfo(numlines - 1, bytes ? linestart : 0, 0, bytes ? 0 : linestart, 0);
+
+		return numlines - 1;
+	}
+
+	ptr	   = &blocks[b]->data[0];
+	lineno = fenwick_prefix(tree_lines, b);
+
+	for(i = 0; i < blocks[b]->count; i++)
+	{
+		ptr = decode(ptr, &ln);
+
+		if(offset < (bytes ? ln.length_bytes : ln.length_chars))
+			break;
+
+		offset -= bytes ? ln.length_bytes : ln.length_chars;
+	}
+
+	if(linestart)
+		*linestart = start - offset;
+
+	return (ULONG)(lineno + i);
+}
+
+ULONG lineindex::lineno_from_bytes(size_w offset_bytes, size_w *linestart_bytes) const
+{
+	return lineno_from_offset(tree_bytes, offset_bytes, true, linestart_bytes);
+}
+
+ULONG lineindex::lineno_from_chars(size_w offset_chars, size_w *linestart_chars) const
+{
+	return lineno_from_offset(tree_chars, offset_chars, false, linestart_chars);
+}
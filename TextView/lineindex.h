@@ -0,0 +1,84 @@
+#ifndef LINEINDEX_INCLUDED
+#define LINEINDEX_INCLUDED
+
+#include <vector>
+#include "sequence.h"
+
+//
+//	lineindex
+//
+//	Records the length of every line of a document, in bytes and in
+//	characters. Lines are held in blocks of a few hundred, and Fenwick
+//	(binary-indexed) trees over the block totals find the block that holds
+//	any line number, byte offset or character offset in O(log n). A run of
+//	lines can then be replaced as the document is edited without touching
+//	any of the lines that follow it.
+//
+//	Within a block the lengths are packed into a few bytes per line, so
+//	the index costs around 2-3 bytes for each line of the document
+//
+class lineindex
+{
+public:
+	struct line
+	{
+		size_w	length_bytes;
+		size_w	length_chars;
+	};
+
+	lineindex();
+	~lineindex();
+
+	void	clear();
+	bool	append(size_w length_bytes, size_w length_chars);
+	void	append(lineindex &source);
+	bool	replace(ULONG first, ULONG count, const line *lines, ULONG numlines);
+
+	ULONG	count() const		{ return numlines; }
+	size_w	size_bytes() const	{ return total_bytes; }
+	size_w	size_chars() const	{ return total_chars; }
+
+	bool	lineinfo(ULONG lineno, size_w *off_bytes, size_w *len_bytes, size_w *off_chars, size_w *len_chars) const;
+	ULONG	lineno_from_bytes(size_w offset_bytes, size_w *linestart_bytes = 0) const;
+	ULONG	lineno_from_chars(size_w offset_chars, size_w *linestart_chars = 0) const;
+
+private:
+
+	// a block's totals are those last added to the Fenwick trees
+	struct block
+	{
+		std::vector<BYTE>	data;
+		size_w				count;
+		size_w				bytes;
+		size_w				chars;
+	};
+
+	typedef std::vector<size_w> fenwick;
+
+	static void		  encode(std::vector<BYTE> &data, const line &ln);
+	static const BYTE *decode(const BYTE *ptr, line *ln);
+
+	void	unpack(size_t b, std::vector<line> &lines) const;
+	void	pack(block *blk, const line *lines, size_t count);
+	void	rebuild();
+
+	void	fenwick_add(fenwick &tree, size_t i, size_w delta);
+	void	fenwick_push(fenwick &tree, size_w value);
+	size_w	fenwick_prefix(const fenwick &tree, size_t i) const;
+	size_t	fenwick_search(const fenwick &tree, size_w *offset) const;
+
+	ULONG	lineno_from_offset(const fenwick &tree, size_w offset, bool bytes, size_w *linestart) const;
+	bool	splice(size_t b, size_w pos, ULONG count, const line *lines, ULONG num);
+
+	std::vector<block *> blocks;
+
+	fenwick	tree_lines;
+	fenwick	tree_bytes;
+	fenwick	tree_chars;
+
+	ULONG	numlines;
+	size_w	total_bytes;
+	size_w	total_chars;
+};
+
+#endif
@@ -0,0 +1,479 @@
+//
+//	MODULE:		linescan.cpp
+//
+//	PURPOSE:	Fast scanning for line-breaks while the line-buffer is built
+//
+//	NOTES:		www.catch22.net
+//
+//				The vector kernels only answer "is everything in this block
+//				plain single-unit text?", which covers almost all of a typical
+//				document. Anything else - multi-byte UTF-8, surrogate pairs,
+//				a possible newline - is stepped over (or refused) one character
+//				at a time using exactly the rules that TextDocument::getchar and
+//				the Unicode.c conversions apply, so both always agree on where
+//				a line ends and how many characters it holds
+//
+
+#define STRICT
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+#include "TextView.h"
+#include "linescan.h"
+
+//
+//	SSE2 is always there on x64 and is tested for at runtime on x86. AVX2
+//	is compiled wherever the compiler has the intrinsics, and used only if
+//	the processor (and OS) support it
+//
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+
+#if (defined(_MSC_VER) && _MSC_VER >= 1400) || (defined(__GNUC__) && (defined(__x86_64__) || defined(__SSE2__)))
+#define LINESCAN_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+#if (defined(_MSC_VER) && _MSC_VER >= 1700) || (defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)))
+#define LINESCAN_USE_AVX2
+#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER) && _MSC_VER >= 1400
+#include <intrin.h>
+#endif
+
+#endif
+
+#if defined(LINESCAN_USE_AVX2) && defined(__GNUC__)
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+#else
+#define AVX2_FUNCTION
+#endif
+
+// kernel in use, chosen when linescan is first called
+static int g_nLevel = -1;
+
+//
+//	Highest kernel that this processor can run
+//
+static int cpu_level()
+{
+	int level = LINESCAN_SCALAR;
+
+#if defined(LINESCAN_USE_SSE2) && defined(_MSC_VER)
+
+	int info[4];
+
+	__cpuid(info, 0);
+
+	int maxleaf = info[0];
+
+	__cpuid(info, 1);
+
+	if(info[3] & (1 << 26))
+		level = LINESCAN_SSE2;
+
+#ifdef LINESCAN_USE_AVX2
+
+	// AVX2 also needs the OS to save the YMM registers (OSXSAVE + AVX, XCR0 bits 1-2)
+	if(level == LINESCAN_SSE2 && maxleaf >= 7 && (info[2] & (1 << 27)) && (info[2] & (1 << 28)) &&
+	   (_xgetbv(0) & 6) == 6)
+	{
+		__cpuidex(info, 7, 0);
+
+		if(info[1] & (1 << 5))
+			level = LINESCAN_AVX2;
+	}
+
+#endif
+
+#elif defined(LINESCAN_USE_SSE2) && defined(__GNUC__)
+
+	if(__builtin_cpu_supports("sse2"))
+		level = LINESCAN_SSE2;
+
+#ifdef LINESCAN_USE_AVX2
+	if(level == LINESCAN_SSE2 && __builtin_cpu_supports("avx2"))
+		level = LINESCAN_AVX2;
+#endif
+
+#endif
+
+	return level;
+}
+
+int linescan_setlevel(int level)
+{
+	int maxlevel = cpu_level();
+
+	g_nLevel = level < LINESCAN_SCALAR ? LINESCAN_SCALAR : min(level, maxlevel);
+	return g_nLevel;
+}
+
+//
+//	Position of the lowest bit set in a (non-zero) movemask result
+//
+static inline size_t lowest_bit(unsigned mask)
+{
+#if defined(_MSC_VER) && _MSC_VER >= 1400
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#elif defined(__GNUC__)
+	return __builtin_ctz(mask);
+#else
+	size_t index = 0;
+	while((mask & 1) == 0)
+		mask >>= 1, index++;
+	return index;
+#endif
+}
+
+//
+//	Length in bytes of the character at the start of 'buf' if it is one
+//	that can be counted as-is, or 0 if it could end the line or is cut
+//	short by the end of the buffer (so must be left to getchar)
+//
+static inline size_t plainchar_ascii(const BYTE *buf)
+{
+	BYTE ch = buf[0];
+
+	return (ch >= 0x0A && ch <= 0x0D) || ch == 0x85 ? 0 : 1;
+}
+
+static inline size_t plainchar_utf8(const BYTE *buf, size_t len)
+{
+	BYTE   ch = buf[0];
+	size_t trailing;
+	size_t i;
+
+	if(ch < 0x80)
+		return ch >= 0x0A && ch <= 0x0D ? 0 : 1;
+
+	// a stray continuation byte, or 0xFE/0xFF, is one illegal character
+	if(ch < 0xC0 || ch >= 0xFE)
+		return 1;
+
+	if(ch >= 0xFC)		trailing = 5;
+	else if(ch >= 0xF8)	trailing = 4;
+	else if(ch >= 0xF0)	trailing = 3;
+	else if(ch >= 0xE0)	trailing = 2;
+	else				trailing = 1;
+
+	// a malformed sequence ends at the first byte that isn't a trail-byte
+	for(i = 1; i <= trailing; i++)
+	{
+		if(i == len)
+			return 0;
+
+		if((buf[i] & 0xC0) != 0x80)
+			return i;
+	}
+
+	// U+0085 (C2 85), U+2028 (E2 80 A8) and U+2029 (E2 80 A9)
+	if((ch == 0xC2 && buf[1] == 0x85) || (ch == 0xE2 && buf[1] == 0x80 && (buf[2] & 0xFE) == 0xA8))
+		return 0;
+
+	return i;
+}
+
+static inline size_t plainchar_utf16(const BYTE *buf, size_t len, bool bigendian)
+{
+	ULONG ch;
+	ULONG ch2;
+
+	if(len < 2)
+		return 0;
+
+	ch = bigendian ? (buf[0] << 8 | buf[1]) : (buf[1] << 8 | buf[0]);
+
+	if((ch >= 0x0A && ch <= 0x0D) || ch == 0x85 || ch == 0x2028 || ch == 0x2029)
+		return 0;
+
+	// a lead surrogate takes its trailing unit with it, if it has one
+	if(ch >= 0xD800 && ch <= 0xDBFF)
+	{
+		if(len < 4)
+			return 0;
+
+		ch2 = bigendian ? (buf[2] << 8 | buf[3]) : (buf[3] << 8 | buf[2]);
+
+		return ch2 >= 0xDC00 && ch2 <= 0xDFFF ? 4 : 2;
+	}
+
+	return 2;
+}
+
+//
+//	Step over plain characters one at a time, until 'window' bytes
+//	have been passed (the last character may straddle the window)
+//
+static size_t scan_scalar(int format, const BYTE *buf, size_t len, size_t window, size_t maxchars, size_t *chars)
+{
+	size_t pos   = 0;
+	size_t count = 0;
+	size_t n;
+
+	window = min(window, len);
+
+	switch(format)
+	{
+	case NCP_ASCII:
+		for(window = min(window, maxchars); pos < window; pos++)
+		{
+			if(plainchar_ascii(buf + pos) == 0)
+				break;
+		}
+
+		count = pos;
+		break;
+
+	case NCP_UTF8:
+		for( ; pos < window && count < maxchars; pos += n, count++)
+		{
+			if((n = plainchar_utf8(buf + pos, len - pos)) == 0)
+				break;
+		}
+
+		break;
+
+	case NCP_UTF16:
+	case NCP_UTF16BE:
+		for( ; pos < window && count < maxchars; pos += n, count++)
+		{
+			if((n = plainchar_utf16(buf + pos, len - pos, format == NCP_UTF16BE)) == 0)
+				break;
+		}
+
+		break;
+	}
+
+	*chars = count;
+	return pos;
+}
+
+//
+//	Offset of the first marked byte in a (non-zero) block mask. A UTF-16
+//	unit marks both of its bytes, so this always lands on a unit
+//
+static inline size_t first_special(int format, unsigned mask)
+{
+	size_t index = lowest_bit(mask);
+
+	return (format == NCP_UTF16 || format == NCP_UTF16BE) ? index & ~1 : index;
+}
+
+#ifdef LINESCAN_USE_SSE2
+
+//
+//	Mark (a bit per byte) everything in a block of sixteen bytes that isn't
+//	plain single-unit text. A 'value in range' test is a wrapping subtract
+//	then a saturating one: (x - lo) -sat (hi - lo) is zero only for lo <= x <= hi
+//
+template <int format> static inline unsigned special_sse2(__m128i v)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i		  t;
+
+	if(format == NCP_ASCII || format == NCP_UTF8)
+	{
+		t = _mm_cmpeq_epi8(_mm_subs_epu8(_mm_sub_epi8(v, _mm_set1_epi8(0x0A)), _mm_set1_epi8(3)), zero);
+
+		// anything with the top bit set starts or continues a multi-byte sequence
+		if(format == NCP_UTF8)
+			return _mm_movemask_epi8(_mm_or_si128(t, v));
+		else
+			return _mm_movemask_epi8(_mm_or_si128(t, _mm_cmpeq_epi8(v, _mm_set1_epi8((char)0x85))));
+	}
+
+	if(format == NCP_UTF16BE)
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+
+	t = _mm_cmpeq_epi16(_mm_subs_epu16(_mm_sub_epi16(v, _mm_set1_epi16(0x0A)), _mm_set1_epi16(3)), zero);
+	t = _mm_or_si128(t, _mm_cmpeq_epi16(v, _mm_set1_epi16(0x85)));
+	t = _mm_or_si128(t, _mm_cmpeq_epi16(_mm_subs_epu16(_mm_sub_epi16(v, _mm_set1_epi16(0x2028)), _mm_set1_epi16(1)), zero));
+	t = _mm_or_si128(t, _mm_cmpeq_epi16(_mm_subs_epu16(_mm_sub_epi16(v, _mm_set1_epi16((short)0xD800)), _mm_set1_epi16(0x7FF)), zero));
+
+	return _mm_movemask_epi8(t);
+}
+
+//
+//	Bytes of plain single-unit text at the start of 'buf', tested two
+//	blocks at a time
+//
+template <int format> static size_t kernel_sse2(const BYTE *buf, size_t len)
+{
+	size_t	 pos;
+	unsigned mask1;
+	unsigned mask2;
+
+	for(pos = 0; pos + 32 <= len; pos += 32)
+	{
+		mask1 = special_sse2<format>(_mm_loadu_si128((const __m128i *)(buf + pos)));
+		mask2 = special_sse2<format>(_mm_loadu_si128((const __m128i *)(buf + pos + 16)));
+
+		if(mask1 | mask2)
+			return pos + (mask1 ? first_special(format, mask1) : 16 + first_special(format, mask2));
+	}
+
+	if(pos + 16 <= len)
+	{
+		if((mask1 = special_sse2<format>(_mm_loadu_si128((const __m128i *)(buf + pos)))) != 0)
+			return pos + first_special(format, mask1);
+
+		pos += 16;
+	}
+
+	return pos;
+}
+
+static size_t scan_sse2(int format, const BYTE *buf, size_t len)
+{
+	switch(format)
+	{
+	case NCP_ASCII:		return kernel_sse2<NCP_ASCII>(buf, len);
+	case NCP_UTF8:		return kernel_sse2<NCP_UTF8>(buf, len);
+	case NCP_UTF16:		return kernel_sse2<NCP_UTF16>(buf, len);
+	case NCP_UTF16BE:	return kernel_sse2<NCP_UTF16BE>(buf, len);
+	default:			return 0;
+	}
+}
+
+#endif
+
+#ifdef LINESCAN_USE_AVX2
+
+//
+//	The same tests as special_sse2, for thirty-two bytes
+//
+template <int format> AVX2_FUNCTION static inline unsigned special_avx2(__m256i v)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i		  t;
+
+	if(format == NCP_ASCII || format == NCP_UTF8)
+	{
+		t = _mm256_cmpeq_epi8(_mm256_subs_epu8(_mm256_sub_epi8(v, _mm256_set1_epi8(0x0A)), _mm256_set1_epi8(3)), zero);
+
+		if(format == NCP_UTF8)
+			return (unsigned)_mm256_movemask_epi8(_mm256_or_si256(t, v));
+		else
+			return (unsigned)_mm256_movemask_epi8(_mm256_or_si256(t, _mm256_cmpeq_epi8(v, _mm256_set1_epi8((char)0x85))));
+	}
+
+	if(format == NCP_UTF16BE)
+		v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+
+	t = _mm256_cmpeq_epi16(_mm256_subs_epu16(_mm256_sub_epi16(v, _mm256_set1_epi16(0x0A)), _mm256_set1_epi16(3)), zero);
+	t = _mm256_or_si256(t, _mm256_cmpeq_epi16(v, _mm256_set1_epi16(0x85)));
+	t = _mm256_or_si256(t, _mm256_cmpeq_epi16(_mm256_subs_epu16(_mm256_sub_epi16(v, _mm256_set1_epi16(0x2028)), _mm256_set1_epi16(1)), zero));
+	t = _mm256_or_si256(t, _mm256_cmpeq_epi16(_mm256_subs_epu16(_mm256_sub_epi16(v, _mm256_set1_epi16((short)0xD800)), _mm256_set1_epi16(0x7FF)), zero));
+
+	return (unsigned)_mm256_movemask_epi8(t);
+}
+
+template <int format> AVX2_FUNCTION static size_t kernel_avx2(const BYTE *buf, size_t len)
+{
+	size_t	 pos;
+	unsigned mask1;
+	unsigned mask2;
+
+	for(pos = 0; pos + 64 <= len; pos += 64)
+	{
+		mask1 = special_avx2<format>(_mm256_loadu_si256((const __m256i *)(buf + pos)));
+		mask2 = special_avx2<format>(_mm256_loadu_si256((const __m256i *)(buf + pos + 32)));
+
+		if(mask1 | mask2)
+			return pos + (mask1 ? first_special(format, mask1) : 32 + first_special(format, mask2));
+	}
+
+	if(pos + 32 <= len)
+	{
+		if((mask1 = special_avx2<format>(_mm256_loadu_si256((const __m256i *)(buf + pos)))) != 0)
+			return pos + first_special(format, mask1);
+
+		pos += 32;
+	}
+
+	return pos;
+}
+
+static size_t scan_avx2(int format, const BYTE *buf, size_t len)
+{
+	switch(format)
+	{
+	case NCP_ASCII:		return kernel_avx2<NCP_ASCII>(buf, len);
+	case NCP_UTF8:		return kernel_avx2<NCP_UTF8>(buf, len);
+	case NCP_UTF16:		return kernel_avx2<NCP_UTF16>(buf, len);
+	case NCP_UTF16BE:	return kernel_avx2<NCP_UTF16BE>(buf, len);
+	default:			return 0;
+	}
+}
+
+#endif
+
+//
+//	Step over the plain text at the start of 'buf' - see linescan.h
+//
+size_t linescan(int format, const BYTE *buf, size_t len, size_t maxchars, size_t *chars)
+{
+	size_t unitsize = (format == NCP_UTF16 || format == NCP_UTF16BE) ? 2 : 1;
+	size_t window;
+	size_t pos   = 0;
+	size_t count = 0;
+	size_t n;
+	size_t c;
+
+	if(format != NCP_ASCII && format != NCP_UTF8 && unitsize == 1)
+	{
+		*chars = 0;
+		return 0;
+	}
+
+	if(g_nLevel < 0)
+		g_nLevel = cpu_level();
+
+	window = g_nLevel == LINESCAN_AVX2 ? 32 : g_nLevel == LINESCAN_SSE2 ? 16 : len;
+
+	while(pos < len && count < maxchars)
+	{
+		size_t avail = len - pos;
+
+		// every plain unit in a vector is one character
+		if(maxchars - count < avail / unitsize)
+			avail = (maxchars - count) * unitsize;
+
+		switch(g_nLevel)
+		{
+#ifdef LINESCAN_USE_AVX2
+		case LINESCAN_AVX2:
+			n = scan_avx2(format, buf + pos, avail);
+			break;
+#endif
+#ifdef LINESCAN_USE_SSE2
+		case LINESCAN_SSE2:
+			n = scan_sse2(format, buf + pos, avail);
+			break;
+#endif
+		default:
+			n = 0;
+			break;
+		}
+
+		pos   += n;
+		count += n / unitsize;
+
+		// whatever stopped the vectors is taken a character at a time, for
+		// one vector's worth, before going back to the fast path
+		n = scan_scalar(format, buf + pos, len - pos, window, maxchars - count, &c);
+
+		if(n == 0)
+			break;
+
+		pos   += n;
+		count += c;
+	}
+
+	*chars = count;
+	return pos;
+}
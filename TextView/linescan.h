@@ -0,0 +1,38 @@
+#ifndef LINESCAN_INCLUDED
+#define LINESCAN_INCLUDED
+
+//
+//	linescan
+//
+//	Steps over the 'plain' text at the start of a buffer - characters
+//	that can't end a line and can be counted without decoding them one at
+//	a time. Whole vectors of such text are skipped with SSE2 or AVX2 where
+//	the processor supports them, with a scalar loop for everything else.
+//
+//	The scan stops in front of anything that might be a newline (\r \n \v
+//	\f U+0085 U+2028 U+2029 in the document's encoding), in front of a
+//	character that is split by the end of the buffer, or once 'maxchars'
+//	characters have been counted. The caller decodes whatever stopped it
+//
+//	format		- one of the NCP_xxx file formats (UTF-32 is never scanned)
+//	buf, len	- text to scan, straight out of the sequence's span memory
+//	maxchars	- most characters to step over
+//	chars		- [out] number of characters stepped over
+//
+//	returns the number of bytes stepped over, which always ends on a
+//	character boundary
+//
+size_t	linescan(int format, const BYTE *buf, size_t len, size_t maxchars, size_t *chars);
+
+//
+//	Kernels available to linescan. The fastest one that the processor
+//	supports is picked when linescan is first used, but a lower one can be
+//	chosen (the benchmark compares them). Returns the level now in use
+//
+#define LINESCAN_SCALAR		0
+#define LINESCAN_SSE2		1
+#define LINESCAN_AVX2		2
+
+int		linescan_setlevel(int level);
+
+#endif
@@ -11,6 +11,8 @@
 #include <windows.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <new>
+#include <algorithm>
 #include "sequence.h"
 
 #ifdef DEBUG_SEQUENCE
@@ -48,16 +50,208 @@ void debug(const char *fmt, ...)
 #define odebug
 #endif
 
+// default amount of memory the undo history may occupy before 
+// the oldest events are spilled to disk
+const size_w DEFAULT_UNDO_BUDGET = 0x4000000;
 
-sequence::sequence ()
+// modify-buffers start small and double in size each time one fills up
+const size_t MODIFYBUFFER_MINSIZE = 0x10000;
+const size_t MODIFYBUFFER_MAXSIZE = 0x1000000;
+
+// compaction copies runs of at least COMPACT_MINRUN spans, each shorter than
+// COMPACT_SPANSIZE, into a single span of up to COMPACT_RUNSIZE elements
+const size_w COMPACT_SPANSIZE = 64;
+const size_w COMPACT_RUNSIZE  = 0x1000;
+const size_t COMPACT_MINRUN	  = 4;
+
+// a quicksave gives up (and a full save is needed instead) when more than 
+// 1/QUICKSAVE_MAXDIRTY of the file would have to be rewritten
+const size_w QUICKSAVE_MAXDIRTY = 2;
+
+// the smallest page-size of any Windows platform
+const size_w QUICKSAVE_PAGESIZE = 0x1000;
+
+// imports at least this long are hashed, so that repeats can share one copy
+const size_t IMPORT_SHAREDSIZE	= 0x100;
+
+// a full save gathers spans smaller than this into blocks before writing
+const size_t SAVE_BLOCKSIZE		= 0x10000;
+
+// the largest single write made to a file
+const size_w FILE_MAXWRITE		= 0x100000;
+
+// a fill keeps one block of its value in memory, however long it is. 
+// Fills no longer than this are simply inserted as data
+const size_w FILL_BLOCKSIZE		= 0x1000;
+
+// which edges of a span the undo/redo history depends on
+const int PIN_START	= 1;
+const int PIN_END	= 2;
+
+//
+//	On-disk layout of an undo event in the spill-file: a spill_header,
+//	then 'count' spill_span entries, then the data of every span that
+//	referred to a heap buffer (these buffers may be freed once spilled)
+//
+struct spill_header
+{
+	size_w	count;
+	int		prev_id;		// spans either side of the event's range
+	int		next_id;
+	int		boundary;
+	int		reserved;
+};
+
+struct spill_span
+{
+	size_w	offset;
+	size_w	length;
+	int		buffer;			// -1 when the data is stored in the record, -2 
+	int		id;				// for a fill (whose value is kept in 'offset')
+};
+
+const int SPILL_DATA = -1;
+const int SPILL_FILL = -2;
+
+//
+//	On-disk layout of the edit journal: a journal_header, then a record
+//	for every committed operation. Each record is a journal_record, then
+//	'count' journal_edit entries, then the inserted data of each edit
+//
+const DWORD JOURNAL_MAGIC	= 0x4a514553;	// "SEQJ"
+const DWORD JOURNAL_VERSION = 1;
+
+enum
+{
+	journal_insert,
+	journal_erase,
+	journal_replace,
+	journal_apply,
+	journal_undo,
+	journal_redo,
+	journal_breakopt,
+	journal_branch,			// one journal_edit, whose index is the revision
+	journal_fill			// one journal_edit, whose data is the single value
+};
+
+struct journal_header
+{
+	DWORD		magic;
+	DWORD		version;
+	DWORD		charsize;		// sizeof(seqchar)
+	DWORD		offsetsize;		// sizeof(size_w)
+	size_w		base_length;	// the file the journal was made against
+	FILETIME	base_time;
+};
+
+struct journal_record
+{
+	DWORD		type;
+	DWORD		count;
+	size_w		group;			// undo-group the operation was made in
+	size_w		reclen;			// size of the entire record in bytes
+};
+
+struct journal_edit
+{
+	size_w		index;
+	size_w		erase_length;
+	size_w		length;
+};
+
+//
+//	Position the file-pointer of the spill-file, the journal or a file being saved
+//
+static bool file_seek(HANDLE hFile, size_w offset)
+{
+#ifdef SEQUENCE64
+	LONG  hi = (LONG)(offset >> 32);
+#else
+	LONG  hi = 0;
+#endif
+	DWORD lo = SetFilePointer(hFile, (LONG)(DWORD)offset, &hi, FILE_BEGIN);
+
+	return lo != INVALID_SET_FILE_POINTER || GetLastError() == NO_ERROR;
+}
+
+//
+//	FNV-1a hash of an imported block
+//
+static DWORD import_hash(const void *buf, size_t len)
+{
+	const BYTE *ptr  = (const BYTE *)buf;
+	DWORD		hash = 2166136261;
+
+	while(len--)
+		hash = (hash ^ *ptr++) * 16777619;
+
+	return hash;
+}
+
+//
+//	Write 'length' items at the file's current position
+//
+template <class type>
+static bool file_write(HANDLE hFile, const type *buf, size_w length)
+{
+	DWORD	written;
+	DWORD	len;
+
+	while(length > 0)
+	{
+		len = (DWORD)(min(length, FILE_MAXWRITE) * sizeof(type));
+
+		if(!WriteFile(hFile, buf, len, &written, 0) || written != len)
+			return false;
+
+		buf	   += len / sizeof(type);
+		length -= len / sizeof(type);
+	}
+
+	return true;
+}
+
+
+template <class CharT, class SizeT>
+basic_sequence<CharT, SizeT>::basic_sequence ()
+	:
+	spanpool(sizeof(span)),
+	rangepool(sizeof(span_range))
 {
 	record_action(action_invalid, 0);
 	
 	head = tail		= 0;
+	root			= 0;
 	sequence_length = 0;
 	group_id		= 0;
 	group_refcount	= 0;
 
+	spill_file		= 0;
+	spill_size		= 0;
+	spill_count		= 0;
+	undo_budget		= DEFAULT_UNDO_BUDGET;
+	undo_resident	= 0;
+	compact_index	= 0;
+	filebuffer_id	= -1;
+	can_quicksave	= false;
+	file_volume		= 0;
+	file_indexhi	= 0;
+	file_indexlo	= 0;
+	edit_count		= 0;
+	coalesce_count	= 0;
+
+	// revision 0 is the root of the undo tree
+	revision_parent.push_back(0);
+	revision_current = 0;
+	revision_saved	 = 0;
+
+	journal_file	= 0;
+	journal_size	= 0;
+	journal_revbase = 0;
+	journal_name[0] = 0;
+	base_length		= 0;
+	memset(&base_time, 0, sizeof(base_time));
+
 	head			= new span(0, 0, 0);
 	tail			= new span(0, 0, 0);
 	head->next		= tail;
@@ -70,7 +264,8 @@ sequence::sequence ()
 #endif
 }
 
-sequence::~sequence ()
+template <class CharT, class SizeT>
+basic_sequence<CharT, SizeT>::~basic_sequence ()
 {
 	clear();
 
@@ -78,11 +273,12 @@ sequence::~sequence ()
 	delete tail;
 }
 
-bool sequence::init ()
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::init ()
 {
 	sequence_length = 0;
 
-	if(!alloc_modifybuffer(0x10000))
+	if(!alloc_modifybuffer(MODIFYBUFFER_MINSIZE))
 		return false;
 
 	record_action(action_invalid, 0);
@@ -90,1030 +286,3968 @@ bool sequence::init ()
 	group_refcount	= 0;
 	undoredo_index	= 0;
 	undoredo_length = 0;
+	undoredo_oldlength = 0;
+	undoredo_head	= 0;
+	undoredo_tail	= 0;
 
 	return true;
 }
 
-bool sequence::init (const seqchar *buffer, size_t length)
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::init (const seqchar *buffer, size_t length)
 {
 	clear();
 
 	if(!init())
 		return false;
 
-	buffer_control *bc = alloc_modifybuffer(length);
+	buffer_control *bc = alloc_buffer(length);
+
+	if(bc == 0)
+		return false;
+
 	memcpy(bc->buffer, buffer, length * sizeof(seqchar));
 	bc->length = length;
 
-	span *sptr = new span(0, length, bc->id, tail, head);
+	span *sptr = new (spanpool.alloc()) span(0, length, bc->id, tail, head);
 	head->next = sptr;
 	tail->prev = sptr;
+	tree_insert(sptr);
 
 	sequence_length = length;
+	base_length		= length;
 	return true;
 }
 
 //
 //	Initialize from an on-disk file
 //
-bool sequence::open(TCHAR *filename, bool readonly)
+//	The file is memory-mapped rather than read, and the initial span 
+//	refers directly to the mapped view - so opening costs the same 
+//	regardless of the file's size, and only the pages that are actually 
+//	touched become resident. The view is copy-on-write and the file is 
+//	never written through it, so 'readonly' does not alter how it is opened.
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::open(TCHAR *filename, bool readonly)
 {
-	return false;
-}
+	HANDLE hFile;
 
-//
-//	Initialize from an on-disk file
-//
-//bool sequence::save(TCHAR *filename)
-//{
-//	return false;
-//}
+	hFile = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, 0, 0);
 
-template <class type>
-void sequence::clear_vector (type &vectorobject)
-{
-	for(size_t i = 0; i < vectorobject.size(); i++)
-	{
-		delete vectorobject[i];
-	}
-}
+	if(hFile == INVALID_HANDLE_VALUE)
+		return false;
 
-void sequence::clearstack (eventstack &dest)
-{
-	for(size_t i = 0; i < dest.size(); i++)
-	{
-		dest[i]->free();
-		delete dest[i];
-	}
+	bool success = open(hFile);
 
-	dest.clear();
+	// the file-mapping keeps its own reference to the file
+	CloseHandle(hFile);
+	return success;
 }
 
-void sequence::debug1 ()
+//
+//	Initialize from an already-open file handle. The caller retains
+//	ownership of the handle
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::open(HANDLE hFile)
 {
-	span *sptr;
+	buffer_control *bc;
+	BY_HANDLE_FILE_INFORMATION info;
+	DWORD			sizehi;
 
-	for(sptr = head; sptr; sptr = sptr->next)
-	{
-		char *buffer = (char *)buffer_list[sptr->buffer]->buffer;
-		printf("%.*s", sptr->length, buffer + sptr->offset);
-	}
+	clear();
 
-	printf("\n");
-}
+	if(!init())
+		return false;
 
-void sequence::debug2 ()
-{
-	span *sptr;
+	// remember which file this is, so a journal can be matched to it
+	// and quicksave can tell whether it is being asked to write to it
+	GetFileTime(hFile, 0, 0, &base_time);
 
-	printf("**********************\n");
-	for(sptr = head; sptr; sptr = sptr->next)
+	if(GetFileInformationByHandle(hFile, &info))
 	{
-		char *buffer = (char *)buffer_list[sptr->buffer]->buffer;
-		
-		printf("[%d] [%4d %4d] %.*s\n", sptr->id, 
-			sptr->offset, sptr->length,
-			sptr->length, buffer + sptr->offset);
+		file_volume   = info.dwVolumeSerialNumber;
+		file_indexhi  = info.nFileIndexHigh;
+		file_indexlo  = info.nFileIndexLow;
+		can_quicksave = true;
 	}
 
-	printf("-------------------------\n");
+	// an empty file has nothing to map
+	if(GetFileSize(hFile, &sizehi) == 0 && sizehi == 0)
+		return true;
 
-	for(sptr = tail; sptr; sptr = sptr->prev)
-	{
-		char *buffer = (char *)buffer_list[sptr->buffer]->buffer;
-		
-		printf("[%d] [%4d %4d] %.*s\n", sptr->id, 
-			sptr->offset, sptr->length,
-			sptr->length, buffer + sptr->offset);
-	}
+	if((bc = map_buffer(hFile)) == 0)
+		return false;
 
-	printf("**********************\n");
+	filebuffer_id = bc->id;
 
-	for(sptr = head; sptr; sptr = sptr->next)
-	{
-		char *buffer = (char *)buffer_list[sptr->buffer]->buffer;
-		printf("%.*s", sptr->length, buffer + sptr->offset);
-	}
+	span *sptr = new (spanpool.alloc()) span(0, bc->length, bc->id, tail, head);
+	head->next = sptr;
+	tail->prev = sptr;
+	tree_insert(sptr);
 
-	printf("\nsequence length = %d chars\n", sequence_length);
-	printf("\n\n");
+	sequence_length = bc->length;
+	base_length		= bc->length;
+	return true;
 }
 
 //
-//	Allocate a buffer and add it to our 'buffer control' list
+//	sequence::save
+//
+//	Write the entire sequence to 'filename'. The data streams from the span
+//	buffers into a temporary file in the same directory - small spans are
+//	gathered into a fixed-size block, larger ones are written directly - so
+//	the memory needed is the same whatever the size of the document. Once 
+//	the data has been flushed to disk the temporary file is renamed over
+//	the target, which is therefore never left half-written.
 //
-sequence::buffer_control* sequence::alloc_buffer (size_t maxsize)
+//	'filename' may be the file the sequence was opened from. Windows won't
+//	replace a file while it is mapped, so the original is renamed aside 
+//	first; the mapping goes with it, and it is deleted once the last
+//	reference to the mapped buffer is released (see free_buffer)
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::save(TCHAR *filename)
 {
+	std::vector<seqchar> block(SAVE_BLOCKSIZE);
+	TCHAR		directory[MAX_PATH];
+	TCHAR		tempname[MAX_PATH];
+	TCHAR		backup[MAX_PATH];
+	TCHAR	  *	ptr;
+	HANDLE		hFile;
+	FILETIME	ft;
+	span	  *	sptr;
 	buffer_control *bc;
+	size_t		blocklen = 0;
+	bool		success	 = true;
 
-	if((bc = new buffer_control) == 0)
-		return 0;
+	// the temporary file must be on the same volume as the target
+	lstrcpyn(directory, filename, MAX_PATH);
 
-	// allocate a new buffer of byte/wchar/long/whatever
-	if((bc->buffer  = new seqchar[maxsize]) == 0)
+	for(ptr = directory + lstrlen(directory); ptr > directory && ptr[-1] != '\\' && ptr[-1] != '/'; ptr--)
+		;
+
+	if(ptr == directory)
+		lstrcpy(directory, TEXT("."));
+	else
+		*ptr = '\0';
+
+	if(GetTempFileName(directory, TEXT("seq"), 0, tempname) == 0)
+		return false;
+
+	hFile = CreateFile(tempname, GENERIC_WRITE, 0, 0, CREATE_ALWAYS, 0, 0);
+
+	if(hFile == INVALID_HANDLE_VALUE)
 	{
-		delete bc;
-		return 0;
+		DeleteFile(tempname);
+		return false;
 	}
 
-	bc->length  = 0;
-	bc->maxsize = maxsize;
-	bc->id		= buffer_list.size();		// assign the id
-
-	buffer_list.push_back(bc);
+	for(sptr = head->next; sptr != tail && success; sptr = sptr->next)
+	{
+		const seqchar *data;
+		size_w		   len;
 
-	return bc;
-}
+		// a fill is written out one block of its value at a time
+		for(size_w off = 0; off < sptr->length && success; off += len)
+		{
+			len = spandata(sptr, off, &data);
 
-sequence::buffer_control* sequence::alloc_modifybuffer (size_t maxsize)
-{
-	buffer_control *bc;
-	
-	if((bc = alloc_buffer(maxsize)) == 0)
-		return 0;
+			if(blocklen + len <= SAVE_BLOCKSIZE)
+			{
+				memcpy(&block[blocklen], data, (size_t)len * sizeof(seqchar));
+				blocklen += (size_t)len;
+			}
+			else
+			{
+				success  = file_write(hFile, &block[0], blocklen) && file_write(hFile, data, len);
+				blocklen = 0;
+			}
+		}
+	}
 
-	modifybuffer_id  = bc->id;
-	modifybuffer_pos = 0;
+	success = success && file_write(hFile, &block[0], blocklen);
 
-	return bc;
-}
+	// stamp the file so that it can be recognised (by the journal) later
+	GetSystemTimeAsFileTime(&ft);
+	success = success && SetFileTime(hFile, 0, 0, &ft) && FlushFileBuffers(hFile);
 
-//
-//	Import the specified range of data into the sequence so we have our own private copy
-//
-bool sequence::import_buffer (const seqchar *buf, size_t len, size_t *buffer_offset)
-{
-	buffer_control *bc;
-	
-	// get the current modify-buffer
-	bc = buffer_list[modifybuffer_id];
+	CloseHandle(hFile);
 
-	// if there isn't room then allocate a new modify-buffer
-	if(bc->length + len >= bc->maxsize)
+	if(success && !MoveFileEx(tempname, filename, MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH))
 	{
-		bc = alloc_modifybuffer(len + 0x10000);
-		
-		// make sure that no old spans use this buffer
-		record_action(action_invalid, 0);
+		// the target is most likely our own mapped file - move it aside
+		success = filebuffer_id != -1 && (bc = buffer_list[filebuffer_id]) != 0 && bc->backup == 0 &&
+				  GetTempFileName(directory, TEXT("seq"), 0, backup) != 0;
+
+		if(success && MoveFileEx(filename, backup, MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH))
+		{
+			if(MoveFileEx(tempname, filename, MOVEFILE_WRITE_THROUGH))
+			{
+				// if there's no memory for the name the file is just left behind
+				if((bc->backup = new TCHAR[lstrlen(backup) + 1]) != 0)
+					lstrcpy(bc->backup, backup);
+			}
+			else
+			{
+				MoveFileEx(backup, filename, MOVEFILE_WRITE_THROUGH);
+				success = false;
+			}
+		}
+		else if(success)
+		{
+			DeleteFile(backup);
+			success = false;
+		}
 	}
 
-	if(bc == 0)
+	if(!success)
+	{
+		DeleteFile(tempname);
 		return false;
+	}
 
-	// import the data
-	memcpy(bc->buffer + bc->length, buf, len * sizeof(seqchar));
-	
-	*buffer_offset = bc->length;
-	bc->length += len;
+	// the mapped view no longer matches the file on disk
+	can_quicksave  = false;
+	base_length	   = sequence_length;
+	base_time	   = ft;
+	revision_saved = revision_current;
+	journal_rebase();
 
 	return true;
 }
 
-
 //
-//	sequence::spanfromindex
+//	sequence::quicksave
 //
-//	search the spanlist for the span which encompasses the specified index position
+//	Save the sequence back to the file it was opened from by rewriting only
+//	the parts that differ from what is on disk, so the cost depends on the
+//	size of the edits rather than the size of the file. If 'filename' is
+//	not the file given to sequence::open - even under another name - false
+//	is returned without writing anything.
 //
-//	index		- character-position index
-//	*spanindex  - index of span within sequence
+//	This is only possible while the file's contents are still in place: 
+//	the sequence must be no shorter than the file, and most of the file 
+//	must be unchanged (e.g. text was overwritten, or appended to the end). 
+//	Otherwise false is returned and the whole file has to be saved instead.
+//
+//	The mapped view is copy-on-write, and every page about to be overwritten
+//	is made private first - so the view, and the undo history and snapshots
+//	that refer to it, go on seeing the original text
 //
-sequence::span* sequence::spanfromindex (size_w index, size_w *spanindex = 0) const
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::quicksave(TCHAR *filename)
 {
-	span * sptr;
-	size_w curidx = 0;
-	
-	// scan the list looking for the span which holds the specified index
-	for(sptr = head->next; sptr->next; sptr = sptr->next)
+	rangelist		dirty;
+	buffer_control *bc;
+	span		  *	sptr;
+	HANDLE			hFile;
+	FILETIME		ft;
+	BY_HANDLE_FILE_INFORMATION info;
+	DWORD			sizelo, sizehi;
+	size_w			filesize;
+	size_w			pos = 0;
+	size_w			rewrite = 0;
+	size_t			i;
+
+	if(!can_quicksave || sequence_length < base_length)
+		return false;
+
+	// everything that isn't a span of the file at its original position
+	// has to be written out
+	for(sptr = head->next; sptr != tail; sptr = sptr->next)
 	{
-		if(index >= curidx && index < curidx + sptr->length)
-		{
-			if(spanindex) 
-				*spanindex = curidx;
+		if(sptr->buffer != filebuffer_id || sptr->offset != pos)
+			addrange(dirty, pos, pos + sptr->length);
 
-			return sptr;
-		}
+		pos += sptr->length;
+	}
+
+	// as does anything overwritten by an earlier save, because the view 
+	// still holds what was there originally
+	for(i = 0; i < file_written.size(); i++)
+		addrange(dirty, file_written[i].first, min(file_written[i].second, sequence_length));
 
-		curidx += sptr->length;
+	for(i = 0; i < dirty.size(); i++)
+	{
+		if(dirty[i].first < base_length)
+			rewrite += min(dirty[i].second, base_length) - dirty[i].first;
 	}
 
-	// insert at tail
-	if(sptr && index == curidx)
+	// too much of the file has moved for an in-place save to make sense
+	if(rewrite > base_length / QUICKSAVE_MAXDIRTY)
+		return false;
+
+	hFile = CreateFile(filename, GENERIC_WRITE, FILE_SHARE_READ, 0, OPEN_EXISTING, 0, 0);
+
+	if(hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	// a different file (e.g. Save As) has none of our unchanged text in it
+	if(!GetFileInformationByHandle(hFile, &info) || 
+	   info.dwVolumeSerialNumber != file_volume	 ||
+	   info.nFileIndexHigh		 != file_indexhi ||
+	   info.nFileIndexLow		 != file_indexlo)
 	{
-		*spanindex = curidx;
-		return sptr;
+		CloseHandle(hFile);
+		return false;
 	}
 
-	return 0;
-}
+	// make sure the file hasn't been changed by anyone else
+	sizehi = 0;
+	sizelo = GetFileSize(hFile, &sizehi);
 
-void sequence::swap_spanrange(span_range *src, span_range *dest)
-{
-	if(src->boundary)
+#ifdef SEQUENCE64
+	filesize = (size_w)sizehi << 32 | sizelo;
+#else
+	filesize = sizehi ? (size_w)-1 : sizelo;
+#endif
+
+	if(filesize != base_length * sizeof(seqchar) || 
+	   !GetFileTime(hFile, 0, 0, &ft) || CompareFileTime(&ft, &base_time) != 0)
 	{
-		if(!dest->boundary)
+		CloseHandle(hFile);
+		return false;
+	}
+
+	// preserve the original contents of every page that is about to change
+	if(filebuffer_id != -1 && (bc = buffer_list[filebuffer_id]) != 0)
+	{
+		volatile seqchar *view = bc->buffer;
+
+		for(i = 0; i < dirty.size() && dirty[i].first < bc->length; i++)
 		{
-			src->first->next = dest->first;
-			src->last->prev  = dest->last;
-			dest->first->prev = src->first;
-			dest->last->next  = src->last;
+			size_w end = min(dirty[i].second, bc->length);
+
+			for(pos = dirty[i].first; pos < end; pos += QUICKSAVE_PAGESIZE / sizeof(seqchar))
+				view[pos] = view[pos];
+
+			view[end - 1] = view[end - 1];
+
+			addrange(file_written, dirty[i].first, end);
 		}
 	}
-	else
+
+	for(i = 0; i < dirty.size(); i++)
 	{
-		if(dest->boundary)
+		if(!quicksave_write(hFile, dirty[i].first, dirty[i].second - dirty[i].first))
 		{
-			src->first->prev->next = src->last->next;
-			src->last->next->prev  = src->first->prev;
+			// the file is now in an unknown state - only a full save will do
+			memset(&base_time, 0, sizeof(base_time));
+			CloseHandle(hFile);
+			return false;
 		}
-		else
-		{
-			src->first->prev->next = dest->first;
-			src->last->next->prev  = dest->last;
-			dest->first->prev = src->first->prev;
-			dest->last->next = src->last->next;
-		}	
 	}
+
+	// the sequence now matches the file: stamp the file so that it can be
+	// recognised next time, and restart the journal against it
+	GetSystemTimeAsFileTime(&ft);
+	SetFileTime(hFile, 0, 0, &ft);
+	CloseHandle(hFile);
+
+	base_length	   = sequence_length;
+	base_time	   = ft;
+	revision_saved = revision_current;
+	journal_rebase();
+
+	return true;
 }
 
-void sequence::restore_spanrange (span_range *range, bool undo_or_redo)
+//
+//	write the range (index, length) of the sequence to the same position
+//	in the file
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::quicksave_write(HANDLE hFile, size_w index, size_w length)
 {
-	if(range->boundary)
+	iterator		itor = iterate(index);
+	const seqchar * ptr;
+	size_w			len;
+
+	if(!file_seek(hFile, index * sizeof(seqchar)))
+		return false;
+
+	while(length > 0 && (len = itor.chunk(&ptr)) != 0)
 	{
-		span *first = range->first->next;
-		span *last  = range->last->prev;
+		len = min(len, length);
 
-		// unlink spans from main list
-		range->first->next = range->last;
-		range->last->prev  = range->first;
+		if(!file_write(hFile, ptr, len))
+			return false;
 
-		// store the span range we just removed
-		range->first = first;
-		range->last  = last;
-		range->boundary = false;
+		itor   += len;
+		length -= len;
 	}
-	else
-	{
-		span *first = range->first->prev;
-		span *last  = range->last->next;
 
-		// are we moving spans into an "empty" region?
-		// (i.e. inbetween two adjacent spans)
-		if(first->next == last)
-		{
-			// move the old spans back into the empty region
-			first->next = range->first;
-			last->prev  = range->last;
+	return length == 0;
+}
 
-			// store the span range we just removed
-			range->first  = first;
-			range->last   = last;
-			range->boundary  = true;
-		}
-		// we are replacing a range of spans in the list,
-		// so swap the spans in the list with the one's in our "undo" event
-		else
-		{
-			// find the span range that is currently in the list
-			first = first->next;
-			last  = last->prev;
+//
+//	add the range (start, end) to a sorted list of ranges, merging it with
+//	any it overlaps or touches
+//
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::addrange(rangelist &list, size_w start, size_w end)
+{
+	typename rangelist::iterator itor;
 
-			// unlink the the spans from the main list
-			first->prev->next = range->first;
-			last->next->prev  = range->last;
+	if(start >= end)
+		return;
 
-			// store the span range we just removed
-			range->first = first;
-			range->last  = last;
-			range->boundary = false;
-		}
+	// the first range that finishes at or after 'start'
+	for(itor = list.end(); itor != list.begin() && (itor - 1)->second >= start; --itor)
+		;
+
+	while(itor != list.end() && itor->first <= end)
+	{
+		start = min(start, itor->first);
+		end   = max(end, itor->second);
+		itor  = list.erase(itor);
 	}
 
-	// update the 'sequence length' and 'quicksave' states
-	std::swap(range->sequence_length,    sequence_length);
-	std::swap(range->quicksave,			 can_quicksave);
+	list.insert(itor, std::make_pair(start, end));
+}
 
-	undoredo_index	= range->index;
 
-	if(range->act == action_erase && undo_or_redo == true || 
-		range->act != action_erase && undo_or_redo == false)
-	{
-		undoredo_length = range->length;
-	}
-	else
+template <class CharT, class SizeT>
+template <class type>
+void basic_sequence<CharT, SizeT>::clear_vector (type &vectorobject)
+{
+	for(size_t i = 0; i < vectorobject.size(); i++)
 	{
-		undoredo_length = 0;
+		delete vectorobject[i];
 	}
 }
 
 //
-//	sequence::undoredo
-//
-//	private routine used to undo/redo spanrange events to/from 
-//	the sequence - handles 'grouped' events
+//	Print a span's text, reading a fill through spandata a block at a
+//	time. Elements outside ASCII are printed as '?', whatever CharT is
 //
-bool sequence::undoredo (eventstack &source, eventstack &dest)
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::debugspan (const span *sptr) const
 {
-	span_range *range = 0;
-	size_t group_id;
+	const seqchar *data;
+	size_w		   len;
 
-	if(source.empty())
-		return false;
+	for(size_w off = 0; off < sptr->length; off += len)
+	{
+		len = spandata(sptr, off, &data);
 
-	// make sure that no "optimized" actions can occur
-	record_action(action_invalid, 0);
+		for(size_w i = 0; i < len; i++)
+			putchar((ULONG)data[i] < 0x80 ? (char)data[i] : '?');
+	}
+}
 
-	group_id = source.back()->group_id;
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::debug1 ()
+{
+	span *sptr;
 
-	do
+	for(sptr = head->next; sptr != tail; sptr = sptr->next)
+		debugspan(sptr);
+
+	printf("\n");
+}
+
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::debug2 ()
+{
+	span *sptr;
+
+	printf("**********************\n");
+	for(sptr = head->next; sptr != tail; sptr = sptr->next)
 	{
-		// remove the next event from the source stack
-		range = source.back();
-		source.pop_back();
+		printf("[%d] [%4lu %4lu] ", sptr->id, (ULONG)sptr->offset, (ULONG)sptr->length);
+		debugspan(sptr);
+		printf("\n");
+	}
 
-		// add event onto the destination stack
-		dest.push_back(range);
+	printf("-------------------------\n");
 
-		// do the actual work
-		restore_spanrange(range, source == undostack ? true : false);
+	for(sptr = tail->prev; sptr != head; sptr = sptr->prev)
+	{
+		printf("[%d] [%4lu %4lu] ", sptr->id, (ULONG)sptr->offset, (ULONG)sptr->length);
+		debugspan(sptr);
+		printf("\n");
 	}
-	while(!source.empty() && (source.back()->group_id == group_id && group_id != 0));
 
-	return true;
-}
+	printf("**********************\n");
 
-// 
-//	UNDO the last action
-//
-bool sequence::undo ()
-{
-	debug("Undo\n");
-	return undoredo(undostack, redostack);
-}
+	debug1();
 
-//
-//	REDO the last UNDO
-//
-bool sequence::redo ()
-{
-	debug("Redo\n");
-	return undoredo(redostack, undostack);
+	printf("\nsequence length = %lu chars\n", (ULONG)sequence_length);
+	printf("\n\n");
 }
 
 //
-//	Will calling sequence::undo change the sequence?
+//	Allocate a buffer and add it to our 'buffer control' list
 //
-bool sequence::canundo () const
+template <class CharT, class SizeT>
+typename basic_sequence<CharT, SizeT>::buffer_control* basic_sequence<CharT, SizeT>::alloc_buffer (size_t maxsize)
 {
-	return undostack.size() != 0;
+	buffer_control *bc;
+
+	if((bc = new buffer_control) == 0)
+		return 0;
+
+	// allocate a new buffer of byte/wchar/long/whatever
+	if((bc->buffer  = new seqchar[maxsize]) == 0)
+	{
+		delete bc;
+		return 0;
+	}
+
+	bc->length   = 0;
+	bc->maxsize  = maxsize;
+	bc->id		 = buffer_list.size();		// assign the id
+	bc->hmapping = 0;
+	bc->refcount = 1;
+	bc->backup	 = 0;
+	bc->fill	 = false;
+
+	buffer_list.push_back(bc);
+
+	return bc;
 }
 
 //
-//	Will calling sequence::redo change the sequence?
+//	Map the entire file and add it to our 'buffer control' list. The view is
+//	copy-on-write so that sequence::quicksave can keep the original contents
+//	of any page it is about to overwrite in the file
 //
-bool sequence::canredo () const
+template <class CharT, class SizeT>
+typename basic_sequence<CharT, SizeT>::buffer_control* basic_sequence<CharT, SizeT>::map_buffer (HANDLE hFile)
 {
-	return redostack.size() != 0;
+	buffer_control *bc;
+	DWORD	 sizelo, sizehi;
+	size_w	 length;
+	HANDLE	 hMap;
+	seqchar *view;
+
+	sizelo = GetFileSize(hFile, &sizehi);
+
+#ifdef SEQUENCE64
+	length = ((size_w)sizehi << 32 | sizelo) / sizeof(seqchar);
+
+	// the whole file must fit in the process's address-space
+	if(length > (size_t)-1 / sizeof(seqchar))
+		return 0;
+#else
+	if(sizehi != 0)
+		return 0;
+
+	length = sizelo / sizeof(seqchar);
+#endif
+
+	if((hMap = CreateFileMapping(hFile, 0, PAGE_WRITECOPY, 0, 0, 0)) == 0)
+		return 0;
+
+	if((view = (seqchar *)MapViewOfFile(hMap, FILE_MAP_COPY, 0, 0, 0)) == 0)
+	{
+		CloseHandle(hMap);
+		return 0;
+	}
+
+	if((bc = new buffer_control) == 0)
+	{
+		UnmapViewOfFile(view);
+		CloseHandle(hMap);
+		return 0;
+	}
+
+	bc->buffer	 = view;
+	bc->length	 = length;
+	bc->maxsize  = length;
+	bc->id		 = buffer_list.size();
+	bc->hmapping = hMap;
+	bc->refcount = 1;
+	bc->backup	 = 0;
+	bc->fill	 = false;
+
+	buffer_list.push_back(bc);
+
+	return bc;
 }
 
 //
-//	Group repeated actions on the sequence (insert/erase etc)
-//	into a single 'undoable' action
+//	Drop a reference to a buffer. Its memory - either a heap allocation or 
+//	a file-mapping - is released once no snapshot is using it either
 //
-void sequence::group()
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::free_buffer (buffer_control *bc)
 {
-	if(group_refcount == 0)
+	if(InterlockedDecrement(&bc->refcount) != 0)
+		return;
+
+	if(bc->hmapping)
 	{
-		if(++group_id == 0)
-			++group_id;
+		UnmapViewOfFile(bc->buffer);
+		CloseHandle(bc->hmapping);
+	}
+	else
+	{
+		delete[] bc->buffer;
+	}
 
-		group_refcount++;
+	// Windows won't delete a file while it is mapped, so a file that a save
+	// moved aside goes only now - whether the sequence or a snapshot let go last
+	if(bc->backup)
+	{
+		DeleteFile(bc->backup);
+		delete[] bc->backup;
 	}
+
+	delete bc;
 }
 
-//
-//	Close the grouping
-//
-void sequence::ungroup()
+template <class CharT, class SizeT>
+typename basic_sequence<CharT, SizeT>::buffer_control* basic_sequence<CharT, SizeT>::alloc_modifybuffer (size_t maxsize)
 {
-	if(group_refcount > 0)
-		group_refcount--;
+	buffer_control *bc;
+	
+	if((bc = alloc_buffer(maxsize)) == 0)
+		return 0;
+
+	modifybuffer_id  = bc->id;
+	modifybuffer_pos = 0;
+
+	return bc;
 }
 
 //
-//	Return logical length of the sequence
+//	Allocate a buffer that holds 'count' copies of a single value. Only one
+//	block of the value is stored - its spans may refer to any offset up to 
+//	'count', and always read their data from the start of the block
 //
-size_w sequence::size () const
+template <class CharT, class SizeT>
+typename basic_sequence<CharT, SizeT>::buffer_control* basic_sequence<CharT, SizeT>::alloc_fillbuffer (seqchar val, size_w count)
 {
-	return sequence_length;
+	buffer_control *bc;
+
+	if((bc = alloc_buffer((size_t)min(count, FILL_BLOCKSIZE))) == 0)
+		return 0;
+
+	std::fill(bc->buffer, bc->buffer + bc->maxsize, val);
+
+	bc->length = count;
+	bc->fill   = true;
+
+	return bc;
 }
 
 //
-//	sequence::initundo
+//	Import the specified range of data into the sequence so we have our own private copy.
+//	Returns the buffer and offset that the data was copied to.
 //
-//	create a new (empty) span range and save the current sequence state
+//	When the modify-buffer fills up the next one is twice the size, so even a long 
+//	editing session only uses a handful of them. Data that is large compared to a 
+//	modify-buffer (i.e. a big paste) is given a buffer of its own instead, leaving 
+//	the current modify-buffer's free space available for subsequent typing.
+//
+//	A large block that has already been imported isn't copied again - the
+//	existing copy is returned instead (see sequence::import_lookup)
 //
-sequence::span_range* sequence::initundo (size_w index, size_w length, action act)
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::import_buffer (const seqchar *buf, size_t len, int *buffer_id, size_t *buffer_offset)
 {
-	span_range *event = new span_range (
-								sequence_length, 
-								index,
-								length,
-								act,
-								can_quicksave, 
-								group_refcount ? group_id : 0
-								);
-
-	undostack.push_back(event);
-	
-	return event;
-}
+	buffer_control *bc;
+	std::pair<size_t, DWORD> key;
 
-sequence::span_range* sequence::stackback(eventstack &source, size_t idx)
-{
-	size_t length = source.size();
-	
-	if(length > 0 && idx < length)
+	// a large block may have been imported before
+	if(len >= IMPORT_SHAREDSIZE)
 	{
-		return source[length - idx - 1];
+		key = std::make_pair(len, import_hash(buf, len * sizeof(seqchar)));
+
+		if(import_lookup(key, buf, buffer_id, buffer_offset))
+			return true;
 	}
-	else
+	
+	// get the current modify-buffer
+	bc = buffer_list[modifybuffer_id];
+
+	// if there isn't room then allocate another buffer
+	if(len > bc->maxsize - bc->length)
 	{
-		return 0;
+		size_t nextsize = (size_t)min(bc->maxsize * 2, MODIFYBUFFER_MAXSIZE);
+
+		if(len > nextsize / 2)
+			bc = alloc_buffer(len);
+		else
+			bc = alloc_modifybuffer(nextsize);
 	}
-}
 
-void sequence::record_action (action act, size_w index)
-{
-	lastaction_index = index;
-	lastaction       = act;
-}
+	if(bc == 0)
+		return false;
 
-bool sequence::can_optimize (action act, size_w index)
-{
-	return (lastaction == act && lastaction_index == index);
+	// import the data
+	memcpy(bc->buffer + bc->length, buf, len * sizeof(seqchar));
+	
+	*buffer_id	   = bc->id;
+	*buffer_offset = bc->length;
+	bc->length += len;
+
+	if(len >= IMPORT_SHAREDSIZE)
+		import_blocks.insert(std::make_pair(key, std::make_pair(*buffer_id, *buffer_offset)));
+
+	return true;
 }
 
 //
-//	sequence::insert_worker
+//	Find an earlier import of the same data. Data never changes once it
+//	is in a buffer, so the earlier copy can be shared by any number of
+//	spans. Blocks whose buffer has since been released are forgotten
 //
-bool sequence::insert_worker (size_w index, const seqchar *buf, size_w length, action act)
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::import_lookup (const std::pair<size_t, DWORD> &key, const seqchar *buf, int *buffer_id, size_t *buffer_offset)
 {
-	span *		sptr;
-	size_w		spanindex;
-	size_t		modbuf_offset;
-	span_range	newspans;
-	size_w		insoffset;
-
-	if(index > sequence_length)
-		return false;
+	typename importmap::iterator itor = import_blocks.lower_bound(key);
 
-	// find the span that the insertion starts at
-	if((sptr = spanfromindex(index, &spanindex)) == 0)
-		return false;
+	while(itor != import_blocks.end() && itor->first == key)
+	{
+		buffer_control *bc = buffer_list[itor->second.first];
 
-	// ensure there is room in the modify buffer...
-	// allocate a new buffer if necessary and then invalidate span cache
-	// to prevent a span using two buffers of data
-	if(!import_buffer(buf, length, &modbuf_offset))
-		return false;
+		if(bc == 0)
+		{
+			import_blocks.erase(itor++);
+		}
+		else if(memcmp(bc->buffer + itor->second.second, buf, key.first * sizeof(seqchar)) == 0)
+		{
+			*buffer_id	   = itor->second.first;
+			*buffer_offset = itor->second.second;
+			return true;
+		}
+		else
+		{
+			++itor;
+		}
+	}
 
-	debug("Inserting: idx=%d len=%d %.*s\n", index, length, length, buf);
+	return false;
+}
 
-	clearstack(redostack);
-	insoffset = index - spanindex;
+//
+//	Return a pointer to a span's data at 'spanoff', and the number of 
+//	contiguous elements available there. A fill span is read a block at
+//	a time, and every block is the same
+//
+template <class CharT, class SizeT>
+typename basic_sequence<CharT, SizeT>::size_w basic_sequence<CharT, SizeT>::spandata (const span *sptr, size_w spanoff, const seqchar **ptr) const
+{
+	const buffer_control *bc = buffer_list[sptr->buffer];
 
-	// special-case #1: inserting at the end of a prior insertion, at a span-boundary
-	if(insoffset == 0 && can_optimize(act, index))
+	if(bc->fill)
 	{
-		// simply extend the last span's length
-		span_range *event = undostack.back();
-		sptr->prev->length	+= length;
-		event->length		+= length;
+		*ptr = bc->buffer;
+		return min(sptr->length - spanoff, bc->maxsize);
 	}
-	// general-case #1: inserting at a span boundary?
-	else if(insoffset == 0)
-	{
-		//
-		// Create a new undo event; because we are inserting at a span
-		// boundary there are no spans to replace, so use a "span boundary"
-		//
-		span_range *oldspans = initundo(index, length, act);
-		oldspans->spanboundary(sptr->prev, sptr);
-		
-		// allocate new span in the modify buffer
-		newspans.append(new span(
-			modbuf_offset, 
-			length, 
-			modifybuffer_id)
-			);
-		
-		// link the span into the sequence
-		swap_spanrange(oldspans, &newspans);
+
+	*ptr = bc->buffer + sptr->offset + spanoff;
+	return sptr->length - spanoff;
+}
+
+
+//
+//	sequence::spanfromindex
+//
+//	search the span-tree for the span which encompasses the specified index position
+//
+//	index		- character-position index
+//	*spanindex  - index of span within sequence
+//
+template <class CharT, class SizeT>
+typename basic_sequence<CharT, SizeT>::span* basic_sequence<CharT, SizeT>::spanfromindex (size_w index, size_w *spanindex) const
+{
+	span * sptr;
+	size_w curidx = 0;
+	size_w total  = root ? root->subtree : 0;
+
+	// insert at tail
+	if(index >= total)
+	{
+		if(index != total)
+			return 0;
+
+		if(spanindex)
+			*spanindex = total;
+
+		return tail;
 	}
-	// general-case #2: inserting in the middle of a span
-	else
+	
+	// descend the tree looking for the span which holds the specified index
+	for(sptr = root; sptr; )
 	{
-		//
-		//	Create a new undo event and add the span
-		//  that we will be "splitting" in half
-		//
-		span_range *oldspans = initundo(index, length, act);
-		oldspans->append(sptr);
+		size_w leftlen = sptr->left ? sptr->left->subtree : 0;
 
-		//	span for the existing data before the insertion
-		newspans.append(new span(
-							sptr->offset, 
-							insoffset, 
-							sptr->buffer)
-						);
+		if(index < curidx + leftlen)
+		{
+			sptr = sptr->left;
+		}
+		else if(index < curidx + leftlen + sptr->length)
+		{
+			if(spanindex) 
+				*spanindex = curidx + leftlen;
 
-		// make a span for the inserted data
-		newspans.append(new span(
-							modbuf_offset, 
-							length, 
-							modifybuffer_id)
-						);
+			return sptr;
+		}
+		else
+		{
+			curidx += leftlen + sptr->length;
+			sptr    = sptr->right;
+		}
+	}
 
-		// span for the existing data after the insertion
-		newspans.append(new span(
-							sptr->offset + insoffset, 
-							sptr->length - insoffset, 
-							sptr->buffer)
-						);
+	return 0;
+}
 
-		swap_spanrange(oldspans, &newspans);
+//
+//	sequence::tree_insert
+//
+//	Add a span into the span-tree. The span must already be linked into 
+//	the span-list, because it is positioned in the tree directly after 
+//	its list-predecessor (which is either 'head' or already in the tree)
+//
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::tree_insert (span *sptr)
+{
+	span *pos = sptr->prev;
+	span *parent;
+
+	sptr->left    = 0;
+	sptr->right   = 0;
+	sptr->subtree = sptr->length;
+	sptr->red     = true;
+
+	if(root == 0)
+	{
+		sptr->parent = 0;
+		root		 = sptr;
 	}
+	// first span in the list - becomes the left-most node
+	else if(pos == head)
+	{
+		for(parent = root; parent->left; parent = parent->left)
+			;
 
-	sequence_length += length;
+		parent->left = sptr;
+		sptr->parent = parent;
+	}
+	// become the in-order successor of our list-predecessor
+	else if(pos->right == 0)
+	{
+		pos->right	 = sptr;
+		sptr->parent = pos;
+	}
+	else
+	{
+		for(parent = pos->right; parent->left; parent = parent->left)
+			;
 
-	return true;
+		parent->left = sptr;
+		sptr->parent = parent;
+	}
+
+	// account for the new span's length all the way up to the root
+	for(parent = sptr->parent; parent; parent = parent->parent)
+		parent->subtree += sptr->length;
+
+	tree_insertfixup(sptr);
 }
 
 //
-//	sequence::insert
+//	sequence::tree_remove
 //
-//	Insert a buffer into the sequence at the specified position.
-//	Consecutive insertions are optimized into a single event
+//	Remove a span from the span-tree. The span's list-pointers are not touched
 //
-bool sequence::insert (size_w index, const seqchar *buf, size_w length)
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::tree_remove (span *sptr)
 {
-	if(insert_worker(index, buf, length, action_insert))
+	span *child;
+	span *parent;
+	span *succ = sptr;
+	bool  red  = sptr->red;
+
+	// if the span has two children its in-order successor takes its place,
+	// so remove the successor's length from the nodes it moves up past
+	if(sptr->left && sptr->right)
 	{
-		record_action(action_insert, index + length);
-		return true;
+		for(succ = sptr->right; succ->left; succ = succ->left)
+			;
+
+		for(parent = succ->parent; parent != sptr; parent = parent->parent)
+			parent->subtree -= succ->length;
+
+		succ->subtree = sptr->subtree - sptr->length;
+		red			  = succ->red;
+	}
+
+	for(parent = sptr->parent; parent; parent = parent->parent)
+		parent->subtree -= sptr->length;
+
+	if(sptr->left == 0)
+	{
+		child  = sptr->right;
+		parent = sptr->parent;
+		tree_transplant(sptr, child);
+	}
+	else if(sptr->right == 0)
+	{
+		child  = sptr->left;
+		parent = sptr->parent;
+		tree_transplant(sptr, child);
 	}
 	else
 	{
-		return false;
+		child = succ->right;
+
+		if(succ->parent == sptr)
+		{
+			parent = succ;
+		}
+		else
+		{
+			parent = succ->parent;
+			tree_transplant(succ, child);
+
+			succ->right			= sptr->right;
+			succ->right->parent = succ;
+		}
+
+		tree_transplant(sptr, succ);
+
+		succ->left			= sptr->left;
+		succ->left->parent	= succ;
+		succ->red			= sptr->red;
 	}
+
+	sptr->parent = sptr->left = sptr->right = 0;
+
+	if(red == false)
+		tree_removefixup(child, parent);
 }
 
 //
-//	sequence::insert
+//	sequence::tree_link
 //
-//	Insert specified character-value into sequence
+//	Add a chain of spans (that has just been linked into the span-list) to the tree
 //
-bool sequence::insert (size_w index, const seqchar val)
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::tree_link (span *first, span *last)
 {
-	return insert(index, &val, 1);
+	span *sptr, *next;
+
+	for(sptr = first; sptr; sptr = next)
+	{
+		next = (sptr == last) ? 0 : sptr->next;
+		tree_insert(sptr);
+	}
 }
 
 //
-//	sequence::deletefromsequence
+//	sequence::tree_unlink
 //
-//	Remove + delete the specified *span* from the sequence
+//	Remove a chain of spans from the tree
 //
-void sequence::deletefromsequence(span **psptr)
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::tree_unlink (span *first, span *last)
 {
-	span *sptr = *psptr;
-	sptr->prev->next = sptr->next;
-	sptr->next->prev = sptr->prev;
+	span *sptr, *next;
 
-	memset(sptr, 0, sizeof(span));
-	delete sptr;
-	*psptr = 0;
+	for(sptr = first; sptr; sptr = next)
+	{
+		next = (sptr == last) ? 0 : sptr->next;
+		tree_remove(sptr);
+	}
 }
 
 //
-//	sequence::erase_worker
+//	sequence::tree_setlength
+//
+//	Alter the length of a span that is currently in the tree
 //
-bool sequence::erase_worker (size_w index, size_w length, action act)
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::tree_setlength (span *sptr, size_w length)
 {
-	span		*sptr;
-	span_range	 oldspans;
-	span_range	 newspans;
-	span_range	*event;
-	size_w		 spanindex;
-	size_w		 remoffset;
-	size_w		 removelen;
-	bool		 append_spanrange;	
+	size_w oldlength = sptr->length;
 
-	debug("Erasing: idx=%d len=%d\n", index, length);
+	sptr->length = length;
 
-	// make sure we stay within the range of the sequence
-	if(length == 0 || length > sequence_length || index > sequence_length - length)
-		return false;
+	for(; sptr; sptr = sptr->parent)
+		sptr->subtree = sptr->subtree - oldlength + length;
+}
 
-	// find the span that the deletion starts at
-	if((sptr = spanfromindex(index, &spanindex)) == 0)
-		return false;
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::tree_transplant (span *oldspan, span *newspan)
+{
+	if(oldspan->parent == 0)
+		root = newspan;
+	else if(oldspan == oldspan->parent->left)
+		oldspan->parent->left = newspan;
+	else
+		oldspan->parent->right = newspan;
 
-	// work out the offset relative to the start of the *span*
-	remoffset = index - spanindex;
-	removelen = length;
+	if(newspan)
+		newspan->parent = oldspan->parent;
+}
 
-	//
-	//	can we optimize?
-	//
-	//	special-case 1: 'forward-delete'
-	//	erase+replace operations will pass through here
-	//
-	if(index == spanindex && can_optimize(act, index))
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::tree_rotateleft (span *sptr)
+{
+	span *pivot = sptr->right;
+
+	sptr->right = pivot->left;
+
+	if(pivot->left)
+		pivot->left->parent = sptr;
+
+	tree_transplant(sptr, pivot);
+
+	pivot->left	 = sptr;
+	sptr->parent = pivot;
+
+	// the pivot now covers everything the old sub-tree root did
+	pivot->subtree = sptr->subtree;
+	sptr->subtree  = sptr->length +
+					 (sptr->left  ? sptr->left->subtree  : 0) +
+					 (sptr->right ? sptr->right->subtree : 0);
+}
+
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::tree_rotateright (span *sptr)
+{
+	span *pivot = sptr->left;
+
+	sptr->left = pivot->right;
+
+	if(pivot->right)
+		pivot->right->parent = sptr;
+
+	tree_transplant(sptr, pivot);
+
+	pivot->right = sptr;
+	sptr->parent = pivot;
+
+	pivot->subtree = sptr->subtree;
+	sptr->subtree  = sptr->length +
+					 (sptr->left  ? sptr->left->subtree  : 0) +
+					 (sptr->right ? sptr->right->subtree : 0);
+}
+
+#define ISRED(sptr) ((sptr) != 0 && (sptr)->red)
+
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::tree_insertfixup (span *sptr)
+{
+	span *uncle;
+
+	while(ISRED(sptr->parent))
 	{
-		event = stackback(undostack, act == action_replace ? 1 : 0);
-		event->length	+= length;
-		append_spanrange = true;
+		span *parent = sptr->parent;
+		span *grand  = parent->parent;
 
-		if(frag2 != 0)
+		if(parent == grand->left)
 		{
-			if(length < frag2->length)
+			uncle = grand->right;
+
+			if(ISRED(uncle))
 			{
-				frag2->length	-= length;
-				frag2->offset	+= length;
-				sequence_length -= length;
-				return true;
+				parent->red = false;
+				uncle->red  = false;
+				grand->red  = true;
+				sptr		= grand;
 			}
 			else
 			{
-				if(act == action_replace)
-					stackback(undostack, 0)->last = frag2->next;
-
-				removelen	-= sptr->length;
-				sptr = sptr->next;
-				deletefromsequence(&frag2);
+				if(sptr == parent->right)
+				{
+					sptr = parent;
+					tree_rotateleft(sptr);
+					parent = sptr->parent;
+				}
+
+				parent->red = false;
+				grand->red  = true;
+				tree_rotateright(grand);
 			}
 		}
-	}
-	//
-	//	special-case 2: 'backward-delete'
-	//	only erase operations can pass through here
-	//
-	else if(index + length == spanindex + sptr->length && can_optimize(action_erase, index+length))
-	{
-		event = undostack.back();
-		event->length	+= length;
-		event->index	-= length;
-		append_spanrange = false;
-
-		if(frag1 != 0)
+		else
 		{
-			if(length < frag1->length)
+			uncle = grand->left;
+
+			if(ISRED(uncle))
 			{
-				frag1->length	-= length;
-				frag1->offset	+= 0;
-				sequence_length -= length;
-				return true;
+				parent->red = false;
+				uncle->red  = false;
+				grand->red  = true;
+				sptr		= grand;
 			}
 			else
 			{
-				removelen -= frag1->length;
-				deletefromsequence(&frag1);
+				if(sptr == parent->left)
+				{
+					sptr = parent;
+					tree_rotateright(sptr);
+					parent = sptr->parent;
+				}
+
+				parent->red = false;
+				grand->red  = true;
+				tree_rotateleft(grand);
 			}
 		}
 	}
-	else
-	{
-		append_spanrange = true;
-		frag1 = frag2 = 0;
 
-		if((event = initundo(index, length, act)) == 0)
-			return false;
-	}
+	root->red = false;
+}
 
-	//
-	//	general-case 2+3
-	//
-	clearstack(redostack);
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::tree_removefixup (span *sptr, span *parent)
+{
+	span *sibling;
 
-	// does the deletion *start* mid-way through a span?
-	if(remoffset != 0)
+	while(sptr != root && !ISRED(sptr))
 	{
-		// split the span - keep the first "half"
-		newspans.append(new span(sptr->offset, remoffset, sptr->buffer));
-		frag1 = newspans.first;
-		
-		// have we split a single span into two?
-		// i.e. the deletion is completely within a single span
-		if(remoffset + removelen < sptr->length)
+		if(sptr == parent->left)
 		{
-			// make a second span for the second half of the split
-			newspans.append(new span(
-							sptr->offset + remoffset + removelen, 
-							sptr->length - remoffset - removelen, 
-							sptr->buffer)
-							);
+			sibling = parent->right;
 
-			frag2 = newspans.last;
+			if(ISRED(sibling))
+			{
+				sibling->red = false;
+				parent->red  = true;
+				tree_rotateleft(parent);
+				sibling = parent->right;
+			}
+
+			if(!ISRED(sibling->left) && !ISRED(sibling->right))
+			{
+				sibling->red = true;
+				sptr   = parent;
+				parent = sptr->parent;
+			}
+			else
+			{
+				if(!ISRED(sibling->right))
+				{
+					sibling->left->red = false;
+					sibling->red	   = true;
+					tree_rotateright(sibling);
+					sibling = parent->right;
+				}
+
+				sibling->red = parent->red;
+				parent->red  = false;
+				
+				if(sibling->right)
+					sibling->right->red = false;
+
+				tree_rotateleft(parent);
+				sptr = root;
+			}
 		}
+		else
+		{
+			sibling = parent->left;
 
-		removelen -= min(removelen, (sptr->length - remoffset));
+			if(ISRED(sibling))
+			{
+				sibling->red = false;
+				parent->red  = true;
+				tree_rotateright(parent);
+				sibling = parent->left;
+			}
 
-		// archive the span we are going to replace
-		oldspans.append(sptr);
-		sptr = sptr->next;	
-	}
+			if(!ISRED(sibling->left) && !ISRED(sibling->right))
+			{
+				sibling->red = true;
+				sptr   = parent;
+				parent = sptr->parent;
+			}
+			else
+			{
+				if(!ISRED(sibling->left))
+				{
+					sibling->right->red = false;
+					sibling->red		= true;
+					tree_rotateleft(sibling);
+					sibling = parent->left;
+				}
+
+				sibling->red = parent->red;
+				parent->red  = false;
+				
+				if(sibling->left)
+					sibling->left->red = false;
+
+				tree_rotateright(parent);
+				sptr = root;
+			}
+		}
+	}
+
+	if(sptr)
+		sptr->red = false;
+}
+
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::swap_spanrange(span_range *src, span_range *dest)
+{
+	if(src->boundary)
+	{
+		if(!dest->boundary)
+		{
+			src->first->next = dest->first;
+			src->last->prev  = dest->last;
+			dest->first->prev = src->first;
+			dest->last->next  = src->last;
+
+			tree_link(dest->first, dest->last);
+		}
+	}
+	else
+	{
+		tree_unlink(src->first, src->last);
+
+		if(dest->boundary)
+		{
+			src->first->prev->next = src->last->next;
+			src->last->next->prev  = src->first->prev;
+		}
+		else
+		{
+			src->first->prev->next = dest->first;
+			src->last->next->prev  = dest->last;
+			dest->first->prev = src->first->prev;
+			dest->last->next = src->last->next;
+
+			tree_link(dest->first, dest->last);
+		}	
+	}
+}
+
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::restore_spanrange (span_range *range, bool undo_or_redo)
+{
+	if(range->boundary)
+	{
+		span *first = range->first->next;
+		span *last  = range->last->prev;
+
+		// unlink spans from main list
+		range->first->next = range->last;
+		range->last->prev  = range->first;
+		tree_unlink(first, last);
+
+		// store the span range we just removed
+		range->first = first;
+		range->last  = last;
+		range->boundary = false;
+	}
+	else
+	{
+		span *first = range->first->prev;
+		span *last  = range->last->next;
+
+		// are we moving spans into an "empty" region?
+		// (i.e. inbetween two adjacent spans)
+		if(first->next == last)
+		{
+			// move the old spans back into the empty region
+			first->next = range->first;
+			last->prev  = range->last;
+			tree_link(range->first, range->last);
+
+			// store the span range we just removed
+			range->first  = first;
+			range->last   = last;
+			range->boundary  = true;
+		}
+		// we are replacing a range of spans in the list,
+		// so swap the spans in the list with the one's in our "undo" event
+		else
+		{
+			// find the span range that is currently in the list
+			first = first->next;
+			last  = last->prev;
+
+			// unlink the the spans from the main list
+			tree_unlink(first, last);
+			first->prev->next = range->first;
+			last->next->prev  = range->last;
+			tree_link(range->first, range->last);
+
+			// store the span range we just removed
+			range->first = first;
+			range->last  = last;
+			range->boundary = false;
+		}
+	}
+
+	// update the 'sequence length' state
+	std::swap(range->sequence_length,    sequence_length);
+
+	undoredo_index	= range->index;
+
+	if(range->act == action_erase && undo_or_redo == true || 
+		range->act != action_erase && undo_or_redo == false)
+	{
+		undoredo_length = range->length;
+	}
+	else
+	{
+		undoredo_length = 0;
+	}
+}
+
+//
+//	sequence::track_undoredo
+//
+//	private routine that narrows down the region changed by an undo/redo,
+//	as each span_range is restored. An event's length is that of its region
+//	either before or after the event, and only a "replace" event could be
+//	either, in which case the larger of the two is assumed
+//
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::track_undoredo (span_range *range, bool undo_or_redo)
+{
+	size_w oldlength = range->sequence_length;
+	size_w newlength;
+
+	if(range->act == action_replace)
+		newlength = range->length + (sequence_length > oldlength ? sequence_length - oldlength : 0);
+	else if(range->act == action_erase && undo_or_redo == true || 
+		range->act != action_erase && undo_or_redo == false)
+		newlength = range->length;
+	else
+		newlength = 0;
+
+	newlength = min(newlength, sequence_length - min(range->index, sequence_length));
+
+	undoredo_head = min(undoredo_head, range->index);
+	undoredo_tail = min(undoredo_tail, sequence_length - min(range->index + newlength, sequence_length));
+}
+
+//
+//	sequence::event_range
+//
+//	Describe the whole of the last undo/redo as a single replace - 'erased'
+//	elements at 'index' were replaced with 'inserted' elements
+//
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::event_range (size_w *index, size_w *erased, size_w *inserted) const
+{
+	size_w shortest = min(undoredo_oldlength, sequence_length);
+	size_w head		= min(undoredo_head, shortest);
+	size_w tail		= min(undoredo_tail, shortest - head);
+
+	*index	  = head;
+	*erased	  = undoredo_oldlength - head - tail;
+	*inserted = sequence_length - head - tail;
+}
+
+//
+//	sequence::undoredo
+//
+//	private routine used to undo/redo spanrange events to/from 
+//	the sequence - handles 'grouped' events
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::undoredo (eventstack &source, eventstack &dest)
+{
+	span_range *range = 0;
+	size_t group_id;
+
+	if(source.empty())
+		return false;
+
+	// make sure that no "optimized" actions can occur
+	record_action(action_invalid, 0);
+
+	group_id = source.back()->group_id;
+
+	undoredo_oldlength = sequence_length;
+	undoredo_head	   = sequence_length;
+	undoredo_tail	   = sequence_length;
+
+	do
+	{
+		// an event that was spilled to disk must be reloaded first. If
+		// that fails then the spilled part of the history is abandoned
+		if(source.back()->spilled && !unspill_event(source.back()))
+		{
+			discard_spill();
+			break;
+		}
+
+		// remove the next event from the source stack
+		range = source.back();
+		source.pop_back();
+
+		// it no longer counts towards the undo history's memory usage
+		undo_resident  -= range->memsize;
+		range->memsize  = 0;
+
+		// add event onto the destination stack
+		dest.push_back(range);
+
+		// do the actual work
+		restore_spanrange(range, source == undostack ? true : false);
+		track_undoredo(range, source == undostack ? true : false);
+	}
+	while(!source.empty() && (source.back()->group_id == group_id && group_id != 0));
+
+	// an undo returns to the step's parent revision
+	if(range != 0)
+		revision_current = &source == &undostack ? revision_parent[range->revision] : range->revision;
+
+	return range != 0;
+}
+
+// 
+//	UNDO the last action
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::undo ()
+{
+	debug("Undo\n");
+
+	if(!undoredo(undostack, redostack))
+		return false;
+
+	if(journal_file)
+		journal_write(journal_undo, 0, 0, 0);
+
+	return true;
+}
+
+//
+//	REDO the last UNDO
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::redo ()
+{
+	debug("Redo\n");
+
+	if(!undoredo(redostack, undostack))
+		return false;
+
+	if(journal_file)
+		journal_write(journal_redo, 0, 0, 0);
+
+	return true;
+}
+
+//
+//	Will calling sequence::undo change the sequence?
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::canundo () const
+{
+	return undostack.size() != 0;
+}
+
+//
+//	Will calling sequence::redo change the sequence?
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::canredo () const
+{
+	return redostack.size() != 0;
+}
+
+//
+//	Group repeated actions on the sequence (insert/erase etc)
+//	into a single 'undoable' action
+//
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::group()
+{
+	if(group_refcount == 0)
+	{
+		if(++group_id == 0)
+			++group_id;
+
+		group_refcount++;
+	}
+}
+
+//
+//	Close the grouping
+//
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::ungroup()
+{
+	if(group_refcount > 0)
+		group_refcount--;
+}
+
+//
+//	sequence::gotorevision
+//
+//	move the sequence to any revision in the undo tree: undo back to where
+//	the current revision's history and the target's meet, then redo along
+//	the target's branch. Only the steps between the two revisions are 
+//	applied, however long ago the target was made
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::gotorevision(size_t revision)
+{
+	std::vector<size_t> path;
+	size_t cur;
+	size_t i;
+
+	if(revision >= revision_parent.size())
+		return false;
+
+	// a revision is always numbered after its parent, so stepping back
+	// from whichever of the two is newer finds their common ancestor
+	for(cur = revision_current; cur != revision; )
+	{
+		if(cur > revision)
+		{
+			cur = revision_parent[cur];
+		}
+		else
+		{
+			path.push_back(revision);
+			revision = revision_parent[revision];
+		}
+	}
+
+	while(revision_current != cur)
+	{
+		if(!undo())
+			return false;
+	}
+
+	for(i = path.size(); i > 0; i--)
+	{
+		if(!switchbranch(path[i - 1]) || !redo())
+			return false;
+	}
+
+	return true;
+}
+
+//
+//	sequence::keepbranch
+//
+//	an edit is about to be made after an undo. Rather than discarding the
+//	redo history, keep it as a branch of the undo tree
+//
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::keepbranch()
+{
+	if(redostack.empty())
+		return;
+
+	branches[redostack.back()->revision].swap(redostack);
+	redostack.clear();
+}
+
+//
+//	sequence::switchbranch
+//
+//	make 'revision' - a child of the current revision - the next one to 
+//	be redone, by swapping its branch onto the redostack
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::switchbranch(size_t revision)
+{
+	typename branchmap::iterator itor;
+	eventstack events;
+
+	if(!redostack.empty() && redostack.back()->revision == revision)
+		return true;
+
+	if((itor = branches.find(revision)) == branches.end())
+		return false;
+
+	events.swap(itor->second);
+	branches.erase(itor);
+
+	keepbranch();
+	redostack.swap(events);
+
+	// revisions made before the journal started can't be replayed
+	if(journal_file)
+	{
+		edit e = { revision >= journal_revbase ? revision - journal_revbase : (size_w)-1, 0, 0, 0 };
+		journal_write(journal_branch, &e, 1, 0);
+	}
+
+	return true;
+}
+
+//
+//	Set the amount of memory (in bytes) the undo history may occupy before
+//	the oldest events are spilled to disk. Zero removes the limit
+//
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::undobudget(size_w maxbytes)
+{
+	undo_budget = maxbytes;
+	undo_trim();
+}
+
+//
+//	Return the number of bytes of undo history held in memory and on disk
+//
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::undostats(size_w *resident, size_w *spilled) const
+{
+	if(resident)	*resident = undo_resident;
+	if(spilled)		*spilled  = spill_size;
+}
+
+//
+//	sequence::eventsize
+//
+//	estimate the memory held by an undo event - its spans, plus
+//	the heap data those spans refer to
+//
+template <class CharT, class SizeT>
+typename basic_sequence<CharT, SizeT>::size_w basic_sequence<CharT, SizeT>::eventsize(span_range *range) const
+{
+	size_w size = sizeof(span_range);
+	span  *sptr;
+	span  *term;
+
+	if(range->boundary == false)
+	{
+		for(sptr = range->first, term = range->last->next; sptr != term; sptr = sptr->next)
+		{
+			size += sizeof(span);
+
+			// file-mapped data is never copied and fills take no space, 
+			// so neither of them count
+			if(buffer_list[sptr->buffer]->hmapping == 0 && !buffer_list[sptr->buffer]->fill)
+				size += sptr->length * sizeof(seqchar);
+		}
+	}
+
+	return size;
+}
+
+//
+//	sequence::undo_trim
+//
+//	keep the undo history within its memory budget. The two most recent
+//	events are always kept in memory, because an insert/erase/replace
+//	might still coalesce with them
+//
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::undo_trim()
+{
+	typename branchmap::iterator itor;
+	std::vector<size_t> roots;
+	span_range *range;
+	size_t		i;
+	size_t		count = 0;
+
+	// count every event that can no longer change against the budget.
+	// these always form a block directly underneath the newest events
+	for(i = 2; (range = stackback(undostack, i)) != 0; i++)
+	{
+		if(range->memsize != 0 || range->spilled)
+			break;
+
+		range->memsize = eventsize(range);
+		undo_resident += range->memsize;
+	}
+
+	if(undo_budget == 0 || undo_resident <= undo_budget)
+		return;
+
+	// the revisions that other branches of the undo tree grow from
+	for(itor = branches.begin(); itor != branches.end(); ++itor)
+		roots.push_back(revision_parent[itor->first]);
+
+	std::sort(roots.begin(), roots.end());
+
+	// spill the oldest events until we are comfortably under budget. A
+	// branch refers to spans that were in the sequence where it started, 
+	// so spilling stops at the first event made from a branch's revision
+	while(undo_resident > undo_budget - undo_budget / 4 && spill_count + 2 < undostack.size())
+	{
+		range = undostack[spill_count];
+
+		if(std::binary_search(roots.begin(), roots.end(), revision_parent[range->revision]))
+			break;
+
+		if(!spill_event(range))
+			break;
+
+		spill_count++;
+		count++;
+	}
+
+	if(count > 0)
+		release_buffers();
+}
+
+//
+//	sequence::spill_event
+//
+//	write an undo event's spans (and any data they reference in heap 
+//	buffers) to the spill-file, then release them. The event's neighbours 
+//	are recorded by span-id, because they may be reloaded themselves by 
+//	the time this event is needed again
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::spill_event(span_range *range)
+{
+	std::vector<BYTE>	record;
+	spill_header	  *	hdr;
+	spill_span		  *	ssp;
+	seqchar			  *	data;
+	span			  *	sptr;
+	span			  *	term	= 0;
+	size_w				count	= 0;
+	size_w				datalen = 0;
+	size_w				reclen;
+	DWORD				written;
+
+	// create the spill-file the first time it is needed
+	if(spill_file == 0)
+	{
+		TCHAR path[MAX_PATH];
+		TCHAR name[MAX_PATH];
+		HANDLE hFile;
+
+		if(GetTempPath(MAX_PATH, path) == 0 || GetTempFileName(path, TEXT("seq"), 0, name) == 0)
+			return false;
+
+		hFile = CreateFile(name, GENERIC_READ|GENERIC_WRITE, 0, 0, CREATE_ALWAYS, 
+			FILE_ATTRIBUTE_TEMPORARY|FILE_FLAG_DELETE_ON_CLOSE, 0);
+
+		if(hFile == INVALID_HANDLE_VALUE)
+			return false;
+
+		spill_file = hFile;
+		spill_size = 0;
+	}
+
+	if(range->boundary == false)
+	{
+		for(sptr = range->first, term = range->last->next; sptr != term; sptr = sptr->next)
+		{
+			if(buffer_list[sptr->buffer]->hmapping == 0 && !buffer_list[sptr->buffer]->fill)
+				datalen += sptr->length;
+
+			count++;
+		}
+	}
+
+	reclen = sizeof(spill_header) + count * sizeof(spill_span) + datalen * sizeof(seqchar);
+
+	// a record must go out in a single write
+	if(reclen > 0xffffffff)
+		return false;
+
+	record.resize((size_t)reclen);
+	hdr  = (spill_header *)&record[0];
+	ssp  = (spill_span *)(hdr + 1);
+	data = (seqchar *)(ssp + count);
+
+	hdr->count		= count;
+	hdr->boundary	= range->boundary;
+	hdr->reserved	= 0;
+
+	if(range->boundary)
+	{
+		hdr->prev_id = range->first->id;
+		hdr->next_id = range->last->id;
+	}
+	else
+	{
+		hdr->prev_id = range->first->prev->id;
+		hdr->next_id = range->last->next->id;
+
+		for(sptr = range->first; sptr != term; sptr = sptr->next, ssp++)
+		{
+			buffer_control *bc = buffer_list[sptr->buffer];
+
+			ssp->offset = sptr->offset;
+			ssp->length = sptr->length;
+			ssp->id		= sptr->id;
+
+			// heap data is stored in the record, file-mapped data stays put
+			// and a fill only needs its value
+			if(bc->fill)
+			{
+				ssp->offset = (size_w)bc->buffer[0];
+				ssp->buffer = SPILL_FILL;
+			}
+			else if(bc->hmapping == 0)
+			{
+				memcpy(data, bc->buffer + sptr->offset, (size_t)sptr->length * sizeof(seqchar));
+				data += sptr->length;
+				ssp->buffer = SPILL_DATA;
+			}
+			else
+			{
+				ssp->buffer = sptr->buffer;
+			}
+		}
+	}
+
+	if(!file_seek(spill_file, spill_size) || 
+	   !WriteFile(spill_file, &record[0], (DWORD)reclen, &written, 0) || written != reclen)
+	{
+		return false;
+	}
+
+	// release the event's spans - it now only holds its position in the file
+	range->free(spanpool);
+	range->first		= 0;
+	range->last			= 0;
+	range->boundary		= true;
+	range->spilled		= true;
+	range->spill_offset = spill_size;
+	range->spill_prev	= hdr->prev_id;
+	range->spill_next	= hdr->next_id;
+
+	spill_size		+= reclen;
+	undo_resident	-= range->memsize;
+	range->memsize	 = 0;
+
+	return true;
+}
+
+//
+//	sequence::unspill_event
+//
+//	bring the most recently spilled event back into memory. This only
+//	happens when the event is at the top of the undostack, so the 
+//	sequence is in the same state as when the event was made and its 
+//	neighbouring spans are all in the span-list
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::unspill_event(span_range *range)
+{
+	std::vector<BYTE>	record;
+	spill_header	  *	hdr;
+	spill_span		  *	ssp;
+	seqchar			  *	data;
+	span			  *	prev;
+	span			  *	next;
+	span_range			spans;
+	size_w				reclen = spill_size - range->spill_offset;
+	size_t				modbuf_offset;
+	int					modbuf_id;
+	DWORD				numread;
+
+	record.resize((size_t)reclen);
+
+	if(!file_seek(spill_file, range->spill_offset) ||
+	   !ReadFile(spill_file, &record[0], (DWORD)reclen, &numread, 0) || numread != reclen)
+	{
+		return false;
+	}
+
+	hdr  = (spill_header *)&record[0];
+	ssp  = (spill_span *)(hdr + 1);
+	data = (seqchar *)(ssp + hdr->count);
+
+	if((prev = spanfromid(hdr->prev_id, range->index)) == 0 ||
+	   (next = spanfromid(hdr->next_id, range->index)) == 0)
+	{
+		return false;
+	}
+
+	// recreate the spans, copying any stored data into the modify-buffer
+	for(size_w i = 0; i < hdr->count; i++, ssp++)
+	{
+		span *sptr;
+
+		if(ssp->buffer == SPILL_DATA)
+		{
+			if(!import_buffer(data, (size_t)ssp->length, &modbuf_id, &modbuf_offset))
+			{
+				spans.free(spanpool);
+				return false;
+			}
+
+			sptr  = new (spanpool.alloc()) span(modbuf_offset, ssp->length, modbuf_id);
+			data += ssp->length;
+		}
+		else if(ssp->buffer == SPILL_FILL)
+		{
+			buffer_control *bc = alloc_fillbuffer((seqchar)ssp->offset, ssp->length);
+
+			if(bc == 0)
+			{
+				spans.free(spanpool);
+				return false;
+			}
+
+			sptr = new (spanpool.alloc()) span(0, ssp->length, bc->id);
+		}
+		else
+		{
+			sptr = new (spanpool.alloc()) span(ssp->offset, ssp->length, ssp->buffer);
+		}
+
+		// keep the original id so that older events can still find it
+		sptr->id = ssp->id;
+		spans.append(sptr);
+	}
+
+	if(hdr->boundary)
+	{
+		range->spanboundary(prev, next);
+	}
+	else
+	{
+		range->first	= spans.first;
+		range->last		= spans.last;
+		range->boundary = false;
+		range->first->prev = prev;
+		range->last->next  = next;
+	}
+
+	range->spilled = false;
+	spill_count--;
+
+	// this was the last record in the file
+	spill_size = range->spill_offset;
+
+	if(file_seek(spill_file, spill_size))
+		SetEndOfFile(spill_file);
+
+	return true;
+}
+
+//
+//	sequence::discard_spill
+//
+//	throw away every spilled event (i.e. the oldest part of the undo history)
+//
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::discard_spill()
+{
+	for(size_t i = 0; i < spill_count; i++)
+		rangepool.free(undostack[i]);
+
+	undostack.erase(undostack.begin(), undostack.begin() + spill_count);
+
+	if(spill_file)
+		CloseHandle(spill_file);
+
+	spill_file  = 0;
+	spill_size  = 0;
+	spill_count = 0;
+}
+
+//
+//	sequence::release_buffers
+//
+//	free any heap buffer that is no longer referenced by the sequence or
+//	by the in-memory undo/redo history
+//
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::release_buffers()
+{
+	std::vector<bool> used(buffer_list.size(), false);
+	std::vector<const eventstack *> stacks;
+	span		*	sptr;
+	span		*	term;
+	size_t			i, j;
+
+	for(sptr = head->next; sptr != tail; sptr = sptr->next)
+		used[sptr->buffer] = true;
+
+	history(stacks);
+
+	for(j = 0; j < stacks.size(); j++)
+	{
+		// spilled events hold their own copy of the data
+		for(i = (stacks[j] == &undostack ? spill_count : 0); i < stacks[j]->size(); i++)
+		{
+			span_range *range = (*stacks[j])[i];
+
+			if(range->boundary == false)
+			{
+				for(sptr = range->first, term = range->last->next; sptr != term; sptr = sptr->next)
+					used[sptr->buffer] = true;
+			}
+		}
+	}
+
+	for(i = 0; i < buffer_list.size(); i++)
+	{
+		buffer_control *bc = buffer_list[i];
+
+		if(bc && !used[i] && bc->hmapping == 0 && bc->id != modifybuffer_id)
+		{
+			free_buffer(bc);
+			buffer_list[i] = 0;
+		}
+	}
+}
+
+//
+//	sequence::history
+//
+//	list every stack of events in the undo tree: the undostack, the 
+//	redostack and each branch that has been kept aside
+//
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::history(std::vector<const eventstack *> &stacks) const
+{
+	typename branchmap::const_iterator itor;
+
+	stacks.push_back(&undostack);
+	stacks.push_back(&redostack);
+
+	for(itor = branches.begin(); itor != branches.end(); ++itor)
+		stacks.push_back(&itor->second);
+}
+
+//
+//	sequence::spanfromid
+//
+//	find the span with the specified id, searching outwards from 'index'
+//
+template <class CharT, class SizeT>
+typename basic_sequence<CharT, SizeT>::span* basic_sequence<CharT, SizeT>::spanfromid(int id, size_w index) const
+{
+	span *fwd  = spanfromindex(min(index, sequence_length), 0);
+	span *back = fwd;
+
+	while(fwd || back)
+	{
+		if(fwd)
+		{
+			if(fwd->id == id)
+				return fwd;
+
+			fwd = fwd->next;
+		}
+
+		if(back)
+		{
+			if(back->id == id)
+				return back;
+
+			back = back->prev;
+		}
+	}
+
+	return 0;
+}
+
+//
+//	write a fresh journal header at the start of the file, for a sequence
+//	of 'type' elements
+//
+template <class type>
+static bool journal_writeheader(HANDLE hFile, size_w base_length, const FILETIME *base_time)
+{
+	journal_header	hdr;
+	DWORD			written;
+
+	hdr.magic		= JOURNAL_MAGIC;
+	hdr.version		= JOURNAL_VERSION;
+	hdr.charsize	= sizeof(type);
+	hdr.offsetsize	= sizeof(size_w);
+	hdr.base_length = base_length;
+	hdr.base_time	= *base_time;
+
+	return file_seek(hFile, 0) && 
+		WriteFile(hFile, &hdr, sizeof(hdr), &written, 0) && written == sizeof(hdr);
+}
+
+//
+//	sequence::journal
+//
+//	Start journalling edits to the specified file. If the file already 
+//	holds a journal that was made against the file the sequence was opened
+//	from (e.g. after a crash), its edits and undo/redo history are replayed
+//	first, and new edits are appended to it. The sequence must not have
+//	been modified since it was opened
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::journal(TCHAR *filename)
+{
+	journal_header	hdr;
+	HANDLE			hFile;
+	DWORD			numread;
+	size_w			validsize;
+
+	endjournal(false);
+
+	if(!undostack.empty() || !redostack.empty() || !branches.empty())
+		return false;
+
+	hFile = CreateFile(filename, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ, 0, OPEN_ALWAYS, 0, 0);
+
+	if(hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	journal_revbase = revision_parent.size();
+
+	if(ReadFile(hFile, &hdr, sizeof(hdr), &numread, 0) && numread == sizeof(hdr) &&
+	   hdr.magic		== JOURNAL_MAGIC	&& 
+	   hdr.version		== JOURNAL_VERSION	&&
+	   hdr.charsize		== sizeof(seqchar)	&& 
+	   hdr.offsetsize	== sizeof(size_w)	&&
+	   hdr.base_length	== base_length		&& 
+	   CompareFileTime(&hdr.base_time, &base_time) == 0)
+	{
+		journal_replay(hFile, &validsize);
+	}
+	else
+	{
+		// not a journal for this file, start a new one
+		if(!journal_writeheader<seqchar>(hFile, base_length, &base_time))
+		{
+			CloseHandle(hFile);
+			return false;
+		}
+
+		validsize = sizeof(hdr);
+	}
+
+	// discard anything after the last record that could be replayed
+	if(!file_seek(hFile, validsize) || !SetEndOfFile(hFile))
+	{
+		CloseHandle(hFile);
+		return false;
+	}
+
+	lstrcpyn(journal_name, filename, MAX_PATH);
+	journal_file = hFile;
+	journal_size = validsize;
+	return true;
+}
+
+//
+//	sequence::endjournal
+//
+//	Stop journalling. The journal is deleted if 'discard' is true (i.e. 
+//	once the document has been saved and the journal is no longer needed)
+//
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::endjournal(bool discard)
+{
+	if(journal_file)
+	{
+		CloseHandle(journal_file);
+
+		if(discard)
+			DeleteFile(journal_name);
+	}
+
+	journal_file = 0;
+	journal_size = 0;
+}
+
+//
+//	sequence::journal_rebase
+//
+//	the file has been saved, so the journal starts again from the file as
+//	it is now. Only the edits made after the save can be recovered, and an
+//	undo back past the save-point ends the replay
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::journal_rebase()
+{
+	if(journal_file == 0)
+		return true;
+
+	if(!journal_writeheader<seqchar>(journal_file, base_length, &base_time) || !SetEndOfFile(journal_file))
+	{
+		endjournal(false);
+		return false;
+	}
+
+	journal_size	= sizeof(journal_header);
+	journal_revbase = revision_parent.size();
+	return true;
+}
+
+//
+//	sequence::journal_write
+//
+//	append a record for an operation that has just been committed. 'group'
+//	is the undo-group that was open when the operation started. The record
+//	goes out in a single write, so after a crash the journal ends with at
+//	most one partial record
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::journal_write(int type, const edit *edits, size_t count, size_t group)
+{
+	std::vector<BYTE>	record;
+	journal_record	  *	rec;
+	journal_edit	  *	je;
+	seqchar			  *	data;
+	size_w				datalen = 0;
+	size_w				reclen;
+	DWORD				written;
+	size_t				i;
+	size_w				len;
+
+	// a fill's data is just the value being repeated
+	for(i = 0; i < count; i++)
+		datalen += type == journal_fill ? 1 : edits[i].length;
+
+	reclen = sizeof(journal_record) + count * sizeof(journal_edit) + datalen * sizeof(seqchar);
+
+	if(reclen > 0xffffffff)
+	{
+		endjournal(false);
+		return false;
+	}
+
+	record.resize((size_t)reclen);
+	rec  = (journal_record *)&record[0];
+	je	 = (journal_edit *)(rec + 1);
+	data = (seqchar *)(je + count);
+
+	rec->type	= type;
+	rec->count	= (DWORD)count;
+	rec->group	= group;
+	rec->reclen = reclen;
+
+	for(i = 0; i < count; i++, je++)
+	{
+		je->index		 = edits[i].index;
+		je->erase_length = edits[i].erase_length;
+		je->length		 = edits[i].length;
+		len				 = type == journal_fill ? 1 : edits[i].length;
+
+		if(len > 0)
+			memcpy(data, edits[i].buf, (size_t)len * sizeof(seqchar));
+
+		data += len;
+	}
+
+	// a journal with a hole in it can't be replayed, so stop at the 
+	// first failure. What was written so far is still usable
+	if(!file_seek(journal_file, journal_size) ||
+	   !WriteFile(journal_file, &record[0], (DWORD)reclen, &written, 0) || written != reclen)
+	{
+		endjournal(false);
+		return false;
+	}
+
+	journal_size += reclen;
+	return true;
+}
+
+//
+//	sequence::journal_replay
+//
+//	re-apply each journalled operation through the same public methods
+//	that made it, so the span-table, undo/redo stacks and coalescing are
+//	rebuilt exactly. Stops at the first record that is incomplete or can't
+//	be applied, and returns the length of the journal that was replayed
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::journal_replay(HANDLE hFile, size_w *validsize)
+{
+	std::vector<BYTE>	record;
+	std::vector<edit>	edits;
+	journal_record		rec;
+	journal_edit	  *	je;
+	const seqchar	  *	data;
+	size_w				datalen;
+	DWORD				numread;
+	DWORD				i;
+	bool				success = true;
+
+	*validsize = sizeof(journal_header);
+
+	while(success)
+	{
+		if(!ReadFile(hFile, &rec, sizeof(rec), &numread, 0) || numread != sizeof(rec))
+			break;
+
+		if(rec.reclen < sizeof(rec) + (size_w)rec.count * sizeof(journal_edit) || rec.reclen > 0xffffffff)
+			break;
+
+		// the edits and their data
+		record.resize((size_t)(rec.reclen - sizeof(rec)) + 1);
+
+		if(!ReadFile(hFile, &record[0], (DWORD)(rec.reclen - sizeof(rec)), &numread, 0) || 
+			numread != rec.reclen - sizeof(rec))
+		{
+			break;
+		}
+
+		je		= (journal_edit *)&record[0];
+		data	= (const seqchar *)(je + rec.count);
+		datalen = 0;
+
+		edits.resize(rec.count + 1);
+
+		for(i = 0; i < rec.count; i++, je++)
+		{
+			edits[i].index		  = je->index;
+			edits[i].erase_length = je->erase_length;
+			edits[i].length		  = je->length;
+			edits[i].buf		  = data + datalen;
+			datalen				 += rec.type == journal_fill ? 1 : je->length;
+		}
+
+		if(sizeof(rec) + rec.count * sizeof(journal_edit) + datalen * sizeof(seqchar) != rec.reclen)
+			break;
+
+		// put the operation back in the undo-group it was made in
+		if(rec.group)
+		{
+			group_id	   = (size_t)rec.group;
+			group_refcount = 1;
+		}
+
+		switch(rec.type)
+		{
+		case journal_insert:
+			success = rec.count == 1 && insert(edits[0].index, edits[0].buf, edits[0].length);
+			break;
+
+		case journal_erase:
+			success = rec.count == 1 && erase(edits[0].index, edits[0].erase_length);
+			break;
+
+		case journal_replace:
+			success = rec.count == 1 && replace(edits[0].index, edits[0].buf, edits[0].length, edits[0].erase_length);
+			break;
+
+		case journal_apply:
+			success = rec.count > 0 && apply(&edits[0], rec.count);
+			break;
+
+		case journal_undo:
+			success = undo();
+			break;
+
+		case journal_redo:
+			success = redo();
+			break;
+
+		case journal_breakopt:
+			breakopt();
+			break;
+
+		case journal_fill:
+			if(rec.count == 1 && edits[0].erase_length == 0)
+				success = insert(edits[0].index, edits[0].buf[0], edits[0].length);
+			else
+				success = rec.count == 1 && replace(edits[0].index, edits[0].buf[0], edits[0].length);
+			break;
+
+		case journal_branch:
+			success = rec.count == 1 && edits[0].index < revision_parent.size() - journal_revbase &&
+				switchbranch(journal_revbase + (size_t)edits[0].index);
+			break;
+
+		default:
+			success = false;
+			break;
+		}
+
+		group_refcount = 0;
+
+		if(success)
+			*validsize += rec.reclen;
+	}
+
+	return success;
+}
+
+//
+//	Return logical length of the sequence
+//
+template <class CharT, class SizeT>
+typename basic_sequence<CharT, SizeT>::size_w basic_sequence<CharT, SizeT>::size () const
+{
+	return sequence_length;
+}
+
+//
+//	sequence::initundo
+//
+//	create a new (empty) span range and save the current sequence state
+//
+template <class CharT, class SizeT>
+typename basic_sequence<CharT, SizeT>::span_range* basic_sequence<CharT, SizeT>::initundo (size_w index, size_w length, action act)
+{
+	span_range *top	  = stackback(undostack, 0);
+	span_range *event = new (rangepool.alloc()) span_range (
+								sequence_length, 
+								index,
+								length,
+								act,
+								group_refcount ? group_id : 0
+								);
+
+	// unless the event joins the current undo-group it starts a new 
+	// revision, made from the current one
+	if(top == 0 || event->group_id == 0 || event->group_id != top->group_id)
+	{
+		revision_parent.push_back(revision_current);
+		revision_current = revision_parent.size() - 1;
+	}
+
+	event->revision = revision_current;
+	undostack.push_back(event);
+	
+	return event;
+}
+
+template <class CharT, class SizeT>
+typename basic_sequence<CharT, SizeT>::span_range* basic_sequence<CharT, SizeT>::stackback(eventstack &source, size_t idx)
+{
+	size_t length = source.size();
+	
+	if(length > 0 && idx < length)
+	{
+		return source[length - idx - 1];
+	}
+	else
+	{
+		return 0;
+	}
+}
+
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::record_action (action act, size_w index)
+{
+	lastaction_index = index;
+	lastaction       = act;
+}
+
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::can_optimize (action act, size_w index)
+{
+	return (lastaction == act && lastaction_index == index);
+}
+
+//
+//	sequence::insert_worker
+//
+//	for a fill, 'buf' points to the single value to insert 'length' times
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::insert_worker (size_w index, const seqchar *buf, size_w length, action act, bool fill)
+{
+	span *		sptr;
+	size_w		spanindex;
+	size_t		modbuf_offset;
+	int			modbuf_id;
+	span_range	newspans;
+	size_w		insoffset;
+
+	if(index > sequence_length)
+		return false;
+
+	// find the span that the insertion starts at
+	if((sptr = spanfromindex(index, &spanindex)) == 0)
+		return false;
+
+	// take a copy of the data - or give a fill a buffer of its own
+	if(fill)
+	{
+		buffer_control *bc = alloc_fillbuffer(*buf, length);
+
+		if(bc == 0)
+			return false;
+
+		modbuf_id	  = bc->id;
+		modbuf_offset = 0;
+	}
+	else if(!import_buffer(buf, (size_t)length, &modbuf_id, &modbuf_offset))
+	{
+		return false;
+	}
+
+	debug("Inserting: idx=%d len=%d %.*s\n", index, length, length, buf);
+
+	keepbranch();
+	insoffset = index - spanindex;
+	edit_count++;
+
+	// special-case #1: inserting at the end of a prior insertion, at a span-boundary.
+	// The new data must follow straight on from the prior insertion's data (it 
+	// won't if the modify-buffer filled up in between)
+	if(insoffset == 0 && can_optimize(act, index) && 
+	   sptr->prev != head &&
+	   sptr->prev->buffer == modbuf_id && 
+	   sptr->prev->offset + sptr->prev->length == modbuf_offset)
+	{
+		// simply extend the last span's length
+		span_range *event = undostack.back();
+		tree_setlength(sptr->prev, sptr->prev->length + length);
+		event->length		+= length;
+		coalesce_count++;
+	}
+	// general-case #1: inserting at a span boundary?
+	else if(insoffset == 0)
+	{
+		//
+		// Create a new undo event; because we are inserting at a span
+		// boundary there are no spans to replace, so use a "span boundary"
+		//
+		span_range *oldspans = initundo(index, length, act);
+		oldspans->spanboundary(sptr->prev, sptr);
+		
+		// allocate new span in the modify buffer
+		newspans.append(new (spanpool.alloc()) span(
+			modbuf_offset, 
+			length, 
+			modbuf_id)
+			);
+		
+		// link the span into the sequence
+		swap_spanrange(oldspans, &newspans);
+	}
+	// general-case #2: inserting in the middle of a span
+	else
+	{
+		//
+		//	Create a new undo event and add the span
+		//  that we will be "splitting" in half
+		//
+		span_range *oldspans = initundo(index, length, act);
+		oldspans->append(sptr);
+
+		//	span for the existing data before the insertion
+		newspans.append(new (spanpool.alloc()) span(
+							sptr->offset, 
+							insoffset, 
+							sptr->buffer)
+						);
+
+		// make a span for the inserted data
+		newspans.append(new (spanpool.alloc()) span(
+							modbuf_offset, 
+							length, 
+							modbuf_id)
+						);
+
+		// span for the existing data after the insertion
+		newspans.append(new (spanpool.alloc()) span(
+							sptr->offset + insoffset, 
+							sptr->length - insoffset, 
+							sptr->buffer)
+						);
+
+		swap_spanrange(oldspans, &newspans);
+	}
+
+	sequence_length += length;
+	undo_trim();
+
+	return true;
+}
+
+//
+//	sequence::insert
+//
+//	Insert a buffer into the sequence at the specified position.
+//	Consecutive insertions are optimized into a single event
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::insert (size_w index, const seqchar *buf, size_w length)
+{
+	if(insert_worker(index, buf, length, action_insert))
+	{
+		record_action(action_insert, index + length);
+
+		if(journal_file)
+		{
+			edit e = { index, 0, buf, length };
+			journal_write(journal_insert, &e, 1, group_refcount ? group_id : 0);
+		}
+
+		return true;
+	}
+	else
+	{
+		return false;
+	}
+}
+
+//
+//	sequence::insert
+//
+//	Insert 'count' copies of a value. A long fill is stored as a single 
+//	span that repeats the value, so it costs the same whatever its length
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::insert (size_w index, const seqchar val, size_w count)
+{
+	if(count <= FILL_BLOCKSIZE)
+	{
+		std::vector<seqchar> data((size_t)count + 1, val);
+		return insert(index, &data[0], count);
+	}
+
+	if(maxlength() - sequence_length < count)
+		return false;
+
+	if(insert_worker(index, &val, count, action_insert, true))
+	{
+		record_action(action_insert, index + count);
+
+		if(journal_file)
+		{
+			edit e = { index, 0, &val, count };
+			journal_write(journal_fill, &e, 1, group_refcount ? group_id : 0);
+		}
+
+		return true;
+	}
+	else
+	{
+		return false;
+	}
+}
+
+//
+//	sequence::insert
+//
+//	Insert specified character-value into sequence
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::insert (size_w index, const seqchar val)
+{
+	return insert(index, &val, 1);
+}
+
+//
+//	sequence::deletefromsequence
+//
+//	Remove + delete the specified *span* from the sequence
+//
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::deletefromsequence(span **psptr)
+{
+	span *sptr = *psptr;
+	tree_remove(sptr);
+	sptr->prev->next = sptr->next;
+	sptr->next->prev = sptr->prev;
+
+	memset(sptr, 0, sizeof(span));
+	spanpool.free(sptr);
+	*psptr = 0;
+}
+
+//
+//	sequence::erase_worker
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::erase_worker (size_w index, size_w length, action act)
+{
+	span		*sptr;
+	span_range	 oldspans;
+	span_range	 newspans;
+	span_range	*event;
+	size_w		 spanindex;
+	size_w		 remoffset;
+	size_w		 removelen;
+	bool		 append_spanrange;	
+
+	debug("Erasing: idx=%d len=%d\n", index, length);
+
+	// make sure we stay within the range of the sequence
+	if(length == 0 || length > sequence_length || index > sequence_length - length)
+		return false;
+
+	// find the span that the deletion starts at
+	if((sptr = spanfromindex(index, &spanindex)) == 0)
+		return false;
+
+	// work out the offset relative to the start of the *span*
+	remoffset = index - spanindex;
+	removelen = length;
+	edit_count++;
+
+	//
+	//	can we optimize?
+	//
+	//	special-case 1: 'forward-delete'
+	//	erase+replace operations will pass through here
+	//
+	if(index == spanindex && can_optimize(act, index))
+	{
+		event = stackback(undostack, act == action_replace ? 1 : 0);
+		event->length	+= length;
+		append_spanrange = true;
+		coalesce_count++;
+
+		if(frag2 != 0)
+		{
+			if(length < frag2->length)
+			{
+				tree_setlength(frag2, frag2->length - length);
+				frag2->offset	+= length;
+				sequence_length -= length;
+				return true;
+			}
+			else
+			{
+				if(act == action_replace)
+					stackback(undostack, 0)->last = frag2->next;
+
+				removelen	-= sptr->length;
+				sptr = sptr->next;
+				deletefromsequence(&frag2);
+			}
+		}
+	}
+	//
+	//	special-case 2: 'backward-delete'
+	//	only erase operations can pass through here
+	//
+	else if(index + length == spanindex + sptr->length && act == action_erase && can_optimize(action_erase, index+length))
+	{
+		event = undostack.back();
+		event->length	+= length;
+		event->index	-= length;
+		append_spanrange = false;
+		coalesce_count++;
+
+		if(frag1 != 0)
+		{
+			if(length < frag1->length)
+			{
+				tree_setlength(frag1, frag1->length - length);
+				frag1->offset	+= 0;
+				sequence_length -= length;
+				return true;
+			}
+			else
+			{
+				removelen -= frag1->length;
+				deletefromsequence(&frag1);
+			}
+		}
+	}
+	else
+	{
+		append_spanrange = true;
+		frag1 = frag2 = 0;
+
+		if((event = initundo(index, length, act)) == 0)
+			return false;
+	}
+
+	//
+	//	general-case 2+3
+	//
+	keepbranch();
+
+	// does the deletion *start* mid-way through a span?
+	if(remoffset != 0)
+	{
+		// split the span - keep the first "half"
+		newspans.append(new (spanpool.alloc()) span(sptr->offset, remoffset, sptr->buffer));
+		frag1 = newspans.first;
+		
+		// have we split a single span into two?
+		// i.e. the deletion is completely within a single span
+		if(remoffset + removelen < sptr->length)
+		{
+			// make a second span for the second half of the split
+			newspans.append(new (spanpool.alloc()) span(
+							sptr->offset + remoffset + removelen, 
+							sptr->length - remoffset - removelen, 
+							sptr->buffer)
+							);
+
+			frag2 = newspans.last;
+		}
+
+		removelen -= min(removelen, (sptr->length - remoffset));
+
+		// archive the span we are going to replace
+		oldspans.append(sptr);
+		sptr = sptr->next;	
+	}
+
+	// we are now on a proper span boundary, so remove
+	// any further spans that the erase-range encompasses
+	while(removelen > 0 && sptr != tail)
+	{
+		// will the entire span be removed?
+		if(removelen < sptr->length)
+		{
+			// split the span, keeping the last "half"
+			newspans.append(new (spanpool.alloc()) span(
+						sptr->offset + removelen, 
+						sptr->length - removelen, 
+						sptr->buffer)
+						);
+
+			frag2 = newspans.last;
+		}
+
+		removelen -= min(removelen, sptr->length);
+
+		// archive the span we are replacing
+		oldspans.append(sptr);
+		sptr = sptr->next;
+	}
+
+	// for replace operations, update the undo-event for the
+	// insertion so that it knows about the newly removed spans
+	if(act == action_replace && !oldspans.boundary)
+		stackback(undostack, 0)->last = oldspans.last->next;
+
+	swap_spanrange(&oldspans, &newspans);
+	sequence_length -= length;
+
+	if(append_spanrange)
+		event->append(&oldspans);
+	else
+		event->prepend(&oldspans);
+
+	undo_trim();
+	return true;
+}
+
+//
+//	sequence::erase 
+//
+//  "removes" the specified range of data from the sequence. 
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::erase (size_w index, size_w len)
+{
+	if(erase_worker(index, len, action_erase))
+	{
+		record_action(action_erase, index);
+
+		if(journal_file)
+		{
+			edit e = { index, len, 0, 0 };
+			journal_write(journal_erase, &e, 1, group_refcount ? group_id : 0);
+		}
+
+		return true;
+	}
+	else
+	{
+		return false;
+	}
+}
+
+//
+//	sequence::erase
+//
+//	remove single character from sequence
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::erase (size_w index)
+{
+	return erase(index, 1);
+}
+
+//
+//	sequence::replace
+//
+//	A 'replace' (or 'overwrite') is a combination of erase+inserting
+//  (first we erase a section of the sequence, then insert a new block
+//  in it's place). 
+//
+//	Doing this as a distinct operation (erase+insert at the 
+//  same time) is really complicated, so I just make use of the existing 
+//  sequence::erase and sequence::insert and combine them into action. We
+//	need to play with the undo stack to combine them in a 'true' sense.
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::replace(size_w index, const seqchar *buf, size_w length, size_w erase_length)
+{
+	size_t groupid = group_refcount ? group_id : 0;
+
+	debug("Replacing: idx=%d len=%d %.*s\n", index, length, length, buf);
+
+	if(!replace_worker(index, buf, length, erase_length, false))
+		return false;
+
+	if(journal_file)
+	{
+		edit e = { index, erase_length, buf, length };
+		journal_write(journal_replace, &e, 1, groupid);
+	}
+
+	return true;
+}
+
+//
+//	sequence::replace_worker
+//
+//	the erase+insert behind every replace. For a fill, 'buf' points to 
+//	the single value to insert 'length' times
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::replace_worker(size_w index, const seqchar *buf, size_w length, size_w erase_length, bool fill)
+{
+	size_t remlen = 0;
+
+	// make sure operation is within allowed range
+	if(index > sequence_length || maxlength() - index < length)
+		return false;
+
+	// for a "replace" which will overrun the sequence, make sure we 
+	// only delete up to the end of the sequence
+	remlen = min(sequence_length - index, erase_length);
+
+	// combine the erase+insert actions together
+	group();
+
+	// first of all remove the range
+	if(remlen > 0 && index < sequence_length && !erase_worker(index, remlen, action_replace))
+	{
+		ungroup();
+		return false;
+	}
+	
+	// then insert the data. When nothing was erased this is a plain insert,
+	// and must not coalesce as though there were an erase-event beneath it
+	if(insert_worker(index, buf, length, remlen > 0 ? action_replace : action_insert, fill))
+	{
+		ungroup();
+		record_action(remlen > 0 ? action_replace : action_insert, index + length);
+		return true;
+	}
+	else
+	{
+		// failed...cleanup what we have done so far
+		ungroup();
+		record_action(action_invalid, 0);
+
+		span_range *range = undostack.back();
+		undostack.pop_back();
+		restore_spanrange(range, true);
+
+		// if that was the only event of its revision, the revision is gone
+		if(undostack.empty() || undostack.back()->revision != range->revision)
+		{
+			revision_current = revision_parent[range->revision];
+
+			if(range->revision + 1 == revision_parent.size())
+				revision_parent.pop_back();
+		}
+
+		rangepool.free(range);
+
+		return false;
+	}
+}
 
-	// we are now on a proper span boundary, so remove
-	// any further spans that the erase-range encompasses
-	while(removelen > 0 && sptr != tail)
+//
+//	sequence::replace
+//
+//	overwrite with the specified buffer
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::replace (size_w index, const seqchar *buf, size_w length)
+{
+	return replace(index, buf, length, length);
+}
+
+//
+//	sequence::replace
+//
+//	overwrite with 'count' copies of a value, stored as a fill (see 
+//	sequence::insert) when the run is long
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::replace (size_w index, const seqchar val, size_w count)
+{
+	size_t groupid = group_refcount ? group_id : 0;
+
+	if(count <= FILL_BLOCKSIZE)
 	{
-		// will the entire span be removed?
-		if(removelen < sptr->length)
+		std::vector<seqchar> data((size_t)count + 1, val);
+		return replace(index, &data[0], count);
+	}
+
+	if(!replace_worker(index, &val, count, count, true))
+		return false;
+
+	if(journal_file)
+	{
+		edit e = { index, count, &val, count };
+		journal_write(journal_fill, &e, 1, groupid);
+	}
+
+	return true;
+}
+
+//
+//	sequence::replace
+//
+//	overwrite with a single character-value
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::replace (size_w index, const seqchar val)
+{
+	return replace(index, &val, 1);
+}
+
+//
+//	sequence::apply
+//
+//	Apply a batch of edits as a single undoable event. The edits must be
+//	sorted by index and must not overlap. Rather than running each one 
+//	through insert/erase, the spans between the first and last edit are 
+//	rebuilt in one pass and swapped into the list in one go. A batch that
+//	neither erases nor inserts anything leaves the sequence (and the undo
+//	history) untouched
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::apply (const edit *edits, size_t count)
+{
+	span	   *	sptr;
+	span_range		oldspans;
+	span_range		newspans;
+	span_range	*	event;
+	size_w			spanindex;
+	size_w			spanoff = 0;
+	size_w			pos;
+	size_w			newlength = sequence_length;
+	size_w			newend	  = 0;
+	size_t			modbuf_offset;
+	int				modbuf_id;
+	size_t			first	  = count;
+	size_t			i;
+
+	if(count == 0)
+		return false;
+
+	// make sure every edit lies within the sequence, in order
+	for(i = 0; i < count; i++)
+	{
+		const edit &e = edits[i];
+
+		if(e.index > sequence_length || e.erase_length > sequence_length - e.index)
+			return false;
+
+		if(i > 0 && edits[i-1].index + edits[i-1].erase_length > e.index)
+			return false;
+
+		newlength -= e.erase_length;
+
+		if(maxlength() - newlength < e.length)
+			return false;
+
+		newlength += e.length;
+
+		if(e.erase_length == 0 && e.length == 0)
+			continue;
+
+		// where the last edit finishes, once the batch has been applied
+		newend     = e.index + e.erase_length + (newlength - sequence_length);
+
+		if(first == count)
+			first = i;
+	}
+
+	// don't split any spans (or start an undo-event) for nothing
+	if(first == count)
+		return true;
+
+	// find the span that the first real edit starts in
+	if((sptr = spanfromindex(edits[first].index, &spanindex)) == 0)
+		return false;
+
+	pos = spanindex;
+
+	for(i = first; i < count; i++)
+	{
+		const edit &e = edits[i];
+		size_w remove = e.erase_length;
+
+		// an empty edit would only split a span in two
+		if(remove == 0 && e.length == 0)
+			continue;
+
+		// keep the unchanged data between the previous edit and this one
+		while(pos < e.index)
 		{
-			// split the span, keeping the last "half"
-			newspans.append(new span(
-						sptr->offset + removelen, 
-						sptr->length - removelen, 
-						sptr->buffer)
-						);
+			size_w len = min(sptr->length - spanoff, e.index - pos);
 
-			frag2 = newspans.last;
+			newspans.append(new (spanpool.alloc()) span(sptr->offset + spanoff, len, sptr->buffer));
+			spanoff += len;
+			pos		+= len;
+
+			if(spanoff == sptr->length)
+			{
+				oldspans.append(sptr);
+				sptr	= sptr->next;
+				spanoff = 0;
+			}
 		}
 
-		removelen -= min(removelen, sptr->length);
+		// step over the data being erased
+		while(remove > 0)
+		{
+			size_w len = min(sptr->length - spanoff, remove);
 
-		// archive the span we are replacing
+			spanoff += len;
+			pos		+= len;
+			remove	-= len;
+
+			if(spanoff == sptr->length)
+			{
+				oldspans.append(sptr);
+				sptr	= sptr->next;
+				spanoff = 0;
+			}
+		}
+
+		// add a span for the inserted data
+		if(e.length > 0)
+		{
+			if(!import_buffer(e.buf, (size_t)e.length, &modbuf_id, &modbuf_offset))
+			{
+				newspans.free(spanpool);
+				return false;
+			}
+
+			newspans.append(new (spanpool.alloc()) span(modbuf_offset, e.length, modbuf_id));
+		}
+	}
+
+	// keep the rest of a span that the last edit finished inside
+	if(spanoff > 0)
+	{
+		newspans.append(new (spanpool.alloc()) span(sptr->offset + spanoff, sptr->length - spanoff, sptr->buffer));
 		oldspans.append(sptr);
 		sptr = sptr->next;
 	}
 
-	// for replace operations, update the undo-event for the
-	// insertion so that it knows about the newly removed spans
-	if(act == action_replace && !oldspans.boundary)
-		stackback(undostack, 0)->last = oldspans.last->next;
+	keepbranch();
+	record_action(action_invalid, 0);
+	frag1 = frag2 = 0;
+
+	// a single undo-event covers the entire batch
+	event = initundo(edits[first].index, newend - edits[first].index, action_replace);
+
+	if(oldspans.boundary)
+		event->spanboundary(sptr->prev, sptr);
+	else
+		event->append(&oldspans);
+
+	swap_spanrange(event, &newspans);
+	sequence_length = newlength;
+	undo_trim();
+
+	if(journal_file)
+		journal_write(journal_apply, edits, count, group_refcount ? group_id : 0);
+
+	return true;
+}
+
+//
+//	sequence::append
+//
+//	very simple wrapper around sequence::insert, just inserts at
+//  the end of the sequence
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::append (const seqchar *buf, size_w length)
+{
+	return insert(size(), buf, length);
+}
+
+//
+//	sequence::append
+//
+//	append a single character to the sequence
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::append (const seqchar val)
+{
+	return append(&val, 1);
+}
+
+//
+//	sequence::clear
+//
+//	empty the entire sequence, clear undo/redo history etc
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::clear ()
+{
+	// re-link the head+tail
+	head->next = tail;
+	tail->prev = head;
+	root	   = 0;
+
+	// every span and span_range lives in the node-pools, so the
+	// sequence and its undo/redo stacks can be released in one go
+	undostack.clear();
+	redostack.clear();
+	spanpool.release();
+	rangepool.release();
+	frag1 = frag2 = 0;
+
+	// the spilled history went with the undostack
+	if(spill_file)
+		CloseHandle(spill_file);
+
+	spill_file		= 0;
+	spill_size		= 0;
+	spill_count		= 0;
+	undo_resident	= 0;
+	compact_index	= 0;
+
+	// the journal belongs to the file that was open
+	endjournal(false);
+	filebuffer_id = -1;
+	branches.clear();
+	revision_parent.assign(1, 0);
+	revision_current = 0;
+	revision_saved	 = 0;
+
+	file_written.clear();
+	can_quicksave = false;
+	file_volume = 0;
+	file_indexhi = 0;
+	file_indexlo = 0;
+	base_length = 0;
+	edit_count = 0;
+	coalesce_count = 0;
+	memset(&base_time, 0, sizeof(base_time));
+
+	// delete all memory-buffers (some may already have been released)
+	for(size_t i = 0; i < buffer_list.size(); i++)
+	{
+		if(buffer_list[i])
+			free_buffer(buffer_list[i]);
+	}
+
+	buffer_list.clear();
+	import_blocks.clear();
+	sequence_length = 0;
+	return true;
+}
+
+//
+//	sequence::render
+//
+//	render the specified range of data (index, len) and store in 'dest'
+//
+//	Returns number of chars copied into destination
+//
+template <class CharT, class SizeT>
+typename basic_sequence<CharT, SizeT>::size_w basic_sequence<CharT, SizeT>::render(size_w index, seqchar *dest, size_w length) const
+{
+	size_w spanoffset = 0;
+	size_w total = 0;
+	span  *sptr;
+
+	// find span to start rendering at
+	if((sptr = spanfromindex(index, &spanoffset)) == 0)
+		return false;
+
+	// might need to start mid-way through the first span
+	spanoffset = index - spanoffset;
+
+	// copy each span's referenced data in succession
+	while(length && sptr != tail)
+	{
+		const seqchar *source;
+		size_w copylen = min(spandata(sptr, spanoffset, &source), length);
+
+		memcpy(dest, source, copylen * sizeof(seqchar));
+		
+		dest	+= copylen;
+		length	-= copylen;
+		total	+= copylen;
+
+		// a fill span is copied a block at a time
+		if((spanoffset += copylen) == sptr->length)
+		{
+			sptr = sptr->next;
+			spanoffset = 0;
+		}
+	}
+
+	return total;
+}
+
+//
+//	sequence::iterate
+//
+//	return an iterator positioned at the specified index
+//
+template <class CharT, class SizeT>
+typename basic_sequence<CharT, SizeT>::iterator basic_sequence<CharT, SizeT>::iterate(size_w index) const
+{
+	return iterator(this, index);
+}
+
+//
+//	sequence::peek
+//
+//	return single element at specified position in the sequence
+//
+template <class CharT, class SizeT>
+typename basic_sequence<CharT, SizeT>::seqchar basic_sequence<CharT, SizeT>::peek(size_w index) const
+{
+	seqchar   value;
+	return render(index, &value, 1) ? value : 0;
+}
+
+//
+//	sequence::poke
+//
+//	modify single element at specified position in the sequence
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::poke(size_w index, seqchar value) 
+{
+	return replace(index, &value, 1);
+}
+
+//
+//	sequence::operator[] const
+//
+//	readonly array access
+//
+template <class CharT, class SizeT>
+typename basic_sequence<CharT, SizeT>::seqchar basic_sequence<CharT, SizeT>::operator[] (size_w index) const
+{
+	return peek(index);
+}
+
+//
+//	sequence::operator[] 
+//
+//	read/write array access
+//
+template <class CharT, class SizeT>
+typename basic_sequence<CharT, SizeT>::ref basic_sequence<CharT, SizeT>::operator[] (size_w index)
+{
+	return ref(this, index);
+}
+
+//
+//	sequence::snapshot
+//
+//	Take an immutable copy of the sequence for reading on another thread. 
+//	Spans are modified in-place as the sequence is edited so they can't be
+//	shared - instead their positions are copied (which is proportional to 
+//	the number of spans, not the length of the text) and the buffers they 
+//	refer to are kept alive until the version is released. The buffers are 
+//	safe to share because data already in them never changes
+//
+template <class CharT, class SizeT>
+typename basic_sequence<CharT, SizeT>::version* basic_sequence<CharT, SizeT>::snapshot() const
+{
+	std::vector<bool>	used(buffer_list.size(), false);
+	version			  *	ver;
+	span			  *	sptr;
+
+	if((ver = new version) == 0)
+		return 0;
+
+	for(sptr = head->next; sptr != tail; sptr = sptr->next)
+	{
+		buffer_control *bc = buffer_list[sptr->buffer];
+		typename version::piece p;
+
+		if(sptr->length == 0)
+			continue;
+
+		p.data	 = bc->fill ? bc->buffer : bc->buffer + sptr->offset;
+		p.index	 = ver->length;
+		p.length = sptr->length;
+		p.repeat = bc->fill ? bc->maxsize : 0;
+
+		ver->piecelist.push_back(p);
+		ver->length += sptr->length;
+
+		if(!used[sptr->buffer])
+		{
+			used[sptr->buffer] = true;
+			InterlockedIncrement(&bc->refcount);
+			ver->bufferlist.push_back(bc);
+		}
+	}
+
+	return ver;
+}
+
+template <class CharT, class SizeT>
+basic_sequence<CharT, SizeT>::version::version()
+{
+	length	 = 0;
+	refcount = 1;
+}
+
+template <class CharT, class SizeT>
+basic_sequence<CharT, SizeT>::version::~version()
+{
+	for(size_t i = 0; i < bufferlist.size(); i++)
+		free_buffer(bufferlist[i]);
+}
+
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::version::addref()
+{
+	InterlockedIncrement(&refcount);
+}
+
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::version::release()
+{
+	if(InterlockedDecrement(&refcount) == 0)
+		delete this;
+}
+
+//
+//	sequence::version::findpiece
+//
+//	binary-search for the piece containing the specified index
+//
+template <class CharT, class SizeT>
+size_t basic_sequence<CharT, SizeT>::version::findpiece(size_w index) const
+{
+	size_t lo = 0;
+	size_t hi = piecelist.size();
 
-	swap_spanrange(&oldspans, &newspans);
-	sequence_length -= length;
+	while(hi - lo > 1)
+	{
+		size_t mid = (lo + hi) / 2;
 
-	if(append_spanrange)
-		event->append(&oldspans);
-	else
-		event->prepend(&oldspans);
+		if(piecelist[mid].index <= index)
+			lo = mid;
+		else
+			hi = mid;
+	}
 
-	return true;
+	return lo;
 }
 
 //
-//	sequence::erase 
+//	sequence::version::chunk
 //
-//  "removes" the specified range of data from the sequence. 
+//	return a pointer to the data at the specified index, and the number of
+//	contiguous elements available there
 //
-bool sequence::erase (size_w index, size_w len)
+template <class CharT, class SizeT>
+typename basic_sequence<CharT, SizeT>::size_w basic_sequence<CharT, SizeT>::version::chunk(size_w index, const seqchar **ptr) const
 {
-	if(erase_worker(index, len, action_erase))
+	if(index >= length)
 	{
-		record_action(action_erase, index);
-		return true;
+		*ptr = 0;
+		return 0;
 	}
-	else
+
+	const piece &p = piecelist[findpiece(index)];
+
+	// a fill is the same block of data over and over
+	if(p.repeat)
 	{
-		return false;
+		*ptr = p.data;
+		return min(p.length - (index - p.index), p.repeat);
 	}
+
+	*ptr = p.data + (index - p.index);
+	return p.length - (index - p.index);
 }
 
 //
-//	sequence::erase
+//	sequence::version::render
 //
-//	remove single character from sequence
+//	copy the specified range of data into 'dest', returning the number 
+//	of elements copied
 //
-bool sequence::erase (size_w index)
+template <class CharT, class SizeT>
+typename basic_sequence<CharT, SizeT>::size_w basic_sequence<CharT, SizeT>::version::render(size_w index, seqchar *dest, size_w len) const
 {
-	return erase(index, 1);
+	const seqchar *	src;
+	size_w			total = 0;
+	size_w			avail;
+
+	while(len > 0 && (avail = chunk(index, &src)) != 0)
+	{
+		avail = min(avail, len);
+		memcpy(dest, src, (size_t)avail * sizeof(seqchar));
+
+		dest  += avail;
+		index += avail;
+		len	  -= avail;
+		total += avail;
+	}
+
+	return total;
+}
+
+template <class CharT, class SizeT>
+typename basic_sequence<CharT, SizeT>::seqchar basic_sequence<CharT, SizeT>::version::peek(size_w index) const
+{
+	seqchar value;
+	return render(index, &value, 1) ? value : 0;
 }
 
 //
-//	sequence::replace
+//	sequence::version::iterate
 //
-//	A 'replace' (or 'overwrite') is a combination of erase+inserting
-//  (first we erase a section of the sequence, then insert a new block
-//  in it's place). 
+//	return an iterator positioned at the specified index
 //
-//	Doing this as a distinct operation (erase+insert at the 
-//  same time) is really complicated, so I just make use of the existing 
-//  sequence::erase and sequence::insert and combine them into action. We
-//	need to play with the undo stack to combine them in a 'true' sense.
+template <class CharT, class SizeT>
+typename basic_sequence<CharT, SizeT>::version::iterator basic_sequence<CharT, SizeT>::version::iterate(size_w index) const
+{
+	return iterator(this, index);
+}
+
+//
+//	sequence::nodestats
+//
+//	return the number of span and span_range nodes currently in use, and
+//	the number sitting on the pools' free-lists
 //
-bool sequence::replace(size_w index, const seqchar *buf, size_w length, size_w erase_length)
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::nodestats(size_t *spans_live, size_t *spans_free, size_t *ranges_live, size_t *ranges_free) const
 {
-	size_t remlen = 0;
+	if(spans_live)	*spans_live  = spanpool.livecount();
+	if(spans_free)	*spans_free  = spanpool.freecount();
+	if(ranges_live) *ranges_live = rangepool.livecount();
+	if(ranges_free) *ranges_free = rangepool.freecount();
+}
 
-	debug("Replacing: idx=%d len=%d %.*s\n", index, length, length, buf);
+//
+//	sequence::stats
+//
+//	report how fragmented the sequence is and where its memory has gone.
+//	This walks the span-table and the undo/redo stacks, so is O(spans)
+//	and not something to call after every edit. Events share spans and 
+//	buffers with each other and with the sequence, so the bytes pinned by
+//	the history are an estimate (see sequence::eventsize)
+//
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::stats(seqstats *st) const
+{
+	std::vector<const eventstack *> stacks;
+	span  *sptr;
+	size_t i, j;
 
-	// make sure operation is within allowed range
-	if(index > sequence_length || MAX_SEQUENCE_LENGTH - index < length)
-		return false;
+	memset(st, 0, sizeof(seqstats));
 
-	// for a "replace" which will overrun the sequence, make sure we 
-	// only delete up to the end of the sequence
-	remlen = min(sequence_length - index, erase_length);
+	st->length = sequence_length;
 
-	// combine the erase+insert actions together
-	group();
+	for(sptr = head->next; sptr != tail; sptr = sptr->next)
+		st->spans++;
 
-	// first of all remove the range
-	if(remlen > 0 && index < sequence_length && !erase_worker(index, remlen, action_replace))
+	if(st->spans)
+		st->avgspan = sequence_length / st->spans;
+
+	// buffers released by sequence::compact leave holes in the list
+	for(i = 0; i < buffer_list.size(); i++)
 	{
-		ungroup();
-		return false;
+		buffer_control *bc = buffer_list[i];
+
+		if(bc == 0)
+			continue;
+
+		st->buffers++;
+
+		if(bc->hmapping)
+		{
+			st->mapped	   += bc->length  * sizeof(seqchar);
+		}
+		else
+		{
+			// a fill's length is virtual - only its block is in memory
+			st->heap_alloc += bc->maxsize * sizeof(seqchar);
+			st->heap_used  += (bc->fill ? bc->maxsize : bc->length) * sizeof(seqchar);
+		}
 	}
-	
-	// then insert the data
-	if(insert_worker(index, buf, length, action_replace))
+
+	// spilled events hold nothing in memory
+	st->undo_events  = undostack.size();
+	st->undo_spilled = spill_size;
+
+	for(i = spill_count; i < undostack.size(); i++)
+		st->undo_bytes += undostack[i]->memsize ? undostack[i]->memsize : eventsize(undostack[i]);
+
+	// the redo history is every branch of the undo tree not yet applied
+	history(stacks);
+
+	for(j = 1; j < stacks.size(); j++)
 	{
-		ungroup();
-		record_action(action_replace, index + length);
-		return true;
+		st->redo_events += stacks[j]->size();
+
+		for(i = 0; i < stacks[j]->size(); i++)
+			st->redo_bytes += eventsize((*stacks[j])[i]);
 	}
-	else
-	{
-		// failed...cleanup what we have done so far
-		ungroup();
-		record_action(action_invalid, 0);
 
-		span_range *range = undostack.back();
-		undostack.pop_back();
-		restore_spanrange(range, true);
-		delete range;
+	st->edits	  = edit_count;
+	st->coalesced = coalesce_count;
 
-		return false;
-	}
+	if(edit_count)
+		st->coalesce_rate = (int)((double)coalesce_count * 100 / edit_count);
 }
 
 //
-//	sequence::replace
+//	sequence::compact
 //
-//	overwrite with the specified buffer
+//	Tidy up the span-table after heavy editing. Adjacent spans that refer 
+//	to contiguous data in the same buffer are merged, and runs of tiny 
+//	spans are copied into the modify-buffer as a single span. The content
+//	of the sequence does not change, but outstanding iterators are 
+//	invalidated.
 //
-bool sequence::replace (size_w index, const seqchar *buf, size_w length)
+//	An undo/redo event only depends on the spans either side of it, and
+//	only on the edge of each that touches the event's range - restoring an
+//	event swaps out everything between those two spans. So two spans may 
+//	be merged as long as no event's range starts or ends between them, and
+//	the merged span is the one (if either) that an event refers to.
+//
+//	Each call examines at most 'maxspans' spans, carrying on from where 
+//	the last call finished. Returns true while there is more to do
+//
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::compact(size_t maxspans)
 {
-	return replace(index, buf, length, length);
+	spanpins	pins;
+	idpins		pinids;
+	span	  *	sptr;
+	span	  *	last;
+	span	  *	keep;
+	size_w		spanindex;
+	size_w		runlen;
+	size_t		runcount;
+	size_t		count	= 0;
+	bool		changed = false;
+
+	compact_pins(pins, pinids);
+
+	if(compact_index >= sequence_length)
+		compact_index = 0;
+
+	if((sptr = spanfromindex(compact_index, &spanindex)) == 0)
+		return false;
+
+	for( ; sptr != tail && count < maxspans; spanindex += sptr->length, sptr = sptr->next, count++)
+	{
+		// absorb following spans that carry straight on from this one
+		while(sptr->next != tail && 
+			  sptr->next->buffer == sptr->buffer && 
+			  sptr->next->offset == sptr->offset + sptr->length &&
+			  compact_mergeable(sptr, sptr->next, pins, pinids))
+		{
+			span *next = sptr->next;
+
+			// keep whichever span the undo history refers to
+			if(compact_pinned(next, pins, pinids))
+			{
+				next->offset = sptr->offset;
+				tree_setlength(next, sptr->length + next->length);
+				deletefromsequence(&sptr);
+				sptr = next;
+			}
+			else
+			{
+				tree_setlength(sptr, sptr->length + next->length);
+				deletefromsequence(&next);
+			}
+
+			changed = true;
+			count++;
+		}
+
+		if(sptr->length >= COMPACT_SPANSIZE)
+			continue;
+
+		// find the run of small spans starting here. At most one of 
+		// them can be referred to by the undo history
+		keep	 = compact_pinned(sptr, pins, pinids) ? sptr : 0;
+		last	 = sptr;
+		runlen	 = sptr->length;
+		runcount = 1;
+
+		while(last->next != tail && 
+			  last->next->length < COMPACT_SPANSIZE && 
+			  runlen + last->next->length <= COMPACT_RUNSIZE &&
+			  compact_mergeable(last, last->next, pins, pinids))
+		{
+			if(compact_pinned(last->next, pins, pinids))
+			{
+				if(keep)
+					break;
+
+				keep = last->next;
+			}
+
+			last	= last->next;
+			runlen += last->length;
+			runcount++;
+		}
+
+		if(runcount >= COMPACT_MINRUN)
+		{
+			if(keep == 0)
+				keep = sptr;
+
+			if(!compact_run(sptr, last, keep, spanindex, runlen))
+				break;
+
+			sptr	 = keep;
+			changed  = true;
+			count	+= runcount - 1;
+		}
+	}
+
+	if(changed)
+	{
+		// spans that a coalesced edit would extend may have gone
+		breakopt();
+		release_buffers();
+	}
+
+	if(sptr == tail)
+	{
+		compact_index = 0;
+		return false;
+	}
+	else
+	{
+		compact_index = spanindex;
+		return true;
+	}
 }
 
 //
-//	sequence::replace
+//	sequence::compact_pins
 //
-//	overwrite with a single character-value
+//	collect the spans that the undo/redo events refer to: those either side
+//	of each event's range (by pointer, or by id for spilled events) and the 
+//	spans that the erase-optimization is tracking. Each is flagged with the
+//	edge(s) that must not move
 //
-bool sequence::replace (size_w index, const seqchar val)
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::compact_pins(spanpins &pins, idpins &pinids) const
 {
-	return replace(index, &val, 1);
+	std::vector<const eventstack *> stacks;
+
+	history(stacks);
+
+	for(size_t j = 0; j < stacks.size(); j++)
+	{
+		for(size_t i = 0; i < stacks[j]->size(); i++)
+		{
+			span_range *range = (*stacks[j])[i];
+
+			if(range->spilled)
+			{
+				pinids.push_back(std::make_pair(range->spill_prev, (int)PIN_END));
+				pinids.push_back(std::make_pair(range->spill_next, (int)PIN_START));
+			}
+			else if(range->boundary)
+			{
+				pins.push_back(std::make_pair(range->first, (int)PIN_END));
+				pins.push_back(std::make_pair(range->last,  (int)PIN_START));
+			}
+			else
+			{
+				pins.push_back(std::make_pair(range->first->prev, (int)PIN_END));
+				pins.push_back(std::make_pair(range->last->next,  (int)PIN_START));
+			}
+		}
+	}
+
+	pins.push_back(std::make_pair(frag1, PIN_START|PIN_END));
+	pins.push_back(std::make_pair(frag2, PIN_START|PIN_END));
+
+	std::sort(pins.begin(), pins.end());
+	std::sort(pinids.begin(), pinids.end());
 }
 
 //
-//	sequence::append
+//	sequence::compact_pinned
 //
-//	very simple wrapper around sequence::insert, just inserts at
-//  the end of the sequence
+//	return which edges of the span the undo history depends on
 //
-bool sequence::append (const seqchar *buf, size_w length)
+template <class CharT, class SizeT>
+int basic_sequence<CharT, SizeT>::compact_pinned(span *sptr, const spanpins &pins, const idpins &pinids) const
 {
-	return insert(size(), buf, length);
+	typename spanpins::const_iterator p;
+	idpins::const_iterator	 q;
+	int flags = 0;
+
+	p = std::lower_bound(pins.begin(), pins.end(), std::make_pair(sptr, 0));
+
+	for( ; p != pins.end() && p->first == sptr; ++p)
+		flags |= p->second;
+
+	q = std::lower_bound(pinids.begin(), pinids.end(), std::make_pair(sptr->id, 0));
+
+	for( ; q != pinids.end() && q->first == sptr->id; ++q)
+		flags |= q->second;
+
+	return flags;
 }
 
 //
-//	sequence::append
+//	sequence::compact_mergeable
 //
-//	append a single character to the sequence
+//	can the adjacent spans a+b become one?
 //
-bool sequence::append (const seqchar val)
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::compact_mergeable(span *a, span *b, const spanpins &pins, const idpins &pinids) const
 {
-	return append(&val, 1);
+	int fa = compact_pinned(a, pins, pinids);
+	int fb = compact_pinned(b, pins, pinids);
+
+	return (fa & PIN_END) == 0 && (fb & PIN_START) == 0 && !(fa && fb);
 }
 
 //
-//	sequence::clear
+//	sequence::compact_run
 //
-//	empty the entire sequence, clear undo/redo history etc
+//	replace the spans first..last (which start at 'index' and hold 'length'
+//	elements) with a single copy of their data in the modify-buffer. The 
+//	span 'keep' is reused for the copy, the others are deleted
 //
-bool sequence::clear ()
+template <class CharT, class SizeT>
+bool basic_sequence<CharT, SizeT>::compact_run(span *first, span *last, span *keep, size_w index, size_w length)
 {
-	span *sptr, *tmp;
-	
-	// delete all spans in the sequence
-	for(sptr = head->next; sptr != tail; sptr = tmp)
-	{
-		tmp = sptr->next;
-		delete sptr;
-	}
+	std::vector<seqchar> data((size_t)length + 1);
+	span  *	term = last->next;
+	span  *	sptr;
+	span  *	next;
+	size_t	modbuf_offset;
+	int		modbuf_id;
 
-	// re-link the head+tail
-	head->next = tail;
-	tail->prev = head;
+	render(index, &data[0], length);
 
-	// delete everything in the undo/redo stacks
-	clearstack(undostack);
-	clearstack(redostack);
+	if(!import_buffer(&data[0], (size_t)length, &modbuf_id, &modbuf_offset))
+		return false;
 
-	// delete all memory-buffers
-	for(size_t i = 0; i < buffer_list.size(); i++)
+	for(sptr = first; sptr != term; sptr = next)
 	{
-		delete[] buffer_list[i]->buffer;
-		delete   buffer_list[i];
+		next = sptr->next;
+
+		if(sptr != keep)
+			deletefromsequence(&sptr);
 	}
 
-	buffer_list.clear();
-	sequence_length = 0;
+	keep->buffer = modbuf_id;
+	keep->offset = modbuf_offset;
+	tree_setlength(keep, length);
+
 	return true;
 }
 
 //
-//	sequence::render
-//
-//	render the specified range of data (index, len) and store in 'dest'
+//	sequence::breakopt
 //
-//	Returns number of chars copied into destination
+//	Prevent subsequent operations from being optimized (coalesced) 
+//  with the last.
 //
-size_w sequence::render(size_w index, seqchar *dest, size_w length) const
+template <class CharT, class SizeT>
+void basic_sequence<CharT, SizeT>::breakopt()
 {
-	size_w spanoffset = 0;
-	size_w total = 0;
-	span  *sptr;
-
-	// find span to start rendering at
-	if((sptr = spanfromindex(index, &spanoffset)) == 0)
-		return false;
-
-	// might need to start mid-way through the first span
-	spanoffset = index - spanoffset;
-
-	// copy each span's referenced data in succession
-	while(length && sptr != tail)
-	{
-		size_w copylen   = min(sptr->length - spanoffset, length);
-		seqchar *source  = buffer_list[sptr->buffer]->buffer;
+	// only worth journalling when it changes what the next edit does
+	if(journal_file && lastaction != action_invalid)
+		journal_write(journal_breakopt, 0, 0, 0);
 
-		memcpy(dest, source + sptr->offset + spanoffset, copylen * sizeof(seqchar));
-		
-		dest	+= copylen;
-		length	-= copylen;
-		total	+= copylen;
-
-		sptr = sptr->next;
-		spanoffset = 0;
-	}
-
-	return total;
+	lastaction = action_invalid;
 }
-
 //
-//	sequence::peek
+//	seqpool::seqpool
 //
-//	return single element at specified position in the sequence
+//	nodes must be big enough to hold a free-list link, and are rounded up
+//	so that every node in a slab stays pointer-aligned
 //
-seqchar sequence::peek(size_w index) const
+seqpool::seqpool(size_t size)
 {
-	seqchar   value;
-	return render(index, &value, 1) ? value : 0;
+	size = max(size, sizeof(freenode));
+
+	nodesize = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	freelist = 0;
+	numlive  = 0;
+	numfree  = 0;
+}
+
+seqpool::~seqpool()
+{
+	release();
 }
 
 //
-//	sequence::poke
+//	seqpool::alloc
 //
-//	modify single element at specified position in the sequence
+//	take a node from the free-list, carving up a new slab when it runs dry.
+//	Slabs double in size (up to a limit) as the pool grows
 //
-bool sequence::poke(size_w index, seqchar value) 
+void *seqpool::alloc()
 {
-	return replace(index, &value, 1);
+	if(freelist == 0)
+	{
+		size_t count = slablist.size() < 8 ? (256 << slablist.size()) : 0x10000;
+		unsigned char *slab;
+
+		if((slab = new unsigned char[count * nodesize]) == 0)
+			return 0;
+
+		slablist.push_back(slab);
+
+		// thread the new nodes onto the free-list, lowest address first
+		for(size_t i = count; i > 0; i--)
+		{
+			freenode *node = (freenode *)(slab + (i - 1) * nodesize);
+			node->next = freelist;
+			freelist   = node;
+		}
+
+		numfree += count;
+	}
+
+	freenode *node = freelist;
+	freelist = node->next;
+
+	numfree--;
+	numlive++;
+
+	return node;
 }
 
 //
-//	sequence::operator[] const
+//	seqpool::free
 //
-//	readonly array access
+//	return a single node to the free-list
 //
-seqchar sequence::operator[] (size_w index) const
+void seqpool::free(void *ptr)
 {
-	return peek(index);
+	freenode *node = (freenode *)ptr;
+
+	node->next = freelist;
+	freelist   = node;
+
+	numlive--;
+	numfree++;
 }
 
 //
-//	sequence::operator[] 
+//	seqpool::release
 //
-//	read/write array access
+//	free every slab (and therefore every node) in one go
 //
-sequence::ref sequence::operator[] (size_w index)
+void seqpool::release()
 {
-	return ref(this, index);
+	for(size_t i = 0; i < slablist.size(); i++)
+		delete[] slablist[i];
+
+	slablist.clear();
+	freelist = 0;
+	numlive  = 0;
+	numfree  = 0;
 }
 
 //
-//	sequence::breakopt
-//
-//	Prevent subsequent operations from being optimized (coalesced) 
-//  with the last.
+//	compile the sequence for each of the element-types it supports
 //
-void sequence::breakopt()
-{
-	lastaction = action_invalid;
-}
\ No newline at end of file
+template class basic_sequence<BYTE,  size_w>;
+template class basic_sequence<WCHAR, size_w>;
+template class basic_sequence<ULONG, size_w>;
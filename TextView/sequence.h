@@ -2,50 +2,131 @@
 #define SEQUENCE_INCLUDED
 
 #include <vector>
+#include <map>
 
 //
-//	Define the underlying string/character type of the sequence.
+//	The sequence is a template over the type of element it holds and the
+//	type of its offsets: basic_sequence<CharT, SizeT>. This lets UTF-16 or
+//	UTF-32 text be stored natively, indexed by element rather than by byte.
 //
-//	'seqchar' can be redefined to BYTE, WCHAR, ULONG etc 
-//	depending on what kind of string you want your sequence to hold
+//	'seqchar' and 'size_w' are the types used by the default 'sequence'
 //
 typedef unsigned char	  seqchar;
 
+//
+//	Document offsets are 64bit by default so that files larger than 4Gb
+//	can be addressed. Define SEQUENCE32 to fall back to 32bit offsets
+//
+#ifndef SEQUENCE32
+#define SEQUENCE64
+#endif
+
 #ifdef SEQUENCE64
 typedef unsigned __int64  size_w;
 #else
 typedef unsigned long	  size_w;
 #endif
 
-const size_w MAX_SEQUENCE_LENGTH = ((size_w)(-1) / sizeof(seqchar));
+//
+//	seqpool
+//
+//	slab-allocator for the sequence's small fixed-size objects (spans and 
+//	span_ranges). Nodes are carved out of large slabs and recycled through
+//	a free-list, so editing doesn't touch the heap once the pool has warmed
+//	up. Every node is released at once when the pool is emptied
+//
+class seqpool
+{
+public:
+	seqpool(size_t size);
+	~seqpool();
+
+	void *	alloc();
+	void	free(void *ptr);
+	void	release();
+
+	size_t	livecount() const { return numlive; }
+	size_t	freecount() const { return numfree; }
+
+private:
+
+	struct freenode
+	{
+		freenode *next;
+	};
+
+	std::vector<unsigned char *> slablist;
+	freenode *	freelist;
+	size_t		nodesize;
+	size_t		numlive;
+	size_t		numfree;
+};
 
 //
 //	sequence class!
 //
-class sequence
+//	Member functions are defined in sequence.cpp, which instantiates the 
+//	template for 8bit (BYTE), 16bit (WCHAR) and 32bit (ULONG) elements
+//
+template <class CharT, class SizeT>
+class basic_sequence
 {
+public:
+	// within the sequence, these name its element and offset types
+	typedef CharT	seqchar;
+	typedef SizeT	size_w;
+
+	// the most elements a sequence can hold (a function, as VC6 won't
+	// initialise a static const member inside the class)
+	static size_w maxlength() { return (size_w)(-1) / sizeof(seqchar); }
+
+	friend class iterator;
+	friend class version;
+
 public:
 	// forward declare the nested helper-classes
 	class			span;
 	class			span_range;
 	class			buffer_control;
 	class			iterator;
+	class			version;
 	class			ref;
-	enum			action;
+	struct			edit;
+	struct			seqstats;
+
+	//
+	//	enumeration of the type of 'edit actions' our sequence supports.
+	//	only important when we try to 'optimize' repeated operations on the
+	//	sequence by coallescing them into a single span.
+	//
+	enum action
+	{ 
+		action_invalid, 
+		action_insert, 
+		action_erase, 
+		action_replace 
+	};
 
 public:
 
 	// sequence construction
-	sequence();
-	~sequence();
+	basic_sequence();
+	~basic_sequence();
 
 	//
 	// initialize with a file
 	//
 	bool		init();
 	bool		open(TCHAR *filename, bool readonly);
+	bool		open(HANDLE hFile);
 	bool		clear();
 
+	//
+	// saving to disk
+	//
+	bool		save(TCHAR *filename);
+	bool		quicksave(TCHAR *filename);
+
 	//
 	// initialize from an in-memory buffer
 	//
@@ -70,6 +151,7 @@ public:
 	bool		erase  (size_w index);
 	bool		append (const seqchar *buf, size_w len);
 	bool		append (const seqchar val);
+	bool		apply  (const edit *edits, size_t count);
 	void		breakopt();
 
 	//
@@ -83,21 +165,58 @@ public:
 	void		ungroup();
 	size_w		event_index() const  { return undoredo_index; }
 	size_w		event_length() const { return undoredo_length; }
+	void		event_range(size_w *index, size_w *erased, size_w *inserted) const;
+
+	//
+	// undo tree - every undo step is a numbered revision of the sequence
+	//
+	size_t		revision() const	  { return revision_current; }
+	size_t		savedrevision() const { return revision_saved; }
+	bool		gotorevision(size_t revision);
+
+	//
+	// undo history memory usage
+	//
+	void		undobudget(size_w maxbytes);
+	void		undostats(size_w *resident, size_w *spilled) const;
+
+	//
+	// crash-recovery journal
+	//
+	bool		journal(TCHAR *filename);
+	void		endjournal(bool discard);
 
 	// print out the sequence
 	void		debug1();
 	void		debug2();
 
+	// span/span_range node usage
+	void		nodestats(size_t *spans_live, size_t *spans_free, size_t *ranges_live, size_t *ranges_free) const;
+
+	// fragmentation and memory usage, for diagnostics
+	void		stats(seqstats *st) const;
+
+	//
+	// span-table maintenance, for when the application is idle
+	//
+	bool		compact(size_t maxspans);
+
 	//
 	// access and iteration
 	//
 	size_w		render(size_w index, seqchar *buf, size_w len) const;
+	iterator	iterate(size_w index) const;
 	seqchar		peek(size_w index) const;
 	bool		poke(size_w index, seqchar val);
 
 	seqchar		operator[] (size_w index) const;
 	ref			operator[] (size_w index);
 
+	//
+	// immutable snapshot of the sequence, for background readers
+	//
+	version *	snapshot() const;
+
 private:
 
 	typedef			std::vector<span_range*>	  eventstack;
@@ -113,18 +232,32 @@ private:
 	size_w			sequence_length;
 	span		*	head;
 	span		*	tail;	
+	span		*	root;
 	span		*	frag1;
 	span		*	frag2;
 
+	//
+	//	Span-tree (red-black tree indexing the span-list by position)
+	//
+	void			tree_insert(span *sptr);
+	void			tree_remove(span *sptr);
+	void			tree_link(span *first, span *last);
+	void			tree_unlink(span *first, span *last);
+	void			tree_setlength(span *sptr, size_w length);
+	void			tree_rotateleft(span *sptr);
+	void			tree_rotateright(span *sptr);
+	void			tree_transplant(span *oldspan, span *newspan);
+	void			tree_insertfixup(span *sptr);
+	void			tree_removefixup(span *sptr, span *parent);
 	
 	//
 	//	Undo and redo stacks
 	//
 	span_range *	initundo(size_w index, size_w length, action act);
 	void			restore_spanrange(span_range *range, bool undo_or_redo);
+	void			track_undoredo(span_range *range, bool undo_or_redo);
 	void			swap_spanrange(span_range *src, span_range *dest);
 	bool			undoredo(eventstack &source, eventstack &dest);
-	void			clearstack(eventstack &source);
 	span_range *	stackback(eventstack &source, size_t idx);
 
 	eventstack		undostack;
@@ -133,50 +266,181 @@ private:
 	size_t			group_refcount;
 	size_w			undoredo_index;
 	size_w			undoredo_length;
+	size_w			undoredo_oldlength;
+	size_w			undoredo_head;
+	size_w			undoredo_tail;
+
+	//
+	//	Undo tree - revisions are numbered in the order they were made, and
+	//	revision 0 is the sequence as it was loaded. The undostack is the 
+	//	path from revision 0 to the current revision and the redostack one
+	//	path onwards from it. Every other branch is kept aside, indexed by
+	//	its first revision, until it is needed
+	//
+	typedef			std::map<size_t, eventstack>  branchmap;
+
+	void			keepbranch();
+	bool			switchbranch(size_t revision);
+	void			history(std::vector<const eventstack *> &stacks) const;
+
+	std::vector<size_t> revision_parent;	// each revision's parent in the tree
+	size_t			revision_current;
+	size_t			revision_saved;		// the revision that matches the file on disk
+	branchmap		branches;
+
+	//
+	//	Undo history spilling - the oldest undo events are written out
+	//	to a temporary file when the history outgrows its memory budget
+	//
+	void			undo_trim();
+	size_w			eventsize(span_range *range) const;
+	bool			spill_event(span_range *range);
+	bool			unspill_event(span_range *range);
+	void			discard_spill();
+	void			release_buffers();
+	span		*	spanfromid(int id, size_w index) const;
+
+	HANDLE			spill_file;
+	size_w			spill_size;
+	size_t			spill_count;		// number of spilled events at the bottom of the undostack
+	size_w			undo_budget;
+	size_w			undo_resident;
+
+	//
+	//	Edit journal - every committed edit is appended to a file so that
+	//	the session can be rebuilt by replaying it over the original file
+	//
+	bool			journal_write(int type, const edit *edits, size_t count, size_t group);
+	bool			journal_replay(HANDLE hFile, size_w *validsize);
+	bool			journal_rebase();
+
+	HANDLE			journal_file;
+	TCHAR			journal_name[MAX_PATH];
+	size_w			journal_size;
+	size_t			journal_revbase;	// revisions journalled are numbered from here
+	size_w			base_length;		// identifies the file the journal applies to
+	FILETIME		base_time;
+
+	//
+	//	Span-table compaction
+	//
+	typedef			std::vector< std::pair<span *, int> >	spanpins;
+	typedef			std::vector< std::pair<int, int> >		idpins;
+
+	void			compact_pins(spanpins &pins, idpins &pinids) const;
+	int				compact_pinned(span *sptr, const spanpins &pins, const idpins &pinids) const;
+	bool			compact_mergeable(span *a, span *b, const spanpins &pins, const idpins &pinids) const;
+	bool			compact_run(span *first, span *last, span *keep, size_w index, size_w length);
+
+	size_w			compact_index;		// where the next compaction pass resumes
+
+	//
+	//	In-place saving
+	//
+	typedef			std::vector< std::pair<size_w, size_w> >	rangelist;
+
+	static void		addrange(rangelist &list, size_w start, size_w end);
+	bool			quicksave_write(HANDLE hFile, size_w index, size_w length);
+
+	int				filebuffer_id;		// buffer holding the file's mapped view
+	rangelist		file_written;		// parts of the file overwritten since it was mapped
+
+	//
+	//	Node allocation
+	//
+	seqpool			spanpool;
+	seqpool			rangepool;
 
 	//
 	//	File and memory buffer management
 	//
 	buffer_control *alloc_buffer(size_t size);
 	buffer_control *alloc_modifybuffer(size_t size);
-	bool			import_buffer(const seqchar *buf, size_t len, size_t *buffer_offset);
+	buffer_control *map_buffer(HANDLE hFile);
+	buffer_control *alloc_fillbuffer(seqchar val, size_w count);
+	static void		free_buffer(buffer_control *bc);
+	bool			import_buffer(const seqchar *buf, size_t len, int *buffer_id, size_t *buffer_offset);
+	size_w			spandata(const span *sptr, size_w spanoff, const seqchar **ptr) const;
+	void			debugspan(const span *sptr) const;
 
 	bufferlist		buffer_list;
 	int				modifybuffer_id;
 	int				modifybuffer_pos;
 
+	//
+	//	Import sharing - a large block imported again (the same clipboard
+	//	text pasted over and over) refers to the copy already made of it.
+	//	Blocks are indexed by (length, hash) and map to (buffer-id, offset)
+	//
+	typedef			std::multimap< std::pair<size_t, DWORD>, std::pair<int, size_t> >	importmap;
+
+	bool			import_lookup(const std::pair<size_t, DWORD> &key, const seqchar *buf, int *buffer_id, size_t *buffer_offset);
+
+	importmap		import_blocks;
+
 	//
 	//	Sequence manipulation
 	//
-	bool			insert_worker (size_w index, const seqchar *buf, size_w len, action act);
+	bool			insert_worker (size_w index, const seqchar *buf, size_w len, action act, bool fill = false);
 	bool			erase_worker  (size_w index, size_w len, action act);
+	bool			replace_worker(size_w index, const seqchar *buf, size_w len, size_w erase_length, bool fill);
 	bool			can_optimize  (action act, size_w index);
 	void			record_action (action act, size_w index);
 
 	size_w			lastaction_index;
 	action			lastaction;
 	bool			can_quicksave;
-	
-	void			LOCK();
-	void			UNLOCK();
-
+	DWORD			file_volume;		// identifies the file opened, so that quicksave
+	DWORD			file_indexhi;		// never writes its changes into a different one
+	DWORD			file_indexlo;
 
+	size_t			edit_count;			// edits made through insert_worker/erase_worker
+	size_t			coalesce_count;		// ...and how many of them extended the previous event
 };
 
 
 //
-//	sequence::action
+//	sequence::edit
+//
+//	a single change within a batch passed to sequence::apply. Every
+//	index refers to the sequence as it was *before* the batch is applied
+//
+template <class CharT, class SizeT>
+struct basic_sequence<CharT, SizeT>::edit
+{
+	size_w			index;			// where the change starts
+	size_w			erase_length;	// number of items removed at 'index'
+	const seqchar *	buf;			// items inserted in their place
+	size_w			length;			// number of items in 'buf'
+};
+
+//
+//	sequence::seqstats
 //
-//	enumeration of the type of 'edit actions' our sequence supports.
-//	only important when we try to 'optimize' repeated operations on the
-//	sequence by coallescing them into a single span.
+//	snapshot of the state of a sequence, returned by sequence::stats.
+//	Lengths are in elements, sizes are in bytes
 //
-enum sequence::action
-{ 
-	action_invalid, 
-	action_insert, 
-	action_erase, 
-	action_replace 
+template <class CharT, class SizeT>
+struct basic_sequence<CharT, SizeT>::seqstats
+{
+	size_w			length;			// length of the sequence
+	size_t			spans;			// spans in the span-table
+	size_w			avgspan;		// average span length
+
+	size_t			buffers;		// buffer_controls in use
+	size_w			heap_alloc;		// bytes allocated for heap buffers
+	size_w			heap_used;		// ...and how many of them hold data
+	size_w			mapped;			// bytes of file mapped into memory
+
+	size_t			undo_events;
+	size_t			redo_events;	// includes the other branches of the undo tree
+	size_w			undo_bytes;		// memory pinned by the undo history
+	size_w			undo_spilled;	// undo history held in the spill-file
+	size_w			redo_bytes;		// memory pinned by the redo history
+
+	size_t			edits;			// insert/erase operations made
+	size_t			coalesced;		// ...that were merged into the previous event
+	int				coalesce_rate;	// percentage of edits that were coalesced
 };
 
 //
@@ -184,10 +448,12 @@ enum sequence::action
 //
 //	private class to the sequence
 //
-class sequence::span
+template <class CharT, class SizeT>
+class basic_sequence<CharT, SizeT>::span
 {
-	friend class sequence;
+	friend class basic_sequence;
 	friend class span_range;
+	friend class iterator;
 	
 public:
 	// constructor
@@ -195,6 +461,11 @@ public:
 			:
 			next(nx), 
 			prev(pr),
+			parent(0),
+			left(0),
+			right(0),
+			subtree(len),
+			red(false),
 			offset(off), 
 			length(len), 
 			buffer(buf)
@@ -208,6 +479,12 @@ private:
 
 	span   *next;
 	span   *prev;	// double-link-list 
+
+	span   *parent;
+	span   *left;
+	span   *right;	// red-black tree, ordered by sequence position
+	size_w  subtree;	// total length of all spans in this sub-tree
+	bool	red;
 	
 	size_w  offset;
 	size_w  length;
@@ -226,9 +503,10 @@ private:
 //	the range of spans affected by an event (operation) on the sequence
 //  
 //
-class sequence::span_range
+template <class CharT, class SizeT>
+class basic_sequence<CharT, SizeT>::span_range
 {
-	friend class sequence;
+	friend class basic_sequence;
 
 public:
 
@@ -237,7 +515,6 @@ public:
 				size_w	idx    = 0, 
 				size_w	len    = 0, 
 				action	a      = action_invalid,
-				bool	qs     = false, 
 				size_t	id     = 0
 			) 
 		: 
@@ -248,31 +525,36 @@ public:
 		index(idx),
 		length(len),
 		act(a),
-		quicksave(qs),
-		group_id(id)
+		group_id(id),
+		revision(0),
+		memsize(0),
+		spilled(false),
+		spill_offset(0),
+		spill_prev(0),
+		spill_next(0)
 	{
 	}
 		
 	// destructor does nothing - because sometimes we don't want
 	// to free the contents when the span_range is deleted. e.g. when
 	// the span_range is just a temporary helper object. The contents
-	// must be deleted manually with span_range::free
+	// must be released manually with span_range::free
 	~span_range()
 	{
 	}
 
 	// separate 'destruction' used when appropriate
-	void free()
+	void free(seqpool &pool)
 	{
 		span *sptr, *next, *term;
 		
 		if(boundary == false)
 		{
-			// delete the range of spans
+			// return the range of spans to the pool
 			for(sptr = first, term = last->next; sptr && sptr != term; sptr = next)
 			{
 				next = sptr->next;
-				delete sptr;
+				pool.free(sptr);
 			}
 		}
 	}
@@ -362,8 +644,15 @@ private:
 	size_w	 index;
 	size_w	 length;
 	action	 act;
-	bool	 quicksave;
 	size_t	 group_id;
+	size_t	 revision;		// the undo step (revision) the event belongs to
+
+	// undo history accounting
+	size_w	 memsize;		// bytes counted against the undo budget
+	bool	 spilled;		// spans are held in the spill-file
+	size_w	 spill_offset;	// position of the event's record in the spill-file
+	int		 spill_prev;	// ids of the neighbouring spans while spilled
+	int		 spill_next;
 };
 
 //
@@ -372,10 +661,11 @@ private:
 //	temporary 'reference' to the sequence, used for
 //  non-const array access with sequence::operator[]
 //
-class sequence::ref
+template <class CharT, class SizeT>
+class basic_sequence<CharT, SizeT>::ref
 {
 public:
-	ref(sequence *s, size_w i) 
+	ref(basic_sequence *s, size_w i) 
 		:  
 		seq(s),  
 		index(i) 
@@ -395,25 +685,379 @@ public:
 
 private:
 	size_w		index;
-	sequence *	seq;
+	basic_sequence *seq;
 };
 
 //
 //	buffer_control
 //
-class sequence::buffer_control
+template <class CharT, class SizeT>
+class basic_sequence<CharT, SizeT>::buffer_control
 {
 public:
 	seqchar	*buffer;
 	size_w	 length;
 	size_w	 maxsize;
 	int		 id;
+	HANDLE	 hmapping;		// non-zero when 'buffer' is a read-only view of a file
+	LONG	 refcount;		// held by the sequence and by each snapshot using the buffer
+	TCHAR	*backup;		// the mapped file was moved here by a save - deleted with the view
+	bool	 fill;			// a single value repeated 'length' times. 'buffer' holds
+							// 'maxsize' copies of it, whatever the offset into the fill
 };
 
-class sequence::iterator
+//
+//	sequence::iterator
+//
+//	bidirectional iterator over the elements of a sequence. The iterator
+//	remembers which span it is positioned within, so stepping through the
+//	sequence costs O(1) per element instead of a span-lookup each time.
+//
+//	Any modification to the sequence invalidates all outstanding iterators
+//
+template <class CharT, class SizeT>
+class basic_sequence<CharT, SizeT>::iterator
 {
+	friend class basic_sequence;
+
 public:
+	iterator() 
+		: 
+		seq(0), 
+		sptr(0), 
+		spanoff(0), 
+		position(0) 
+	{
+	}
+
+	// return the element at the current position (zero at end-of-sequence)
+	seqchar operator* () const
+	{
+		if(sptr == seq->tail)
+			return 0;
+
+		const buffer_control *bc = seq->buffer_list[sptr->buffer];
+		return bc->fill ? bc->buffer[0] : bc->buffer[sptr->offset + spanoff];
+	}
+
+	iterator & operator++ ()
+	{
+		if(sptr != seq->tail)
+		{
+			position++;
+
+			if(++spanoff == sptr->length)
+				nextspan();
+		}
+
+		return *this;
+	}
 
+	iterator & operator-- ()
+	{
+		if(position > 0)
+		{
+			position--;
+
+			if(spanoff > 0)
+			{
+				spanoff--;
+			}
+			else
+			{
+				// skip back to the previous non-empty span
+				do
+				{
+					sptr = sptr->prev;
+				}
+				while(sptr->length == 0);
+
+				spanoff = sptr->length - 1;
+			}
+		}
+
+		return *this;
+	}
+
+	iterator & operator+= (size_w count)
+	{
+		// stay within the current span if possible
+		if(sptr != seq->tail && count < sptr->length - spanoff)
+		{
+			spanoff  += count;
+			position += count;
+		}
+		// stepping over the remainder of a chunk lands on the next span
+		else if(sptr != seq->tail && count == sptr->length - spanoff)
+		{
+			position += count;
+			nextspan();
+		}
+		else if(count > 0)
+		{
+			seek(position + count);
+		}
+
+		return *this;
+	}
+
+	iterator & operator-= (size_w count)
+	{
+		if(count <= spanoff)
+		{
+			spanoff  -= count;
+			position -= count;
+		}
+		else
+		{
+			seek(count < position ? position - count : 0);
+		}
+
+		return *this;
+	}
+
+	//
+	//	return a pointer directly into the span-memory at the current 
+	//	position, and the number of contiguous elements available there.
+	//	This lets callers process the sequence a span at a time without
+	//	copying anything:
+	//
+	//		while((len = itor.chunk(&ptr)) != 0) { ...; itor += len; }
+	//
+	size_w chunk(const seqchar **ptr) const
+	{
+		if(sptr == seq->tail)
+		{
+			*ptr = 0;
+			return 0;
+		}
+
+		return seq->spandata(sptr, spanoff, ptr);
+	}
+
+	size_w pos() const
+	{
+		return position;
+	}
+
+	bool atend() const
+	{
+		return sptr == seq->tail;
+	}
+
+	bool operator== (const iterator &itor) const
+	{
+		return seq == itor.seq && position == itor.position;
+	}
+
+	bool operator!= (const iterator &itor) const
+	{
+		return !(*this == itor);
+	}
+
+private:
+
+	iterator(const basic_sequence *s, size_w index)
+		:
+		seq(s)
+	{
+		seek(index);
+	}
+
+	// reposition the iterator with a span-tree lookup
+	void seek(size_w index)
+	{
+		size_w spanindex;
+
+		if(index > seq->size())
+			index = seq->size();
+
+		sptr	 = seq->spanfromindex(index, &spanindex);
+		spanoff  = index - spanindex;
+		position = index;
+	}
+
+	// move to the start of the next non-empty span
+	void nextspan()
+	{
+		do
+		{
+			sptr = sptr->next;
+		}
+		while(sptr != seq->tail && sptr->length == 0);
+
+		spanoff = 0;
+	}
+
+	const basic_sequence *seq;
+	span		   *sptr;
+	size_w			spanoff;
+	size_w			position;
 };
 
+//
+//	sequence::version
+//
+//	read-only copy of the sequence as it was when sequence::snapshot was 
+//	called. No text is copied: the version records where each span's data 
+//	lives and holds a reference to every buffer involved, so it stays valid
+//	however the sequence is edited (or even destroyed) afterwards. A version
+//	can be read on one thread while the sequence is modified on another.
+//
+//	Versions are reference-counted - call release() when finished with one
+//
+template <class CharT, class SizeT>
+class basic_sequence<CharT, SizeT>::version
+{
+	friend class basic_sequence;
+
+public:
+	class		iterator;
+	friend class iterator;
+
+	size_w		size() const { return length; }
+	size_w		render(size_w index, seqchar *buf, size_w len) const;
+	size_w		chunk(size_w index, const seqchar **ptr) const;
+	seqchar		peek(size_w index) const;
+	iterator	iterate(size_w index) const;
+
+	void		addref();
+	void		release();
+
+private:
+	version();
+	~version();
+
+	size_t		findpiece(size_w index) const;
+
+	struct piece
+	{
+		const seqchar *	data;
+		size_w			index;		// where the piece starts in the sequence
+		size_w			length;
+		size_w			repeat;		// for a fill, the length of the block at 'data'
+	};
+
+	std::vector<piece>				piecelist;
+	std::vector<buffer_control *>	bufferlist;
+	size_w							length;
+	LONG							refcount;
+};
+
+//
+//	sequence::version::iterator
+//
+//	forward iterator over the elements of a version, with the same reading
+//	interface as sequence::iterator - so code that scans text a chunk at
+//	a time can be written once for both. A version never changes, so its
+//	iterators stay valid until the version is released
+//
+template <class CharT, class SizeT>
+class basic_sequence<CharT, SizeT>::version::iterator
+{
+	friend class version;
+
+public:
+	iterator()
+		:
+		ver(0),
+		pieceno(0),
+		pieceoff(0),
+		position(0)
+	{
+	}
+
+	// return the element at the current position (zero at the end)
+	seqchar operator* () const
+	{
+		if(pieceno == ver->piecelist.size())
+			return 0;
+
+		const piece &p = ver->piecelist[pieceno];
+		return p.repeat ? p.data[0] : p.data[pieceoff];
+	}
+
+	iterator & operator++ ()
+	{
+		if(pieceno != ver->piecelist.size())
+		{
+			position++;
+
+			if(++pieceoff == ver->piecelist[pieceno].length)
+			{
+				pieceno++;
+				pieceoff = 0;
+			}
+		}
+
+		return *this;
+	}
+
+	iterator & operator+= (size_w count)
+	{
+		if(pieceno != ver->piecelist.size() && count < ver->piecelist[pieceno].length - pieceoff)
+		{
+			pieceoff += count;
+			position += count;
+		}
+		else if(count > 0)
+		{
+			seek(position + count);
+		}
+
+		return *this;
+	}
+
+	// see sequence::iterator::chunk
+	size_w chunk(const seqchar **ptr) const
+	{
+		return ver->chunk(position, ptr);
+	}
+
+	size_w pos() const
+	{
+		return position;
+	}
+
+	bool atend() const
+	{
+		return pieceno == ver->piecelist.size();
+	}
+
+private:
+
+	iterator(const version *v, size_w index)
+		:
+		ver(v)
+	{
+		seek(index);
+	}
+
+	void seek(size_w index)
+	{
+		if(index >= ver->length)
+		{
+			pieceno  = ver->piecelist.size();
+			pieceoff = 0;
+			position = ver->length;
+		}
+		else
+		{
+			pieceno  = ver->findpiece(index);
+			pieceoff = index - ver->piecelist[pieceno].index;
+			position = index;
+		}
+	}
+
+	const version  *ver;
+	size_t			pieceno;
+	size_w			pieceoff;
+	size_w			position;
+};
+
+//
+//	the default sequence, as used by the TextView
+//
+typedef basic_sequence<seqchar, size_w> sequence;
+
 #endif
\ No newline at end of file